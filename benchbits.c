@@ -0,0 +1,185 @@
+/*
+ * Time the bit kernels of bits.h against their portable versions,
+ * and the IPMap operations built on them: ipmapinsert(),
+ * ipmapfind() and ipmapnearest() reverse every key and count
+ * common bits at every node.  lib.c picks the builtins or the
+ * portable code when it is compiled, so the IPMap rows compare
+ * builds: run it once as built and once with -DNO_BIT_INTRINSICS
+ * added to CFLAGS.
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bits.h"
+#include "dat.h"
+#include "lib.h"
+#include "testlib.h"
+
+enum {
+	NWORDS = 1 << 16,
+	NPASSES = 1024,
+	DEFAULT_PREFIXES = 1000000,
+	NLOOKUPS = 4000000,
+	NROUNDS = 3,
+};
+
+static uint32_t seed = 44;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double
+ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+//
+// Run one kernel over every word NPASSES times.  Each sums its
+// results so that the loop cannot be optimised away.
+//
+#define KERNEL(fn)							\
+static uint64_t								\
+time##fn(const uint32_t *words, uint64_t *sum)				\
+{									\
+	uint64_t start = nanotime();					\
+									\
+	for (int pass = 0; pass < NPASSES; pass++)			\
+		for (size_t k = 0; k < NWORDS; k++)			\
+			*sum += fn(words[k]);				\
+	return nanotime() - start;					\
+}
+
+KERNEL(ctz32)
+KERNEL(softctz32)
+KERNEL(clz32)
+KERNEL(softclz32)
+KERNEL(pop32)
+KERNEL(softpop32)
+KERNEL(brev32)
+KERNEL(softbrev32)
+
+typedef struct Kernel Kernel;
+struct Kernel {
+	const char *name;
+	uint64_t (*hard)(const uint32_t *, uint64_t *);
+	uint64_t (*soft)(const uint32_t *, uint64_t *);
+};
+
+static const Kernel kernels[] = {
+	{ "ctz32", timectz32, timesoftctz32 },
+	{ "clz32", timeclz32, timesoftclz32 },
+	{ "pop32", timepop32, timesoftpop32 },
+	{ "brev32", timebrev32, timesoftbrev32 },
+};
+
+static size_t
+rndkeylen(void)
+{
+	uint32_t r = rnd() % 100;
+
+	if (r < 60)
+		return 24;
+	if (r < 95)
+		return 16 + rnd() % 8;
+	if (r < 98)
+		return 8 + rnd() % 8;
+	return 25 + rnd() % 8;
+}
+
+static void
+benchipmap(size_t n)
+{
+	uint64_t best[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+	IPMapEntry *entries;
+	uint32_t *addrs;
+	size_t hits = 0;
+
+	entries = calloc(n, sizeof(*entries));
+	addrs = calloc(NLOOKUPS, sizeof(*addrs));
+	if (entries == NULL || addrs == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t k = 0; k < n; k++) {
+		entries[k].keylen = rndkeylen();
+		entries[k].key = rnd() & ~(0xFFFFFFFF >> entries[k].keylen);
+		entries[k].datum = &entries[k];
+	}
+	for (size_t k = 0; k < NLOOKUPS; k++)
+		addrs[k] = rnd();
+
+	for (int round = 0; round < NROUNDS; round++) {
+		IPMap *map = mkipmap();
+		uint64_t t[3], start;
+
+		start = nanotime();
+		for (size_t k = 0; k < n; k++)
+			ipmapinsert(map, entries[k].key, entries[k].keylen,
+			    entries[k].datum);
+		t[0] = nanotime() - start;
+		start = nanotime();
+		for (size_t k = 0; k < n; k++)
+			if (ipmapfind(map, entries[k].key,
+			    entries[k].keylen) != NULL)
+				hits++;
+		t[1] = nanotime() - start;
+		start = nanotime();
+		for (size_t k = 0; k < NLOOKUPS; k++)
+			if (ipmapnearest(map, addrs[k], 32) != NULL)
+				hits++;
+		t[2] = nanotime() - start;
+		freeipmap(map, nofree);
+		for (int k = 0; k < 3; k++)
+			if (t[k] < best[k])
+				best[k] = t[k];
+	}
+	printf("\n%zu prefixes, %d nearest lookups, best of %d (%zu hits)\n",
+	    n, NLOOKUPS, NROUNDS, hits);
+	printf("%-12s %11.1f ms\n", "ipmapinsert", ms(best[0]));
+	printf("%-12s %11.1f ms\n", "ipmapfind", ms(best[1]));
+	printf("%-12s %11.1f ms\n", "ipmapnearest", ms(best[2]));
+	free(entries);
+	free(addrs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = DEFAULT_PREFIXES;
+	uint32_t *words;
+	uint64_t sum = 0;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	words = calloc(NWORDS, sizeof(*words));
+	if (words == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (size_t k = 0; k < NWORDS; k++)
+		words[k] = rnd() | 1U << (rnd() % 32);
+
+	printf("%d calls of each kernel\n", NWORDS*NPASSES);
+	printf("%-12s %11s %11s\n", "", "builtin ms", "portable ms");
+	for (size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+		uint64_t hard = kernels[k].hard(words, &sum);
+		uint64_t soft = kernels[k].soft(words, &sum);
+		printf("%-12s %11.1f %11.1f\n", kernels[k].name, ms(hard),
+		    ms(soft));
+	}
+	free(words);
+	if (sum == 0)
+		printf("\n");
+	benchipmap(n);
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Time interface number allocation under churn.  A Bitvec is
+ * filled with 'n' interfaces, as at start-up, and then tunnels come
+ * and go: each step frees the interface of a random live tunnel,
+ * as collapse() does, and allocates one for a new tunnel, as
+ * alloctunif() does.
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dat.h"
+#include "lib.h"
+
+enum {
+	NCHURN = 1000000,
+	NROUNDS = 3,
+};
+
+static const size_t sizes[] = { 1000, 10000, 100000 };
+
+static uint32_t seed = 44;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static size_t
+alloc(Bitvec *bits)
+{
+	size_t ifnum = nextbit(bits);
+
+	bitset(bits, ifnum);
+	return ifnum;
+}
+
+static void
+run(size_t n, size_t *live)
+{
+	uint64_t fill = UINT64_MAX, churn = UINT64_MAX;
+	size_t sum = 0;
+
+	for (int round = 0; round < NROUNDS; round++) {
+		Bitvec *bits = mkbitvec();
+		uint64_t start, t;
+
+		start = nanotime();
+		for (size_t k = 0; k < n; k++)
+			live[k] = alloc(bits);
+		t = nanotime() - start;
+		if (t < fill)
+			fill = t;
+		start = nanotime();
+		for (size_t k = 0; k < NCHURN; k++) {
+			size_t victim = rnd() % n;
+			bitclr(bits, live[victim]);
+			live[victim] = alloc(bits);
+			sum += live[victim];
+		}
+		t = nanotime() - start;
+		if (t < churn)
+			churn = t;
+		freebitvec(bits);
+	}
+	printf("%-10zu %12.1f %12.1f %12.1f\n", n, fill / 1e3,
+	    (double)churn / NCHURN, (double)sum / NROUNDS / NCHURN);
+}
+
+int
+main(void)
+{
+	size_t nsizes = sizeof(sizes)/sizeof(sizes[0]);
+	size_t *live;
+
+	live = calloc(sizes[nsizes - 1], sizeof(*live));
+	if (live == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	printf("%d frees and allocations, best of %d\n", NCHURN, NROUNDS);
+	printf("%-10s %12s %12s %12s\n", "tunnels", "fill us", "churn ns/op",
+	    "mean ifnum");
+	for (size_t k = 0; k < nsizes; k++)
+		run(sizes[k], live);
+	free(live);
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Time a mass expiry: every route in the table times out at once,
+ * as after a long outage of the RIP source, and is destroyed the
+ * way destroy() does it, in the order walkexpired() finds them.
+ * The total number of routes is fixed and spread over fewer,
+ * busier tunnels in each row, so that the cost of taking a route
+ * off its tunnel's list shows up as the lists get longer.
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "testlib.h"
+
+enum {
+	DEFAULT_ROUTES = 100000,
+	NROUNDS = 3,
+};
+
+static const size_t perhub[] = { 1, 10, 100, 1000, 10000 };
+
+static uint32_t seed = 44;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+typedef struct Expiry Expiry;
+struct Expiry {
+	Route **routes;
+	size_t n;
+};
+
+static int
+collect(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Expiry *e = arg;
+
+	e->routes[e->n++] = datum;
+	return 0;
+}
+
+static void
+run(size_t n, size_t per, Route *routes, Route **order)
+{
+	size_t ntunnels = (n + per - 1) / per;
+	uint64_t best = UINT64_MAX;
+	size_t collapsed = 0;
+	Tunnel *tunnels;
+
+	tunnels = calloc(ntunnels, sizeof(*tunnels));
+	if (tunnels == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int round = 0; round < NROUNDS; round++) {
+		IPMap *map = mkipmap();
+		Expiry e = { order, 0 };
+		uint64_t start, t;
+
+		for (size_t k = 0; k < ntunnels; k++)
+			tunnels[k].outer_remote = 0x0A000000 + k;
+		for (size_t k = 0; k < n; k++) {
+			Route *route = &routes[k];
+			route->ipnet = 0x2C000000 + ((uint32_t)k << 8);
+			route->subnetmask = 0xFFFFFF00;
+			route->rprev = NULL;
+			route->rnext = NULL;
+			ipmapinsert(map, route->ipnet, 24, route);
+			linkroute(&tunnels[rnd() % ntunnels], route);
+		}
+		ipmapdo(map, collect, &e);
+
+		start = nanotime();
+		collapsed = 0;
+		for (size_t k = 0; k < e.n; k++) {
+			Route *route = e.routes[k];
+			Tunnel *tunnel = route->tunnel;
+			ipmapremove(map, route->ipnet, 24);
+			unlinkroute(tunnel, route);
+			if (tunnel->nref == 0)
+				collapsed++;
+		}
+		t = nanotime() - start;
+		if (t < best)
+			best = t;
+		freeipmap(map, nofree);
+	}
+	printf("%-10zu %-10zu %12.1f %12.1f %10zu\n", per, ntunnels,
+	    best / 1e6, (double)best / n, collapsed);
+	free(tunnels);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = DEFAULT_ROUTES;
+	Route *routes, **order;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	routes = calloc(n, sizeof(*routes));
+	order = calloc(n, sizeof(*order));
+	if (routes == NULL || order == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	printf("%zu routes expiring, best of %d\n", n, NROUNDS);
+	printf("%-10s %-10s %12s %12s %10s\n", "per hub", "tunnels",
+	    "expiry ms", "ns/route", "collapsed");
+	for (size_t k = 0; k < sizeof(perhub)/sizeof(perhub[0]); k++)
+		if (perhub[k] <= n)
+			run(n, perhub[k], routes, order);
+	free(routes);
+	free(order);
+
+	return 0;
+}
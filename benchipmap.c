@@ -0,0 +1,382 @@
+/*
+ * Compare building a full-table-sized IPMap with ipmapbuild()
+ * against inserting the same prefixes one at a time, and both
+ * against a typed map from ipmapt.h and a Tree Bitmap from tbm.h,
+ * timing lookups, updates and a full walk of each result.  An
+ * update removes a prefix and puts it back.
+ *
+ * The prefixes are random, with a length mix roughly like the
+ * global table's: most are /24s, most of the rest /16 to /23.
+ */
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "ipmapt.h"
+#include "lib.h"
+#include "tbm.h"
+#include "testlib.h"
+
+IPMAP_DEFINE(benchmap, void *)
+IPMAP_DEFINE(benchset, uint8_t)
+
+enum {
+	DEFAULT_PREFIXES = 1000000,
+	NLOOKUPS = 4000000,
+	NUPDATES = 1000000,
+	NROUNDS = 3,
+};
+
+static uint32_t seed = 44;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static size_t
+rndkeylen(void)
+{
+	uint32_t r = rnd() % 100;
+
+	if (r < 60)
+		return 24;
+	if (r < 95)
+		return 16 + rnd() % 8;
+	if (r < 98)
+		return 8 + rnd() % 8;
+	return 25 + rnd() % 8;
+}
+
+static double
+ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+//
+// Nearest-match lookups of random addresses, and walks summing the
+// key lengths; each returns its result, so that the loop cannot be
+// optimised away.
+//
+static size_t
+lookups(IPMap *map, const uint32_t *addrs, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	size_t hits = 0;
+
+	for (size_t k = 0; k < NLOOKUPS; k++)
+		if (ipmapnearest(map, addrs[k], 32) != NULL)
+			hits++;
+	*ns = nanotime() - start;
+
+	return hits;
+}
+
+static size_t
+typedlookups(benchmap *map, const uint32_t *addrs, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	size_t hits = 0;
+
+	for (size_t k = 0; k < NLOOKUPS; k++)
+		if (benchmapnearest(map, addrs[k], 32) != NULL)
+			hits++;
+	*ns = nanotime() - start;
+
+	return hits;
+}
+
+static size_t
+tbmlookups(TBMap *map, const uint32_t *addrs, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	size_t hits = 0;
+
+	for (size_t k = 0; k < NLOOKUPS; k++)
+		if (tbmapnearest(map, addrs[k], 32) != NULL)
+			hits++;
+	*ns = nanotime() - start;
+
+	return hits;
+}
+
+static int
+sumlen(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	*(size_t *)arg += keylen;
+	return 0;
+}
+
+static size_t
+walk(IPMap *map, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	size_t sum = 0;
+
+	ipmapdotopdown(map, sumlen, &sum);
+	*ns = nanotime() - start;
+
+	return sum;
+}
+
+static size_t
+typedwalk(benchmap *map, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	benchmapiter it;
+	size_t sum = 0;
+
+	for (benchmapwalk(map, &it); benchmapnext(&it);)
+		sum += it.keylen;
+	*ns = nanotime() - start;
+
+	return sum;
+}
+
+static size_t
+tbmwalk(TBMap *map, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	size_t sum = 0;
+
+	tbmapdo(map, sumlen, &sum);
+	*ns = nanotime() - start;
+
+	return sum;
+}
+
+static size_t
+setlookups(benchset *set, const uint32_t *addrs, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	size_t hits = 0;
+
+	for (size_t k = 0; k < NLOOKUPS; k++)
+		if (benchsetnearest(set, addrs[k], 32) != NULL)
+			hits++;
+	*ns = nanotime() - start;
+
+	return hits;
+}
+
+static size_t
+setwalk(benchset *set, uint64_t *ns)
+{
+	uint64_t start = nanotime();
+	benchsetiter it;
+	size_t sum = 0;
+
+	for (benchsetwalk(set, &it); benchsetnext(&it);)
+		sum += it.keylen;
+	*ns = nanotime() - start;
+
+	return sum;
+}
+
+enum {
+	INSERT,
+	BUILD,
+	TYPED,
+	TYPEDSET,
+	TREEBITMAP,
+	NMETHODS,
+};
+
+enum {
+	NCOLUMNS = 5,	// Build, lookup, update, walk, free.
+};
+
+static const char *methods[NMETHODS] = {
+	[INSERT] = "insert",
+	[BUILD] = "build",
+	[TYPED] = "typed",
+	[TYPEDSET] = "typed u8",
+	[TREEBITMAP] = "tree bitmap",
+};
+
+//
+// Remove and put back NUPDATES of the prefixes, cycling through
+// them.
+//
+static void
+updates(int method, void *map, const IPMapEntry *entries, size_t n,
+    uint64_t *ns)
+{
+	uint64_t start = nanotime();
+
+	for (size_t k = 0; k < NUPDATES && n > 0; k++) {
+		const IPMapEntry *e = &entries[k % n];
+		switch (method) {
+		case INSERT:
+		case BUILD:
+			ipmapremove(map, e->key, e->keylen);
+			ipmapinsert(map, e->key, e->keylen, e->datum);
+			break;
+		case TYPED:
+			benchmapremove(map, e->key, e->keylen, NULL);
+			benchmapinsert(map, e->key, e->keylen, e->datum);
+			break;
+		case TYPEDSET:
+			benchsetremove(map, e->key, e->keylen, NULL);
+			benchsetinsert(map, e->key, e->keylen, 1);
+			break;
+		case TREEBITMAP:
+			tbmapremove(map, e->key, e->keylen);
+			tbmapinsert(map, e->key, e->keylen, e->datum);
+			break;
+		}
+	}
+	*ns = nanotime() - start;
+}
+
+//
+// Time one way of holding the table, best of NROUNDS, and print a
+// row of results.
+//
+static void
+run(int method, const IPMapEntry *entries, IPMapEntry *copy, size_t n,
+    const uint32_t *addrs)
+{
+	uint64_t best[NCOLUMNS];
+
+	for (int k = 0; k < NCOLUMNS; k++)
+		best[k] = UINT64_MAX;
+	for (int round = 0; round < NROUNDS; round++) {
+		uint64_t t[NCOLUMNS], start;
+		benchmap *typed = NULL;
+		benchset *set = NULL;
+		IPMap *map = NULL;
+		TBMap *tbm = NULL;
+
+		memcpy(copy, entries, n*sizeof(*copy));
+		start = nanotime();
+		switch (method) {
+		case INSERT:
+			map = mkipmap();
+			for (size_t k = 0; k < n; k++)
+				ipmapinsert(map, copy[k].key, copy[k].keylen,
+				    copy[k].datum);
+			break;
+		case BUILD:
+			map = mkipmap();
+			ipmapbuild(map, copy, n);
+			break;
+		case TYPED:
+			typed = mkbenchmap();
+			for (size_t k = 0; k < n; k++)
+				benchmapinsert(typed, copy[k].key,
+				    copy[k].keylen, copy[k].datum);
+			break;
+		case TYPEDSET:
+			set = mkbenchset();
+			for (size_t k = 0; k < n; k++)
+				benchsetinsert(set, copy[k].key,
+				    copy[k].keylen, 1);
+			break;
+		case TREEBITMAP:
+			tbm = mktbmap();
+			for (size_t k = 0; k < n; k++)
+				tbmapinsert(tbm, copy[k].key, copy[k].keylen,
+				    copy[k].datum);
+			break;
+		}
+		t[0] = nanotime() - start;
+		if (typed != NULL) {
+			typedlookups(typed, addrs, &t[1]);
+			updates(method, typed, copy, n, &t[2]);
+			typedwalk(typed, &t[3]);
+			start = nanotime();
+			freebenchmap(typed);
+		} else if (set != NULL) {
+			setlookups(set, addrs, &t[1]);
+			updates(method, set, copy, n, &t[2]);
+			setwalk(set, &t[3]);
+			start = nanotime();
+			freebenchset(set);
+		} else if (tbm != NULL) {
+			tbmlookups(tbm, addrs, &t[1]);
+			updates(method, tbm, copy, n, &t[2]);
+			tbmwalk(tbm, &t[3]);
+			start = nanotime();
+			freetbmap(tbm, nofree);
+		} else {
+			lookups(map, addrs, &t[1]);
+			updates(method, map, copy, n, &t[2]);
+			walk(map, &t[3]);
+			start = nanotime();
+			freeipmap(map, nofree);
+		}
+		t[4] = nanotime() - start;
+		for (int k = 0; k < NCOLUMNS; k++)
+			if (t[k] < best[k])
+				best[k] = t[k];
+	}
+	printf("%-12s", methods[method]);
+	for (int k = 0; k < NCOLUMNS; k++)
+		printf(" %11.1f", ms(best[k]));
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = DEFAULT_PREFIXES;
+	IPMapEntry *entries, *copy;
+	uint32_t *addrs;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	entries = calloc(n, sizeof(*entries));
+	copy = calloc(n, sizeof(*copy));
+	addrs = calloc(NLOOKUPS, sizeof(*addrs));
+	if (entries == NULL || copy == NULL || addrs == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (size_t k = 0; k < n; k++) {
+		entries[k].keylen = rndkeylen();
+		entries[k].key = rnd() & ~(0xFFFFFFFF >> entries[k].keylen);
+		entries[k].datum = &entries[k];
+	}
+	for (size_t k = 0; k < NLOOKUPS; k++)
+		addrs[k] = rnd();
+
+	printf("%zu prefixes, %d lookups, %d updates, best of %d\n", n,
+	    NLOOKUPS, NUPDATES, NROUNDS);
+	printf("%-12s %11s %11s %11s %11s %11s\n", "", "build ms",
+	    "lookup ms", "update ms", "walk ms", "free ms");
+	fflush(stdout);
+
+	// Each in a fresh process, so none inherits another's heap.
+	for (int method = 0; method < NMETHODS; method++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			run(method, entries, copy, n, addrs);
+			fflush(stdout);
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+
+	free(entries);
+	free(copy);
+	free(addrs);
+
+	return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Compare routes and tunnels allocated one by one with calloc(),
+ * each route holding its own expiry time, as they were, against
+ * routes and tunnels from slabs, with the expiry times in the route
+ * slab's hot arrays.  For each it times building the tables, the
+ * expiry scan that walkexpired() makes after every RIP packet when
+ * nothing has expired, and a refresh of every route in random order
+ * as a RIP cycle does it.  The scan and the refresh are timed with
+ * the caches warm, and cold after streaming through a large buffer,
+ * which is where the cache misses saved show up.  It also prints
+ * the bytes each scan reads.
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "slab.h"
+#include "testlib.h"
+
+enum {
+	DEFAULT_ROUTES = 10000,
+	ROUTESPERTUNNEL = 4,
+	NROUNDS = 5,
+	EVICTBYTES = 64 << 20,
+	TIMEOUT = 3600,
+	NOW = 1000000,
+};
+
+enum {
+	BUILD,
+	SCAN,
+	COLDSCAN,
+	REFRESH,
+	COLDREFRESH,
+	NCOLUMNS,
+};
+
+//
+// A route as it was: the expiry time among the other fields.
+//
+typedef struct OldRoute OldRoute;
+struct OldRoute {
+	uint32_t ipnet;
+	uint32_t subnetmask;
+	uint32_t gateway;
+	time_t expires;
+	OldRoute *rnext;
+	OldRoute **rprev;
+	Tunnel *tunnel;
+};
+
+typedef struct Net Net;
+struct Net {
+	uint32_t ipnet;
+	size_t cidr;
+	uint32_t gateway;
+};
+
+static uint32_t seed = 44;
+
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static volatile unsigned char *evictbuf;
+
+static void
+evict(void)
+{
+	for (size_t k = 0; k < EVICTBYTES; k += 64)
+		evictbuf[k]++;
+}
+
+//
+// The state of one model: the tables, and whatever holds the
+// objects.
+//
+typedef struct Model Model;
+struct Model {
+	IPMap *routes;
+	IPMap *tunnels;
+	Slab *routeslab;
+	Slab *tunnelslab;
+	void **objs;		// For freeing the calloc()ed ones.
+	size_t nobjs;
+	time_t nextexpiry;
+};
+
+static Tunnel *
+oldtunnel(Model *m, uint32_t gateway)
+{
+	Tunnel *tunnel = ipmapfind(m->tunnels, gateway, 32);
+
+	if (tunnel == NULL) {
+		tunnel = calloc(1, sizeof(*tunnel));
+		if (tunnel == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		tunnel->outer_remote = gateway;
+		ipmapinsert(m->tunnels, gateway, 32, tunnel);
+		m->objs[m->nobjs++] = tunnel;
+	}
+	return tunnel;
+}
+
+static void
+oldbuild(Model *m, const Net *nets, size_t n)
+{
+	for (size_t k = 0; k < n; k++) {
+		Tunnel *tunnel = oldtunnel(m, nets[k].gateway);
+		OldRoute *route = calloc(1, sizeof(*route));
+
+		if (route == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		route->ipnet = nets[k].ipnet;
+		route->gateway = nets[k].gateway;
+		route->tunnel = tunnel;
+		route->expires = NOW + TIMEOUT + k % TIMEOUT;
+		ipmapinsert(m->routes, nets[k].ipnet, nets[k].cidr, route);
+		m->objs[m->nobjs++] = route;
+	}
+}
+
+static int
+oldexpire(uint32_t key, size_t keylen, void *routep, void *arg)
+{
+	OldRoute *route = routep;
+	Model *m = arg;
+
+	if (route->expires > NOW) {
+		if (m->nextexpiry == 0 || route->expires < m->nextexpiry)
+			m->nextexpiry = route->expires;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+oldscan(Model *m)
+{
+	m->nextexpiry = 0;
+	ipmapdo(m->routes, oldexpire, m);
+}
+
+static size_t
+oldrefresh(Model *m, const Net *nets, const size_t *order, size_t n)
+{
+	size_t moved = 0;
+
+	for (size_t k = 0; k < n; k++) {
+		const Net *net = &nets[order[k]];
+		Tunnel *tunnel = ipmapfind(m->tunnels, net->gateway, 32);
+		OldRoute *route = ipmapfind(m->routes, net->ipnet, net->cidr);
+
+		if (route->tunnel != tunnel)
+			moved++;
+		route->expires = NOW + 2*TIMEOUT;
+	}
+	return moved;
+}
+
+static void
+oldfree(Model *m)
+{
+	freeipmap(m->routes, nofree);
+	freeipmap(m->tunnels, nofree);
+	for (size_t k = 0; k < m->nobjs; k++)
+		free(m->objs[k]);
+}
+
+static Tunnel *
+newtunnel(Model *m, uint32_t gateway)
+{
+	Tunnel *tunnel = ipmapfind(m->tunnels, gateway, 32);
+
+	if (tunnel == NULL) {
+		tunnel = slaballoc(m->tunnelslab);
+		tunnel->outer_remote = gateway;
+		ipmapinsert(m->tunnels, gateway, 32, tunnel);
+	}
+	return tunnel;
+}
+
+static void
+newbuild(Model *m, const Net *nets, size_t n)
+{
+	m->routeslab = mkslab(sizeof(Route), sizeof(time_t));
+	m->tunnelslab = mkslab(sizeof(Tunnel), 0);
+	for (size_t k = 0; k < n; k++) {
+		Tunnel *tunnel = newtunnel(m, nets[k].gateway);
+		Route *route = slaballoc(m->routeslab);
+
+		route->ipnet = nets[k].ipnet;
+		route->gateway = nets[k].gateway;
+		route->tunnel = tunnel;
+		setrouteexpires(route, NOW + TIMEOUT + k % TIMEOUT);
+		ipmapinsert(m->routes, nets[k].ipnet, nets[k].cidr, route);
+	}
+}
+
+static int
+newexpire(void *expiresp, void *routep, void *arg)
+{
+	time_t expires = *(time_t *)expiresp;
+	Model *m = arg;
+
+	if (expires > NOW) {
+		if (m->nextexpiry == 0 || expires < m->nextexpiry)
+			m->nextexpiry = expires;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+newscan(Model *m)
+{
+	m->nextexpiry = 0;
+	slabscan(m->routeslab, newexpire, m);
+}
+
+static size_t
+newrefresh(Model *m, const Net *nets, const size_t *order, size_t n)
+{
+	size_t moved = 0;
+
+	for (size_t k = 0; k < n; k++) {
+		const Net *net = &nets[order[k]];
+		Tunnel *tunnel = ipmapfind(m->tunnels, net->gateway, 32);
+		Route *route = ipmapfind(m->routes, net->ipnet, net->cidr);
+
+		if (route->tunnel != tunnel)
+			moved++;
+		setrouteexpires(route, NOW + 2*TIMEOUT);
+	}
+	return moved;
+}
+
+static void
+newfree(Model *m)
+{
+	freeipmap(m->routes, nofree);
+	freeipmap(m->tunnels, nofree);
+	freeslab(m->routeslab);
+	freeslab(m->tunnelslab);
+}
+
+typedef struct Impl Impl;
+struct Impl {
+	const char *name;
+	void (*build)(Model *, const Net *, size_t);
+	void (*scan)(Model *);
+	size_t (*refresh)(Model *, const Net *, const size_t *, size_t);
+	void (*free)(Model *);
+};
+
+static const Impl impls[] = {
+	{ "calloc", oldbuild, oldscan, oldrefresh, oldfree },
+	{ "slab", newbuild, newscan, newrefresh, newfree },
+};
+
+static void
+since(uint64_t start, uint64_t *best)
+{
+	uint64_t t = nanotime() - start;
+
+	if (t < *best)
+		*best = t;
+}
+
+static void
+run(const Impl *impl, const Net *nets, const size_t *order, size_t n,
+    void **objs)
+{
+	uint64_t best[NCOLUMNS];
+	size_t moved = 0, scanbytes = 0;
+	time_t nextexpiry = 0;
+
+	for (int k = 0; k < NCOLUMNS; k++)
+		best[k] = UINT64_MAX;
+	for (int round = 0; round < NROUNDS; round++) {
+		Model m;
+		IPMapStats stats;
+		uint64_t start;
+
+		memset(&m, 0, sizeof(m));
+		m.routes = mkipmap();
+		m.tunnels = mkipmap();
+		m.objs = objs;
+		start = nanotime();
+		impl->build(&m, nets, n);
+		since(start, &best[BUILD]);
+
+		impl->scan(&m);
+		start = nanotime();
+		impl->scan(&m);
+		since(start, &best[SCAN]);
+		evict();
+		start = nanotime();
+		impl->scan(&m);
+		since(start, &best[COLDSCAN]);
+		nextexpiry = m.nextexpiry;
+
+		start = nanotime();
+		moved += impl->refresh(&m, nets, order, n);
+		since(start, &best[REFRESH]);
+		evict();
+		start = nanotime();
+		moved += impl->refresh(&m, nets, order, n);
+		since(start, &best[COLDREFRESH]);
+
+		if (m.routeslab != NULL) {
+			Slab *s = m.routeslab;
+			scanbytes = s->npages *
+			    (s->hotoff + s->nperpage*s->hotsize);
+		} else {
+			ipmapstats(m.routes, &stats);
+			scanbytes = stats.bytes + n*sizeof(OldRoute);
+		}
+		impl->free(&m);
+	}
+	printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f %10zu\n", impl->name,
+	    best[BUILD] / 1e3, best[SCAN] / 1e3, best[COLDSCAN] / 1e3,
+	    best[REFRESH] / 1e3, best[COLDREFRESH] / 1e3, scanbytes);
+	if (moved != 0 || nextexpiry != NOW + TIMEOUT)
+		printf("%s: %zu moved, next expiry %lld\n", impl->name, moved,
+		    (long long)nextexpiry);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t n = DEFAULT_ROUTES;
+	IPMap *seen;
+	Net *nets;
+	size_t *order;
+	void **objs;
+	Slab *routeslab, *tunnelslab;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+	if (n == 0)
+		n = 1;
+	nets = calloc(n, sizeof(*nets));
+	order = calloc(n, sizeof(*order));
+	objs = calloc(2*n, sizeof(*objs));
+	evictbuf = calloc(EVICTBYTES, 1);
+	if (nets == NULL || order == NULL || objs == NULL ||
+	    evictbuf == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	// Distinct prefixes in 44/8, mostly /24s, a few gateways each.
+	seen = mkipmap();
+	for (size_t k = 0; k < n;) {
+		size_t cidr = rnd() % 4 == 0 ? 16 + rnd() % 14 : 24;
+		uint32_t ipnet = (0x2C000000 | (rnd() & 0x00FFFFFF)) &
+		    ~(0xFFFFFFFF >> cidr);
+
+		if (ipmapfind(seen, ipnet, cidr) != NULL)
+			continue;
+		ipmapinsert(seen, ipnet, cidr, &nets[k]);
+		nets[k].ipnet = ipnet;
+		nets[k].cidr = cidr;
+		nets[k].gateway = 0x80000000 + k / ROUTESPERTUNNEL;
+		order[k] = k;
+		k++;
+	}
+	freeipmap(seen, nofree);
+	for (size_t k = n - 1; k > 0; k--) {
+		size_t j = rnd() % (k + 1), t = order[k];
+		order[k] = order[j];
+		order[j] = t;
+	}
+
+	routeslab = mkslab(sizeof(Route), sizeof(time_t));
+	tunnelslab = mkslab(sizeof(Tunnel), 0);
+	printf("%zu routes, %zu tunnels, best of %d\n", n,
+	    (n + ROUTESPERTUNNEL - 1) / ROUTESPERTUNNEL, NROUNDS);
+	printf("sizeof: old route %zu, route %zu + expiry %zu, tunnel %zu\n",
+	    sizeof(OldRoute), sizeof(Route), sizeof(time_t), sizeof(Tunnel));
+	printf("slab pages of %d bytes: %zu routes or %zu tunnels\n",
+	    SLAB_PAGESIZE, routeslab->nperpage, tunnelslab->nperpage);
+	freeslab(routeslab);
+	freeslab(tunnelslab);
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "", "build us",
+	    "scan us", "cold us", "refresh us", "cold us", "scan bytes");
+	for (size_t k = 0; k < sizeof(impls)/sizeof(impls[0]); k++)
+		run(&impls[k], nets, order, n, objs);
+	free(nets);
+	free(order);
+	free(objs);
+	free((void *)evictbuf);
+
+	return 0;
+}
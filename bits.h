@@ -0,0 +1,204 @@
+#ifndef RIPD_BITS_H
+#define RIPD_BITS_H
+
+#include <stdint.h>
+
+/*
+ * Bit manipulation kernels for the tries, the interface bitmap and
+ * the latency histograms.
+ *
+ * With GCC or clang these use the compiler's builtins, which are
+ * single instructions where the target has them: tzcnt or bsf,
+ * lzcnt or bsr, popcnt, bswap, and rbit on arm64.  On x86 without
+ * popcnt in -march the builtin popcount is a library call, several
+ * times slower than the portable version, so that is used instead.
+ * Other compilers, or -DNO_BIT_INTRINSICS, get the portable
+ * versions, which are always available as soft*() to test and
+ * benchmark against.
+ *
+ * ctz and clz of zero are undefined.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_BIT_INTRINSICS)
+#define BITS_BUILTINS
+#if defined(__POPCNT__) || !(defined(__x86_64__) || defined(__i386__))
+#define BITS_POPCNT
+#endif
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_bitreverse32)
+#define BITS_BITREVERSE
+#endif
+#endif
+#endif
+
+static inline int
+softctz32(uint32_t w)
+{
+	int n = 0;
+
+	if ((w & 0xFFFF) == 0) {
+		n += 16;
+		w >>= 16;
+	}
+	if ((w & 0xFF) == 0) {
+		n += 8;
+		w >>= 8;
+	}
+	if ((w & 0xF) == 0) {
+		n += 4;
+		w >>= 4;
+	}
+	if ((w & 0x3) == 0) {
+		n += 2;
+		w >>= 2;
+	}
+	return n + ((w & 0x1) == 0);
+}
+
+static inline int
+softctz64(uint64_t w)
+{
+	if ((uint32_t)w == 0)
+		return 32 + softctz32(w >> 32);
+	return softctz32(w);
+}
+
+static inline int
+softclz32(uint32_t w)
+{
+	int n = 0;
+
+	if ((w & 0xFFFF0000) == 0) {
+		n += 16;
+		w <<= 16;
+	}
+	if ((w & 0xFF000000) == 0) {
+		n += 8;
+		w <<= 8;
+	}
+	if ((w & 0xF0000000) == 0) {
+		n += 4;
+		w <<= 4;
+	}
+	if ((w & 0xC0000000) == 0) {
+		n += 2;
+		w <<= 2;
+	}
+	return n + ((w & 0x80000000) == 0);
+}
+
+static inline int
+softclz64(uint64_t w)
+{
+	if ((w >> 32) == 0)
+		return 32 + softclz32(w);
+	return softclz32(w >> 32);
+}
+
+static inline int
+softpop32(uint32_t w)
+{
+	w = w - ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+	w = (w + (w >> 4)) & 0x0F0F0F0F;
+	return (w * 0x01010101) >> 24;
+}
+
+static inline uint32_t
+softbswap32(uint32_t w)
+{
+	return w << 24 | (w & 0xFF00) << 8 | ((w >> 8) & 0xFF00) | w >> 24;
+}
+
+// Reverse the bits within each byte.
+static inline uint32_t
+bytebrev32(uint32_t w)
+{
+	w = (w & 0x55555555) << 1 | ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) << 2 | ((w >> 2) & 0x33333333);
+	w = (w & 0x0F0F0F0F) << 4 | ((w >> 4) & 0x0F0F0F0F);
+	return w;
+}
+
+// See Hacker's Delight, second edition, section 7-1.
+static inline uint32_t
+softbrev32(uint32_t w)
+{
+	return softbswap32(bytebrev32(w));
+}
+
+static inline int
+ctz32(uint32_t w)
+{
+#ifdef BITS_BUILTINS
+	return __builtin_ctz(w);
+#else
+	return softctz32(w);
+#endif
+}
+
+static inline int
+ctz64(uint64_t w)
+{
+#ifdef BITS_BUILTINS
+	return __builtin_ctzll(w);
+#else
+	return softctz64(w);
+#endif
+}
+
+static inline int
+clz32(uint32_t w)
+{
+#ifdef BITS_BUILTINS
+	return __builtin_clz(w);
+#else
+	return softclz32(w);
+#endif
+}
+
+static inline int
+clz64(uint64_t w)
+{
+#ifdef BITS_BUILTINS
+	return __builtin_clzll(w);
+#else
+	return softclz64(w);
+#endif
+}
+
+static inline int
+pop32(uint32_t w)
+{
+#ifdef BITS_POPCNT
+	return __builtin_popcount(w);
+#else
+	return softpop32(w);
+#endif
+}
+
+static inline uint32_t
+bswap32(uint32_t w)
+{
+#ifdef BITS_BUILTINS
+	return __builtin_bswap32(w);
+#else
+	return softbswap32(w);
+#endif
+}
+
+static inline uint32_t
+brev32(uint32_t w)
+{
+#if defined(BITS_BITREVERSE)
+	return __builtin_bitreverse32(w);
+#elif defined(BITS_BUILTINS) && defined(__aarch64__)
+	uint32_t r;
+
+	__asm__("rbit %w0, %w1" : "=r"(r) : "r"(w));
+	return r;
+#else
+	return bswap32(bytebrev32(w));
+#endif
+}
+
+#endif
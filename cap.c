@@ -0,0 +1,276 @@
+/*
+ * A capture ring of received RIP datagrams, for replay.
+ *
+ * With -C, riptide() copies every datagram it receives, with the
+ * sender and the time it arrived, into a fixed-size ring in a
+ * memory-mapped file.  When the ring is full the oldest datagrams
+ * are overwritten.  The file can be handed straight to -f, which
+ * feeds the datagrams back through the daemon in order, using the
+ * recorded arrival times as the current time, so that an incident
+ * can be replayed exactly as it happened.
+ *
+ * Only the main thread captures.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cap.h"
+#include "dat.h"
+#include "log.h"
+
+enum {
+	MIN_CAP_SIZE = 4096,
+};
+
+struct CapReader {
+	void *base;
+	size_t len;
+	const CapHeader *header;
+	const octet *data;
+	uint64_t pos;
+	uint64_t end;
+};
+
+static const char CAP_MAGIC[8] = "44RIPCAP";
+
+// Record length marking the unused end of the data area.
+static const uint32_t CAP_WRAP = 0xFFFFFFFF;
+
+static CapHeader *header;
+static octet *data;
+static size_t maplen;
+
+// Bytes a record for a 'len'-byte datagram occupies in the ring.
+static uint64_t
+recsize(uint64_t len)
+{
+	return (sizeof(CapRecord) + len + CAP_ALIGN - 1) &
+	    ~(uint64_t)(CAP_ALIGN - 1);
+}
+
+static int
+validheader(const CapHeader *h, size_t len)
+{
+	return memcmp(h->magic, CAP_MAGIC, sizeof(CAP_MAGIC)) == 0 &&
+	    h->version == CAP_VERSION &&
+	    h->size % CAP_ALIGN == 0 &&
+	    len == sizeof(CapHeader) + h->size &&
+	    h->tail <= h->head && h->head - h->tail <= h->size &&
+	    h->head % CAP_ALIGN == 0 && h->tail % CAP_ALIGN == 0;
+}
+
+//
+// Map the capture ring at 'path', creating it with a 'size'-byte
+// data area if it does not exist or does not match.  An existing
+// ring of the right size is appended to.
+//
+int
+opencapture(const char *path, size_t size)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	size -= size % CAP_ALIGN;
+	if (size < MIN_CAP_SIZE) {
+		error("capture size %zu is too small", size);
+		return -1;
+	}
+	closecapture();
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		error("cannot open capture %s: %m", path);
+		return -1;
+	}
+	maplen = sizeof(CapHeader) + size;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != maplen) {
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, maplen) < 0) {
+			error("cannot size capture %s: %m", path);
+			close(fd);
+			return -1;
+		}
+	}
+	base = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		error("cannot map capture %s: %m", path);
+		return -1;
+	}
+	header = base;
+	data = (octet *)(header + 1);
+	if (!validheader(header, maplen)) {
+		memset(header, 0, sizeof(*header));
+		memcpy(header->magic, CAP_MAGIC, sizeof(header->magic));
+		header->version = CAP_VERSION;
+		header->size = size;
+		header->head = 0;
+		header->tail = 0;
+	}
+
+	return 0;
+}
+
+void
+closecapture(void)
+{
+	if (header == NULL)
+		return;
+	msync(header, maplen, MS_ASYNC);
+	munmap(header, maplen);
+	header = NULL;
+	data = NULL;
+}
+
+//
+// Append a datagram to the ring, overwriting the oldest ones as
+// needed.  The tail is moved past anything about to be overwritten
+// before the new record is written, and the head only once it is
+// complete, so the ring is always readable.
+//
+void
+cappacket(const octet *packet, size_t len, const struct sockaddr_in *from,
+    int64_t when)
+{
+	uint64_t size, head, tail, off, skip, need;
+	CapRecord *rec;
+
+	if (header == NULL)
+		return;
+	size = header->size;
+	need = recsize(len);
+	if (need > size)
+		return;
+	head = header->head;
+	off = head % size;
+	skip = (off + need > size) ? size - off : 0;
+	tail = header->tail;
+	while (head + skip + need - tail > size) {
+		if (tail == head) {
+			tail = head + skip;
+			break;
+		}
+		const CapRecord *old = (const CapRecord *)(data + tail % size);
+		if (old->len == CAP_WRAP)
+			tail += size - tail % size;
+		else
+			tail += recsize(old->len);
+	}
+	header->tail = tail;
+	atomic_signal_fence(memory_order_release);
+	if (skip != 0) {
+		((CapRecord *)(data + off))->len = CAP_WRAP;
+		head += skip;
+		off = 0;
+	}
+	rec = (CapRecord *)(data + off);
+	memset(rec, 0, sizeof(*rec));
+	rec->len = len;
+	rec->addr = ntohl(from->sin_addr.s_addr);
+	rec->port = ntohs(from->sin_port);
+	rec->time = when;
+	memcpy(rec + 1, packet, len);
+	atomic_signal_fence(memory_order_release);
+	header->head = head + need;
+}
+
+//
+// Open 'path' for replay.  Returns NULL if it is not a capture
+// ring at all, so the caller can treat it as a raw packet file.
+//
+CapReader *
+opencapreader(const char *path)
+{
+	struct stat st;
+	CapReader *r;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		fatal("Can't open '%s'", path);
+	if (fstat(fd, &st) < 0)
+		fatal_err("fstat");
+	if ((size_t)st.st_size < sizeof(CapHeader)) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		fatal("cannot map '%s': %m", path);
+	if (memcmp(base, CAP_MAGIC, sizeof(CAP_MAGIC)) != 0) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	if (!validheader(base, st.st_size))
+		fatal("damaged capture '%s'", path);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		fatal("malloc");
+	r->base = base;
+	r->len = st.st_size;
+	r->header = base;
+	r->data = (const octet *)(r->header + 1);
+	r->pos = r->header->tail;
+	r->end = r->header->head;
+
+	return r;
+}
+
+//
+// Read the next datagram into 'packet'.  Returns its length, or 0
+// once the ring is exhausted.
+//
+ssize_t
+capread(CapReader *r, octet *packet, size_t len, struct sockaddr_in *from,
+    int64_t *when)
+{
+	uint64_t size = r->header->size;
+
+	while (r->pos < r->end) {
+		uint64_t off = r->pos % size;
+		const CapRecord *rec = (const CapRecord *)(r->data + off);
+		if (rec->len == CAP_WRAP) {
+			r->pos += size - off;
+			continue;
+		}
+		if (off + recsize(rec->len) > size)
+			fatal("damaged capture record at %" PRIu64, r->pos);
+		if (rec->len == 0) {
+			// Nothing to replay, and 0 would mean the end.
+			r->pos += recsize(0);
+			continue;
+		}
+		if (len > rec->len)
+			len = rec->len;
+		memcpy(packet, rec + 1, len);
+		memset(from, 0, sizeof(*from));
+		from->sin_family = AF_INET;
+		from->sin_addr.s_addr = htonl(rec->addr);
+		from->sin_port = htons(rec->port);
+		*when = rec->time;
+		r->pos += recsize(rec->len);
+		return len;
+	}
+
+	return 0;
+}
+
+void
+closecapreader(CapReader *r)
+{
+	if (r == NULL)
+		return;
+	munmap(r->base, r->len);
+	free(r);
+}
@@ -0,0 +1,59 @@
+#ifndef RIPD_CAP_H
+#define RIPD_CAP_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "dat.h"
+
+typedef struct CapHeader CapHeader;
+typedef struct CapRecord CapRecord;
+typedef struct CapReader CapReader;
+
+enum {
+	CAP_VERSION = 1,
+	CAP_DEFAULT_SIZE = 32*1024*1024,
+	CAP_ALIGN = 8,
+};
+
+/*
+ * On-disk layout of a packet capture: a header followed by a
+ * 'size'-byte data area used as a ring of variable-length records.
+ * 'head' and 'tail' are logical byte offsets that only grow; the
+ * physical offset is the logical one modulo 'size'.  Records hold a
+ * CapRecord followed by the datagram, padded to CAP_ALIGN bytes,
+ * and never straddle the end of the data area: a record with
+ * length CAP_WRAP says the rest of the area is unused.  All fields
+ * are in host byte order.
+ */
+struct CapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	uint64_t size;
+	volatile uint64_t head;		// Where the next record goes.
+	volatile uint64_t tail;		// The oldest record.
+	char pad2[24];
+};
+
+struct CapRecord {
+	uint32_t len;			// Datagram bytes, or CAP_WRAP.
+	uint32_t addr;			// Sender, in host byte order.
+	int64_t time;			// Received, nanoseconds since epoch.
+	uint16_t port;
+	uint16_t pad[3];
+};
+
+int opencapture(const char *path, size_t size);
+void closecapture(void);
+void cappacket(const octet *packet, size_t len,
+    const struct sockaddr_in *from, int64_t when);
+CapReader *opencapreader(const char *path);
+ssize_t capread(CapReader *r, octet *packet, size_t len,
+    struct sockaddr_in *from, int64_t *when);
+void closecapreader(CapReader *r);
+
+#endif
@@ -0,0 +1,507 @@
+/*
+ * The control socket.
+ *
+ * A UNIX-domain stream socket, served from the main loop alongside
+ * the RIP socket, that answers one-line queries about the running
+ * daemon:
+ *
+ *	stats			event counters and gauges
+ *	route <net>[/<cidr>]	the route for a prefix, or the one
+ *				covering an address
+ *	tunnel <addr|ifname>	a tunnel, by remote address or
+ *				interface, and its routes
+ *	latency			p50, p99 and maximum time spent in
+ *				each phase of packet processing and
+ *				in each kernel operation
+ *	tries			node, data and depth counts for
+ *				each map
+ *	dump [text|json]	the policy, tunnels and routes; the
+ *				connection is closed afterwards
+ *
+ * Each reply is a series of lines ending with a line holding a
+ * single '.'.  Sockets are non-blocking and replies are buffered, so
+ * a slow or stalled client never holds up packet processing.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "dat.h"
+#include "dump.h"
+#include "hist.h"
+#include "lib.h"
+#include "log.h"
+#include "stats.h"
+
+typedef struct CtlClient CtlClient;
+
+enum {
+	MAX_CTL_LINE = 256,
+	MAX_CTL_OUTPUT = 1024*1024,
+	CIDR_HOST = 32,
+};
+
+struct CtlClient {
+	int fd;
+	char in[MAX_CTL_LINE];
+	size_t nin;
+	char *out;
+	size_t nout;
+	size_t outoff;
+	size_t maxout;
+	int handedoff;		// A dump child owns the connection.
+};
+
+static int listenfd = -1;
+static char *sockpath;
+static CtlClient clients[MAX_CTL_CLIENTS];
+static IPMap *routes;
+static tunnelmap *tunnels;
+
+static void
+setnonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		fatal_err("fcntl O_NONBLOCK");
+}
+
+void
+initctl(const char *path, IPMap *routemap, tunnelmap *tunnelsmap)
+{
+	struct sockaddr_un sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		fatal("control socket path too long: %s", path);
+	strcpy(sun.sun_path, path);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd < 0)
+		fatal_err("control socket");
+	unlink(path);
+	if (bind(listenfd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		fatal("cannot bind control socket %s: %m", path);
+	if (chmod(path, 0600) < 0)
+		fatal("cannot chmod control socket %s: %m", path);
+	if (listen(listenfd, MAX_CTL_CLIENTS) < 0)
+		fatal_err("control socket listen");
+	setnonblock(listenfd);
+	sockpath = strdup(path);
+	if (sockpath == NULL)
+		fatal("malloc");
+	for (int k = 0; k < MAX_CTL_CLIENTS; k++)
+		clients[k].fd = -1;
+	routes = routemap;
+	tunnels = tunnelsmap;
+}
+
+static void
+dropclient(CtlClient *c)
+{
+	close(c->fd);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+void
+finictl(void)
+{
+	if (listenfd < 0)
+		return;
+	for (int k = 0; k < MAX_CTL_CLIENTS; k++)
+		if (clients[k].fd >= 0)
+			dropclient(&clients[k]);
+	close(listenfd);
+	listenfd = -1;
+	unlink(sockpath);
+	free(sockpath);
+	sockpath = NULL;
+}
+
+int
+ctlactive(void)
+{
+	return listenfd >= 0;
+}
+
+static void
+reply(CtlClient *c, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (c->nout + n + 1 > c->maxout) {
+		size_t max = (c->maxout == 0) ? 1024 : c->maxout;
+		while (max < c->nout + n + 1)
+			max *= 2;
+		char *out = realloc(c->out, max);
+		if (out == NULL)
+			fatal("malloc");
+		c->out = out;
+		c->maxout = max;
+	}
+	va_start(ap, fmt);
+	vsnprintf(c->out + c->nout, n + 1, fmt, ap);
+	va_end(ap);
+	c->nout += n;
+}
+
+static int
+parseprefix(const char *s, uint32_t *addr, int *cidr)
+{
+	char buf[INET_ADDRSTRLEN + 4];
+	struct in_addr in;
+	char *slash;
+
+	if (strlen(s) >= sizeof(buf))
+		return -1;
+	strcpy(buf, s);
+	*cidr = -1;
+	slash = strchr(buf, '/');
+	if (slash != NULL) {
+		*slash++ = '\0';
+		char *end;
+		long n = strtol(slash, &end, 10);
+		if (*slash == '\0' || *end != '\0' || n < 0 || n > CIDR_HOST)
+			return -1;
+		*cidr = n;
+	}
+	if (inet_pton(AF_INET, buf, &in) != 1)
+		return -1;
+	*addr = ntohl(in.s_addr);
+
+	return 0;
+}
+
+static void
+replyroute(CtlClient *c, const Route *route, time_t now)
+{
+	char net[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
+
+	ipaddrstr(route->ipnet, net);
+	ipaddrstr(route->gateway, gw);
+	reply(c, "route %s/%d via %s %s expires %lld\n", net,
+	    netmask2cidr(route->subnetmask), gw,
+	    route->tunnel != NULL ? route->tunnel->ifname : "-",
+	    (long long)(routeexpires(route) - now));
+}
+
+static void
+cmdstats(CtlClient *c)
+{
+	for (size_t k = 0; k < nstatnames; k++)
+		reply(c, "%s %" PRIu64 "\n", statnames[k].name,
+		    statvalue(&statnames[k]));
+	reply(c, "log_dropped %" PRIu64 "\n", logdropped());
+	reply(c, "routes %" PRId64 "\n", (int64_t)statget(routes));
+	reply(c, "tunnels %" PRId64 "\n", (int64_t)statget(tunnels));
+	reply(c, "ipmap_nodes %zu\n", ipmaplivenodes());
+
+	uint64_t calls[IPMAP_NOPS], visits[IPMAP_NOPS];
+	if (ipmapvisits(calls, visits)) {
+		for (int k = 0; k < IPMAP_NOPS; k++)
+			reply(c, "ipmap_%s_calls %" PRIu64 "\n"
+			    "ipmap_%s_visits %" PRIu64 "\n",
+			    ipmapopnames[k], calls[k], ipmapopnames[k],
+			    visits[k]);
+	}
+}
+
+static void
+replytrie(CtlClient *c, const char *name, const IPMapStats *st)
+{
+	reply(c, "%s nodes %zu data %zu bytes %zu maxdepth %zu\n", name,
+	    st->nodes, st->data, st->bytes, st->maxdepth);
+	for (size_t d = 0; d <= st->maxdepth; d++)
+		if (st->depth[d] != 0)
+			reply(c, "%s depth %zu data %zu\n", name, d,
+			    st->depth[d]);
+}
+
+static void
+cmdtries(CtlClient *c)
+{
+	IPMapStats st;
+
+	ipmapstats(routes, &st);
+	replytrie(c, "routes", &st);
+	tunnelmapstats(tunnels, &st);
+	replytrie(c, "tunnels", &st);
+}
+
+static void
+cmdlatency(CtlClient *c)
+{
+	for (int k = 0; k < NPHASES; k++) {
+		HistSummary s;
+		histsummary(&latency[k], &s);
+		reply(c, "%s count %" PRIu64 " p50 %" PRIu64 " p99 %" PRIu64
+		    " max %" PRIu64 "\n", phasenames[k], s.count, s.p50,
+		    s.p99, s.max);
+	}
+}
+
+static void
+cmdroute(CtlClient *c, const char *arg)
+{
+	uint32_t addr;
+	Route *route;
+	int cidr;
+
+	if (arg == NULL || parseprefix(arg, &addr, &cidr) < 0) {
+		reply(c, "error bad prefix\n");
+		return;
+	}
+	if (cidr >= 0) {
+		uint32_t mask = (cidr == 0) ? 0 : ~0U << (CIDR_HOST - cidr);
+		route = ipmapfind(routes, addr & mask, cidr);
+	} else {
+		route = ipmapnearest(routes, addr, CIDR_HOST);
+	}
+	if (route == NULL) {
+		reply(c, "error no route\n");
+		return;
+	}
+	replyroute(c, route, time(NULL));
+}
+
+// The tunnel on interface 'ifname', or NULL if there is none.
+static Tunnel *
+findifname(const char *ifname)
+{
+	tunnelmapiter it;
+
+	for (tunnelmapwalk(tunnels, &it); tunnelmapnext(&it);)
+		if (strcmp((*it.value)->ifname, ifname) == 0)
+			return *it.value;
+	return NULL;
+}
+
+static void
+cmdtunnel(CtlClient *c, const char *arg)
+{
+	char outer_local[INET_ADDRSTRLEN], outer_remote[INET_ADDRSTRLEN];
+	char inner_local[INET_ADDRSTRLEN], inner_remote[INET_ADDRSTRLEN];
+	struct in_addr in;
+	Tunnel *tunnel;
+	time_t now;
+
+	if (arg == NULL) {
+		reply(c, "error missing tunnel\n");
+		return;
+	}
+	if (inet_pton(AF_INET, arg, &in) == 1) {
+		Tunnel **found = tunnelmapfind(tunnels, ntohl(in.s_addr),
+		    CIDR_HOST);
+		tunnel = (found != NULL) ? *found : NULL;
+	} else
+		tunnel = findifname(arg);
+	if (tunnel == NULL) {
+		reply(c, "error no tunnel\n");
+		return;
+	}
+	ipaddrstr(tunnel->outer_local, outer_local);
+	ipaddrstr(tunnel->outer_remote, outer_remote);
+	ipaddrstr(tunnel->inner_local, inner_local);
+	ipaddrstr(tunnel->inner_remote, inner_remote);
+	reply(c, "tunnel %s outer %s -> %s inner %s -> %s routes %d\n",
+	    tunnel->ifname, outer_local, outer_remote, inner_local,
+	    inner_remote, tunnel->nref);
+	now = time(NULL);
+	for (Route *route = tunnel->routes; route != NULL;
+	    route = route->rnext)
+		replyroute(c, route, now);
+}
+
+//
+// Hand the connection to a dump child, which writes any replies
+// still buffered, the dump and the closing '.', and then exits.
+// The parent just forgets the connection.
+//
+static void
+cmddump(CtlClient *c, const char *arg)
+{
+	void (*dump)(FILE *) = dumptext;
+	FILE *out;
+	int flags;
+
+	if (arg != NULL && strcmp(arg, "json") == 0)
+		dump = dumpjson;
+	else if (arg != NULL && strcmp(arg, "text") != 0) {
+		reply(c, "error unknown format %s\n", arg);
+		return;
+	}
+	switch (forkdump()) {
+	case -1:
+		reply(c, "error cannot start dump\n");
+		return;
+	case 0:
+		flags = fcntl(c->fd, F_GETFL);
+		if (flags >= 0)
+			fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+		out = fdopen(c->fd, "w");
+		if (out == NULL)
+			_exit(EXIT_FAILURE);
+		fwrite(c->out + c->outoff, 1, c->nout - c->outoff, out);
+		dump(out);
+		fputs(".\n", out);
+		_exit(fclose(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	c->nout = c->outoff = 0;
+	c->handedoff = 1;
+}
+
+static void
+command(CtlClient *c, char *line)
+{
+	char *cmd, *arg;
+
+	cmd = strsep(&line, " \t");
+	arg = strsep(&line, " \t");
+	if (strcmp(cmd, "stats") == 0)
+		cmdstats(c);
+	else if (strcmp(cmd, "latency") == 0)
+		cmdlatency(c);
+	else if (strcmp(cmd, "route") == 0)
+		cmdroute(c, arg);
+	else if (strcmp(cmd, "tunnel") == 0)
+		cmdtunnel(c, arg);
+	else if (strcmp(cmd, "tries") == 0)
+		cmdtries(c);
+	else if (strcmp(cmd, "dump") == 0)
+		cmddump(c, arg);
+	else if (*cmd != '\0')
+		reply(c, "error unknown command %s\n", cmd);
+	if (!c->handedoff)
+		reply(c, ".\n");
+}
+
+// Write as much buffered output as the socket will take.  Returns -1
+// if the client has gone away (EPIPE, as SIGPIPE is ignored).
+static int
+flush(CtlClient *c)
+{
+	while (c->outoff < c->nout) {
+		ssize_t n = write(c->fd, c->out + c->outoff,
+		    c->nout - c->outoff);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -1;
+		}
+		c->outoff += n;
+	}
+	c->nout = c->outoff = 0;
+
+	return 0;
+}
+
+static int
+readclient(CtlClient *c)
+{
+	ssize_t n;
+	char *nl;
+
+	n = read(c->fd, c->in + c->nin, sizeof(c->in) - c->nin);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if (n == 0)
+		return -1;
+	c->nin += n;
+	while ((nl = memchr(c->in, '\n', c->nin)) != NULL) {
+		*nl = '\0';
+		if (nl > c->in && nl[-1] == '\r')
+			nl[-1] = '\0';
+		command(c, c->in);
+		if (c->handedoff)
+			return -1;
+		c->nin -= nl + 1 - c->in;
+		memmove(c->in, nl + 1, c->nin);
+	}
+	if (c->nin == sizeof(c->in)) {
+		reply(c, "error line too long\n.\n");
+		c->nin = 0;
+	}
+
+	return 0;
+}
+
+static void
+acceptclient(void)
+{
+	int fd;
+
+	fd = accept(listenfd, NULL, NULL);
+	if (fd < 0)
+		return;
+	for (int k = 0; k < MAX_CTL_CLIENTS; k++) {
+		if (clients[k].fd < 0) {
+			setnonblock(fd);
+			clients[k].fd = fd;
+			return;
+		}
+	}
+	debug("control socket: too many clients");
+	close(fd);
+}
+
+void
+ctlpollfds(struct pollfd fds[static CTL_NFDS])
+{
+	fds[0].fd = listenfd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	for (int k = 0; k < MAX_CTL_CLIENTS; k++) {
+		CtlClient *c = &clients[k];
+		fds[k + 1].fd = c->fd;
+		fds[k + 1].events = POLLIN;
+		if (c->outoff < c->nout)
+			fds[k + 1].events |= POLLOUT;
+		fds[k + 1].revents = 0;
+	}
+}
+
+void
+ctlservice(const struct pollfd fds[static CTL_NFDS])
+{
+	for (int k = 0; k < MAX_CTL_CLIENTS; k++) {
+		CtlClient *c = &clients[k];
+		short revents = fds[k + 1].revents;
+		if (c->fd < 0 || c->fd != fds[k + 1].fd || revents == 0)
+			continue;
+		if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+		    readclient(c) < 0)
+		{
+			flush(c);
+			dropclient(c);
+			continue;
+		}
+		if (flush(c) < 0 || c->nout > MAX_CTL_OUTPUT)
+			dropclient(c);
+	}
+	if (fds[0].revents & POLLIN)
+		acceptclient();
+}
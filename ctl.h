@@ -0,0 +1,20 @@
+#ifndef RIPD_CTL_H
+#define RIPD_CTL_H
+
+#include <poll.h>
+
+#include "dat.h"
+#include "lib.h"
+
+enum {
+	MAX_CTL_CLIENTS = 8,
+	CTL_NFDS = 1 + MAX_CTL_CLIENTS,
+};
+
+void initctl(const char *path, IPMap *routes, tunnelmap *tunnels);
+void finictl(void);
+int ctlactive(void);
+void ctlpollfds(struct pollfd fds[static CTL_NFDS]);
+void ctlservice(const struct pollfd fds[static CTL_NFDS]);
+
+#endif
@@ -5,32 +5,62 @@
 #include <stddef.h>
 #include <time.h>
 
+#include "ipmapt.h"
+#include "slab.h"
+
 typedef unsigned char octet;
 typedef struct Route Route;
 typedef struct Tunnel Tunnel;
 
+/*
+ * Routes and tunnels come from slabs.  A route's expiry time, in
+ * seconds, is its hot record in the route slab rather than a field,
+ * so that walkexpired() reads only the dense arrays of expiry times;
+ * routeexpires() and setrouteexpires() must only be given routes
+ * from the slab, not copies of them.
+ */
 struct Route {
+	Tunnel *tunnel;
+	Route *rnext;		// The tunnel's next route.
+	Route **rprev;		// The link to this route, NULL if none.
 	uint32_t ipnet;
 	uint32_t subnetmask;
 	uint32_t gateway;
-	time_t expires;		// Seconds.
-	Route *rnext;
-	Tunnel *tunnel;
 };
 
+static inline time_t
+routeexpires(const Route *route)
+{
+	return *(const time_t *)slabhot(route);
+}
+
+static inline void
+setrouteexpires(Route *route, time_t expires)
+{
+	*(time_t *)slabhot(route) = expires;
+}
+
 enum {
 	MAX_TUN_IFNAME = 16,
 };
 
+//
+// The fields that linking and unlinking routes touch come first,
+// ahead of the addresses and name, which are read when the tunnel
+// is set up, torn down or reported.
+//
 struct Tunnel {
 	Route *routes;
-	uint32_t outer_local;
+	int nref;
+	unsigned int ifnum;
 	uint32_t outer_remote;
+	uint32_t outer_local;
 	uint32_t inner_local;
 	uint32_t inner_remote;
-	int nref;
 	char ifname[MAX_TUN_IFNAME];
-	unsigned int ifnum;
 };
 
+// Tunnels by outer remote address, and by inner while discovering.
+IPMAP_DEFINE(tunnelmap, Tunnel *)
+
 #endif
@@ -0,0 +1,322 @@
+/*
+ * Dumps of the acceptance policy, tunnels and routes.
+ *
+ * A dump of a full table runs to megabytes, far too long to write
+ * from the main loop.  Instead the daemon forks: the child writes
+ * the dump from its copy-on-write image of the tables, which
+ * cannot change under it, and exits, while the parent goes back
+ * to routing and reaps the child whenever it notices it is done.
+ * Only one dump runs at a time, which bounds the memory the
+ * copy-on-write pages can cost.
+ *
+ * The child has none of the parent's threads.  The logger notices
+ * the fork and logs synchronously in the child; nothing else the
+ * child touches needs a thread.
+ */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "dump.h"
+#include "lib.h"
+#include "log.h"
+#include "policy.h"
+
+static const Policy *policy;
+static tunnelmap *tunnels;
+static pid_t dumper = -1;
+
+typedef struct JSONState JSONState;
+struct JSONState {
+	FILE *out;
+	int n;
+};
+
+//
+// Record the tables to dump.  Called again whenever the policy is
+// replaced.
+//
+void
+initdump(const Policy *current, tunnelmap *map)
+{
+	policy = current;
+	tunnels = map;
+}
+
+static void
+texttunnel(Tunnel *tunnel, FILE *out)
+{
+	char outer_local[INET_ADDRSTRLEN], outer_remote[INET_ADDRSTRLEN],
+	     inner_local[INET_ADDRSTRLEN], inner_remote[INET_ADDRSTRLEN];
+
+	ipaddrstr(tunnel->outer_local, outer_local);
+	ipaddrstr(tunnel->outer_remote, outer_remote);
+	ipaddrstr(tunnel->inner_local, inner_local);
+	ipaddrstr(tunnel->inner_remote, inner_remote);
+
+	fprintf(out, "Tunnel interface %s:\n"
+	              "\tOuter %s -> %s\n"
+	              "\tInner %s -> %s\n"
+	              "\tRouted networks:\n",
+	    tunnel->ifname, outer_local, outer_remote, inner_local,
+	    inner_remote);
+
+	Route *route;
+	for (route = tunnel->routes; route; route = route->rnext) {
+		char net[INET_ADDRSTRLEN];
+		size_t cidr;
+
+		assert(route->tunnel == tunnel);
+
+		ipaddrstr(route->ipnet, net);
+		cidr = netmask2cidr(route->subnetmask);
+
+		fprintf(out, "\t\t%s/%zd\n", net, cidr);
+	}
+}
+
+static int
+textpolicy(uint32_t key, int cidr, int accept, void *arg)
+{
+	FILE *out = arg;
+	char net[INET_ADDRSTRLEN];
+
+	ipaddrstr(key, net);
+
+	fprintf(out, "\t%s/%d -> %s\n", net, cidr,
+	    accept ? "ACCEPT" : "REJECT");
+
+	return 0;
+}
+
+void
+dumptext(FILE *out)
+{
+	tunnelmapiter it;
+
+	fputs("Acceptance policy:\n", out);
+	policydo(policy, textpolicy, out);
+	for (tunnelmapwalk(tunnels, &it); tunnelmapnext(&it);)
+		texttunnel(*it.value, out);
+}
+
+// Interface names come from the kernel; quote them properly anyway.
+static void
+jsonstr(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static int
+jsonpolicy(uint32_t key, int cidr, int accept, void *arg)
+{
+	JSONState *state = arg;
+	char net[INET_ADDRSTRLEN];
+
+	ipaddrstr(key, net);
+	fprintf(state->out, "%s\n    {\"prefix\": \"%s/%d\", "
+	    "\"action\": \"%s\"}", state->n++ == 0 ? "" : ",", net, cidr,
+	    accept ? "accept" : "reject");
+
+	return 0;
+}
+
+static void
+jsontunnel(Tunnel *tunnel, JSONState *state)
+{
+	FILE *out = state->out;
+	char outer_local[INET_ADDRSTRLEN], outer_remote[INET_ADDRSTRLEN],
+	     inner_local[INET_ADDRSTRLEN], inner_remote[INET_ADDRSTRLEN];
+	int n = 0;
+
+	ipaddrstr(tunnel->outer_local, outer_local);
+	ipaddrstr(tunnel->outer_remote, outer_remote);
+	ipaddrstr(tunnel->inner_local, inner_local);
+	ipaddrstr(tunnel->inner_remote, inner_remote);
+
+	fprintf(out, "%s\n    {\"interface\": ", state->n++ == 0 ? "" : ",");
+	jsonstr(out, tunnel->ifname);
+	fprintf(out, ", \"outer_local\": \"%s\", \"outer_remote\": \"%s\", "
+	    "\"inner_local\": \"%s\", \"inner_remote\": \"%s\", "
+	    "\"routes\": [", outer_local, outer_remote, inner_local,
+	    inner_remote);
+	for (Route *route = tunnel->routes; route; route = route->rnext) {
+		char net[INET_ADDRSTRLEN];
+
+		ipaddrstr(route->ipnet, net);
+		fprintf(out, "%s\n      {\"prefix\": \"%s/%d\", "
+		    "\"expires\": %lld}", n++ == 0 ? "" : ",", net,
+		    netmask2cidr(route->subnetmask),
+		    (long long)routeexpires(route));
+	}
+	fprintf(out, "%s]}", n == 0 ? "" : "\n    ");
+}
+
+//
+// The same as dumptext(), as a single JSON object.  Route expiry
+// times are in seconds since the epoch.
+//
+void
+dumpjson(FILE *out)
+{
+	JSONState state = { out, 0 };
+	tunnelmapiter it;
+
+	fprintf(out, "{\n  \"time\": %lld,\n  \"policy\": [",
+	    (long long)time(NULL));
+	policydo(policy, jsonpolicy, &state);
+	fprintf(out, "\n  ],\n  \"tunnels\": [");
+	state.n = 0;
+	for (tunnelmapwalk(tunnels, &it); tunnelmapnext(&it);)
+		jsontunnel(*it.value, &state);
+	fprintf(out, "\n  ]\n}\n");
+}
+
+//
+// Fork a child to write a dump.  Returns 0 in the child, which must
+// finish with _exit(), and the child's pid in the parent.  Returns
+// -1 if a dump is already running or the fork fails.
+//
+pid_t
+forkdump(void)
+{
+	pid_t pid;
+
+	reapdumps();
+	if (dumper > 0) {
+		notice("dump already in progress");
+		return -1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		error("cannot fork dump: %m");
+		return -1;
+	}
+	if (pid > 0)
+		dumper = pid;
+
+	return pid;
+}
+
+static int
+writeto(const char *path, void (*dump)(FILE *))
+{
+	char tmp[PATH_MAX];
+	FILE *out;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		error("dump path too long: %s", path);
+		return -1;
+	}
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		error("cannot create %s: %m", tmp);
+		return -1;
+	}
+	dump(out);
+	if (fclose(out) != 0) {
+		error("cannot write %s: %m", tmp);
+		remove(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) < 0) {
+		error("cannot rename %s: %m", tmp);
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// Dump the tables as text to 'path' and as JSON to 'path'.json,
+// from a child.  Each file is written under a temporary name and
+// renamed into place.
+//
+int
+dumpfile(const char *path)
+{
+	char json[PATH_MAX];
+	pid_t pid;
+
+	if (snprintf(json, sizeof(json), "%s.json", path) >=
+	    (int)sizeof(json))
+	{
+		error("dump path too long: %s", path);
+		return -1;
+	}
+	pid = forkdump();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		int failed = writeto(path, dumptext) < 0;
+		failed |= writeto(json, dumpjson) < 0;
+		_exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	info("dumping tables to %s in process %d", path, (int)pid);
+
+	return 0;
+}
+
+static void
+reap(int options)
+{
+	int status;
+	pid_t pid;
+
+	if (dumper <= 0)
+		return;
+	do
+		pid = waitpid(dumper, &status, options);
+	while (pid < 0 && errno == EINTR && options == 0);
+	if (pid == 0 || (pid < 0 && errno == EINTR))
+		return;
+	if (pid < 0)
+		error("waitpid dump %d: %m", (int)dumper);
+	else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		info("dump %d done", (int)dumper);
+	else if (WIFSIGNALED(status))
+		error("dump %d killed by signal %d", (int)dumper,
+		    WTERMSIG(status));
+	else
+		error("dump %d failed", (int)dumper);
+	dumper = -1;
+}
+
+//
+// Collect a finished dump child, if there is one.  Never waits.
+//
+void
+reapdumps(void)
+{
+	reap(WNOHANG);
+}
+
+//
+// Wait for a running dump child to finish, before exiting.
+//
+void
+waitdumps(void)
+{
+	reap(0);
+}
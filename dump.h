@@ -0,0 +1,19 @@
+#ifndef RIPD_DUMP_H
+#define RIPD_DUMP_H
+
+#include <sys/types.h>
+
+#include <stdio.h>
+
+#include "dat.h"
+#include "policy.h"
+
+void initdump(const Policy *policy, tunnelmap *tunnels);
+void dumptext(FILE *out);
+void dumpjson(FILE *out);
+pid_t forkdump(void);
+int dumpfile(const char *path);
+void reapdumps(void);
+void waitdumps(void);
+
+#endif
@@ -18,6 +18,7 @@
 #include <inttypes.h>
 #include <ifaddrs.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdalign.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -28,15 +29,21 @@
 #include "dat.h"
 #include "lib.h"
 #include "log.h"
+#include "probes.h"
+#include "rec.h"
+#include "stats.h"
 #include "sys.h"
 
-typedef struct iface_info iface_info;
+typedef struct IfIndex IfIndex;
 
-struct iface_info {
-	char ifname[MAX_TUN_IFNAME];
-	int gifnum;    // Tunnel instance number
-	u_short index; // OS identifier
-	iface_info *next;
+//
+// Names of the tunnel interfaces found during discovery, indexed
+// by their OS interface index so that route gateways can be resolved
+// in constant time.  An empty name marks an unused slot.
+//
+struct IfIndex {
+	char (*names)[MAX_TUN_IFNAME];
+	size_t nnames;
 };
 
 enum TunnelAddrAction {
@@ -46,13 +53,25 @@ enum TunnelAddrAction {
 
 typedef enum TunnelAddrAction TunnelAddrAction;
 
-static int ctlfd = -1;
-static int rtfd = -1;
+//
+// Each thread that manipulates interfaces or routes has its own
+// control and routing sockets; see initsysthread().
+//
+static _Thread_local int ctlfd = -1;
+static _Thread_local int rtfd = -1;
 static int rtfd_rtable = -1;
 
+#ifndef SIOCSTUNFIB
+//
+// setfib() sets the FIB of the whole process, so pool workers take
+// turns at creating interfaces in the tunnel's FIB.
+//
+static pthread_mutex_t fiblock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static uint32_t hostmask;
 
-static void discoverroute(iface_info *ifaces, int rtable,
+static int discoverroute(const IfIndex *ifindex, int rtable,
     struct rt_msghdr *rtm, rt_discovered_thunk thunk, void *arg);
 static void tunnel_configure_inner(Tunnel *tunnel, TunnelAddrAction act);
 static void tunnel_rebase(Tunnel *tunnel, Route *route, int rtable);
@@ -117,30 +136,50 @@ getifindexfromsa(struct sockaddr *sa)
 	return sdl->sdl_index;
 }
 
-static char *
-lookupifbyindex(iface_info *head, u_short index)
+static void
+addifbyindex(IfIndex *ifindex, u_short index, const char *name)
+{
+	if (index >= ifindex->nnames) {
+		size_t nnames = 2*ifindex->nnames;
+		if (nnames <= index)
+			nnames = index + 1;
+		char (*names)[MAX_TUN_IFNAME] = reallocarray(ifindex->names,
+		    nnames, sizeof(names[0]));
+		if (names == NULL)
+			fatal("malloc");
+		memset(names + ifindex->nnames, 0,
+		    (nnames - ifindex->nnames)*sizeof(names[0]));
+		ifindex->names = names;
+		ifindex->nnames = nnames;
+	}
+	strlcpy(ifindex->names[index], name, sizeof(ifindex->names[index]));
+}
+
+static const char *
+lookupifbyindex(const IfIndex *ifindex, u_short index)
 {
-	for (;head != NULL; head = head->next)
-		if (head->index == index)
-			return head->ifname;
-	return NULL;
+	if (index >= ifindex->nnames || ifindex->names[index][0] == '\0')
+		return NULL;
+	return ifindex->names[index];
 }
 
-static void
-discoverifs(iface_info *gifinterfaces, int rtable, if_discovered_thunk thunk,
+static size_t
+discoverifs(IfIndex *ifindex, int rtable, if_discovered_thunk thunk,
     void *arg)
 {
-	struct ifaddrs *ifa;
+	struct ifaddrs *ifaddrs, *ifa;
 	int tmpctlfd;
+	size_t count;
 
 	tmpctlfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (tmpctlfd < 0)
 		fatal_err("ctl socket");
 
-	if (getifaddrs(&ifa) != 0)
+	if (getifaddrs(&ifaddrs) != 0)
 		fatal_err("getifaddrs");
 
-	for (; ifa != NULL; ifa = ifa->ifa_next) {
+	count = 0;
+	for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
 		struct ifreq ifr;
 		int gifnum;
 		uint32_t outer_local, outer_remote;
@@ -150,26 +189,29 @@ discoverifs(iface_info *gifinterfaces, int rtable, if_discovered_thunk thunk,
 		if (sscanf(ifa->ifa_name, "gif%d", &gifnum) != 1)
 			continue;
 		if (ifa->ifa_addr->sa_family == AF_LINK) {
-			iface_info *ifi = malloc(sizeof(iface_info));
-			if (ifi == NULL)
-				fatal("malloc");
-			int res = getifnamefromsa(ifa->ifa_addr, ifi->ifname,
-			    sizeof(ifi->ifname));
-			ifi->index = getifindexfromsa(ifa->ifa_addr);
-			if (res != 0 || ifi->index == 0) {
-				free(ifi);
+			char name[MAX_TUN_IFNAME];
+			int res = getifnamefromsa(ifa->ifa_addr, name,
+			    sizeof(name));
+			u_short index = getifindexfromsa(ifa->ifa_addr);
+			if (res != 0 || index == 0)
 				continue;
-			}
-			ifi->gifnum = gifnum;
-			ifi->next = gifinterfaces;
-			gifinterfaces = ifi;
+			addifbyindex(ifindex, index, name);
 			continue;
 		}
 		if (ifa->ifa_addr->sa_family != AF_INET)
 			continue;
 		if (ifa->ifa_dstaddr->sa_family != AF_INET)
 			continue;
+
+		//
+		// Check the routing table first: interfaces belonging to
+		// other tables cost one ioctl rather than three.
+		//
 		strlcpy(ifr.ifr_name, ifa->ifa_name, sizeof(ifr.ifr_name));
+		if (ioctl(tmpctlfd, SIOCGIFFIB, &ifr) < 0)
+			fatal("get %s fib: %m", ifa->ifa_name);
+		if (ifr.ifr_fib != rtable)
+			continue;
 		if (ioctl(tmpctlfd, SIOCGIFPSRCADDR, &ifr) < 0)
 			fatal("get %s outer src addr: %m", ifa->ifa_name);
 		if (ifr.ifr_addr.sa_family != AF_INET)
@@ -182,10 +224,6 @@ discoverifs(iface_info *gifinterfaces, int rtable, if_discovered_thunk thunk,
 			continue;
 		outer_remote = ntohl(
 		    ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr);
-		if (ioctl(tmpctlfd, SIOCGIFFIB, &ifr) < 0)
-			fatal("get %s fib: %m", ifa->ifa_name);
-		if (ifr.ifr_fib != rtable)
-			continue;
 		uint32_t inner_local = ntohl(
 		    ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr
 		);
@@ -195,14 +233,24 @@ discoverifs(iface_info *gifinterfaces, int rtable, if_discovered_thunk thunk,
 
 		thunk(ifa->ifa_name, gifnum, outer_local, outer_remote,
 		    inner_local, inner_remote, arg);
+		count++;
 	}
 
-	freeifaddrs(ifa);
+	freeifaddrs(ifaddrs);
 	close(tmpctlfd);
+
+	return count;
 }
 
-static void
-discoverrts(iface_info *gifinterfaces, int rtable, rt_discovered_thunk thunk,
+//
+// The route dump buffer is kept between calls and only grown when
+// the table outgrows it.
+//
+static char *rtbuf;
+static size_t rtbufcap;
+
+static size_t
+discoverrts(const IfIndex *ifindex, int rtable, rt_discovered_thunk thunk,
     void *arg)
 {
 	int mib[7];
@@ -218,32 +266,47 @@ discoverrts(iface_info *gifinterfaces, int rtable, rt_discovered_thunk thunk,
 
 	size_t rtbufsize;
 
-	if (sysctl(mib, mib_depth, NULL, &rtbufsize, NULL, 0) < 0)
-		fatal_err("sysctl: net.route sizing");
-	
-	char *rtbuf = malloc(rtbufsize);
-	if (rtbuf == NULL)
-		fatal("malloc net.route sysctl");
+	for (;;) {
+		rtbufsize = rtbufcap;
+		if (rtbuf != NULL &&
+		    sysctl(mib, mib_depth, rtbuf, &rtbufsize, NULL, 0) == 0)
+			break;
+		if (rtbuf != NULL && errno != ENOMEM)
+			fatal_err("sysctl: net.route");
 
-	if (sysctl(mib, mib_depth, rtbuf, &rtbufsize, NULL, 0) < 0)
-		fatal_err("sysctl: net.route");
+		//
+		// Either there is no buffer yet or the table grew.  Size
+		// it again, leaving some slack for routes added between
+		// the two calls.
+		//
+		if (sysctl(mib, mib_depth, NULL, &rtbufsize, NULL, 0) < 0)
+			fatal_err("sysctl: net.route sizing");
+		rtbufsize += rtbufsize/4;
+		char *buf = realloc(rtbuf, rtbufsize);
+		if (buf == NULL)
+			fatal("malloc net.route sysctl");
+		rtbuf = buf;
+		rtbufcap = rtbufsize;
+	}
 
 	char *hdr;
 	struct rt_msghdr *rtm;
+	size_t count = 0;
 
 	for (hdr = rtbuf; hdr < rtbuf + rtbufsize; hdr += rtm->rtm_msglen) {
 		rtm = (struct rt_msghdr *) hdr;
-		discoverroute(gifinterfaces, rtable, rtm, thunk, arg);
+		count += discoverroute(ifindex, rtable, rtm, thunk, arg);
 	}
 
-	free(rtbuf);
+	return count;
 }
 
-static void
-discoverroute(iface_info *gifinterfaces, int rtable, struct rt_msghdr *rtm,
+static int
+discoverroute(const IfIndex *ifindex, int rtable, struct rt_msghdr *rtm,
     rt_discovered_thunk thunk, void *arg)
 {
-	char ifname[MAX_TUN_IFNAME], *name=NULL;
+	char ifname[MAX_TUN_IFNAME];
+	const char *name = NULL;
 	uint32_t net, netmask, dest;
 	int isaddr;
 
@@ -260,7 +323,7 @@ discoverroute(iface_info *gifinterfaces, int rtable, struct rt_msghdr *rtm,
 
 	// We're only interested in routes to IPv4 addresses.
 	if (netaddr == NULL || netaddr->sa_family != AF_INET)
-		return;
+		return 0;
 	// Routed network is an IPv4 network. Get its address.
 	struct sockaddr_in *sin = (struct sockaddr_in *)netaddr;
 	net = ntohl(sin->sin_addr.s_addr);
@@ -272,7 +335,7 @@ discoverroute(iface_info *gifinterfaces, int rtable, struct rt_msghdr *rtm,
 	//
 	if (gwaddr == NULL)
 		// No gateway. We can't possibly care about this route.
-		return;
+		return 0;
 
 	if (gwaddr->sa_family == AF_LINK) {
 		//
@@ -316,25 +379,25 @@ discoverroute(iface_info *gifinterfaces, int rtable, struct rt_msghdr *rtm,
 			// to store the name in the provided buffer.
 			//
 			fatal("interface name too big");
-			return;
+			return 0;
 		} else if (res == -1) {
 			//
 			// There's no name in the address, just an
 			// OS interface index (unique ID).
 			//
-			// We should have a list of all valid tunnel
+			// We should have a table of all valid tunnel
 			// interfaces built up from the interface
 			// discovery phase. Consult it to see if we
 			// have a name stored for this index.
 			//
-			u_short index = getifindexfromsa(gwaddr);
-			name = lookupifbyindex(gifinterfaces, index);
+			u_short index = getifindexfromsa(ifaddr);
+			name = lookupifbyindex(ifindex, index);
 			if (name == NULL)
 				//
 				// Nope. No name available. We probably
 				// don't care about this route.
 				//
-				return;
+				return 0;
 		} else {
 			//
 			// There was a name available. Use it.
@@ -357,7 +420,7 @@ discoverroute(iface_info *gifinterfaces, int rtable, struct rt_msghdr *rtm,
 		dest = ntohl(sin->sin_addr.s_addr);
 	} else {
 		// Unknown gateway address family.
-		return;
+		return 0;
 	}
 
 	//
@@ -376,13 +439,17 @@ discoverroute(iface_info *gifinterfaces, int rtable, struct rt_msghdr *rtm,
 	}
 
 	thunk(net, netmask, isaddr, dest, name, arg);
+
+	return 1;
 }
 
 void
 discover(int rtable, if_discovered_thunk ifthunk, rt_discovered_thunk rtthunk,
     void *arg)
 {
-	iface_info *interfaces = NULL;
+	IfIndex ifindex;
+	size_t nifs, nrts;
+	uint64_t start, ifsdone, rtsdone;
 
 	// Create prototype tunnel netmask.
 	struct in_addr addr;
@@ -390,20 +457,60 @@ discover(int rtable, if_discovered_thunk ifthunk, rt_discovered_thunk rtthunk,
 	inet_pton(AF_INET, "255.255.255.255", &addr);
 	hostmask = addr.s_addr;
 
-	discoverifs(interfaces, rtable, ifthunk, arg);
-	discoverrts(interfaces, rtable, rtthunk, arg);
+	memset(&ifindex, 0, sizeof(ifindex));
+	start = nanotime();
+	nifs = discoverifs(&ifindex, rtable, ifthunk, arg);
+	ifsdone = nanotime();
+	nrts = discoverrts(&ifindex, rtable, rtthunk, arg);
+	rtsdone = nanotime();
+	free(ifindex.names);
+
+	info("discovered %zu tunnels in %" PRIu64 " us, "
+	    "%zu routes in %" PRIu64 " us",
+	    nifs, (ifsdone - start) / 1000, nrts, (rtsdone - ifsdone) / 1000);
+}
 
-	iface_info *head = interfaces;
+//
+// Discover only the tunnel interfaces.  Used to check a saved
+// snapshot against the system without paying for a route dump.
+//
+void
+discovertunnels(int rtable, if_discovered_thunk ifthunk, void *arg)
+{
+	IfIndex ifindex;
 
-	while (head != NULL) {
-		iface_info *next = head->next;
-		free(head);
-		head = next;
-	}
+	memset(&ifindex, 0, sizeof(ifindex));
+	discoverifs(&ifindex, rtable, ifthunk, arg);
+	free(ifindex.names);
 }
 
 void
 initsys(int rtable)
+{
+	initsysthread(rtable);
+
+	//
+	// Save the route table that we set so that we can check that
+	// all incoming route table modification requests are meant
+	// for said table. (This is merely to check the program for
+	// bitrot).
+	//
+	rtfd_rtable = rtable;
+
+	// Create prototype tunnel netmask.
+	struct in_addr addr;
+	memset(&addr, 0, sizeof(addr));
+	inet_pton(AF_INET, "255.255.255.255", &addr);
+	hostmask = addr.s_addr;
+}
+
+//
+// Open the calling thread's private control and routing sockets.
+// The main thread does this via initsys(); worker threads that
+// bring up tunnels in parallel call this directly.
+//
+void
+initsysthread(int rtable)
 {
 	ctlfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (ctlfd < 0)
@@ -425,20 +532,15 @@ initsys(int rtable)
 	if (setsockopt(rtfd, SOL_SOCKET, SO_SETFIB, &rtable,
 	               sizeof(rtable)) < 0)
 		fatal_err("setsockopt rtfd SO_SETFIB");
+}
 
-	//
-	// Save the route table that we set so that we can check that
-	// all incoming route table modification requests are meant
-	// for said table. (This is merely to check the program for
-	// bitrot).
-	//
-	rtfd_rtable = rtable;
-
-	// Create prototype tunnel netmask.
-	struct in_addr addr;
-	memset(&addr, 0, sizeof(addr));
-	inet_pton(AF_INET, "255.255.255.255", &addr);
-	hostmask = addr.s_addr;
+void
+finisysthread(void)
+{
+	close(ctlfd);
+	close(rtfd);
+	ctlfd = -1;
+	rtfd = -1;
 }
 
 int
@@ -498,6 +600,8 @@ uptunnel(Tunnel *tunnel, int rtable)
 
 	assert(tunnel != NULL);
 	assert(ctlfd >= 0);
+	PROBE5(kernel__uptunnel, tunnel->ifname, tunnel->outer_remote,
+	    tunnel->inner_local, tunnel->inner_remote, rtable);
 
 	// Zero everything.
 	memset(&ifr, 0, sizeof(ifr));
@@ -511,8 +615,11 @@ uptunnel(Tunnel *tunnel, int rtable)
 	// tunnel has been created.
 	//
 	// Before FreeBSD 10.2, the only way to set this value was to
-	// set the FIB on the thread which created the interface.
-	// Set the tunnnel routing domain.
+	// set the FIB of the process which created the interface.  The
+	// FIB is the whole process's, so the lock is held from here
+	// until it is restored, lest another worker's setfib(0) land
+	// before SIOCIFCREATE.
+	pthread_mutex_lock(&fiblock);
 	if (setfib(rtable) < 0)
 		fatal("cannot set tunnel routing table %s: %m",
 		    tunnel->ifname);
@@ -524,10 +631,11 @@ uptunnel(Tunnel *tunnel, int rtable)
 		fatal("create %s failed: %m", tunnel->ifname);
 
 #ifndef SIOCSTUNFIB
-	// Restore thread's FIB
+	// Restore the process's FIB.
 	setfib(0);
+	pthread_mutex_unlock(&fiblock);
 #endif
-	
+
 	// Initialize the alias structure.
 	strlcpy(ifar.ifra_name, tunnel->ifname, sizeof(ifar.ifra_name));
 
@@ -598,6 +706,7 @@ downtunnel(Tunnel *tunnel)
 
 	assert(tunnel != NULL);
 	assert(ctlfd >= 0);
+	PROBE1(kernel__downtunnel, tunnel->ifname);
 	memset(&ifr, 0, sizeof(ifr));
 	strlcpy(ifr.ifr_name, tunnel->ifname, sizeof(ifr.ifr_name));
 	if (ioctl(ctlfd, SIOCIFDESTROY, &ifr) < 0)
@@ -617,7 +726,7 @@ struct Routemsg {
 static size_t
 buildrtmsg(int cmd, Route *route, Tunnel *tunnel, int rtable, Routemsg *msg)
 {
-	static int seqno = 0;
+	static _Thread_local int seqno = 0;
 	struct rt_msghdr *header;
 	struct sockaddr_in *dst, *netmask;
 	struct sockaddr_dl *gw;
@@ -683,6 +792,8 @@ addroute(Route *route, Tunnel *tunnel, int rtable)
 	Routemsg rtmsg;
 	size_t len;
 
+	PROBE4(kernel__addroute, route->ipnet,
+	    netmask2cidr(route->subnetmask), tunnel->ifname, rtable);
 	if (route->subnetmask == hostmask &&
 	    route->ipnet == tunnel->inner_remote)
 	{
@@ -717,6 +828,9 @@ chroute(Route *route, Tunnel *tunnel, int rtable)
 	// to point to a new endpoint.
 	//
 	assert(route->tunnel != NULL);
+	PROBE5(kernel__chroute, route->ipnet,
+	    netmask2cidr(route->subnetmask), route->tunnel->ifname,
+	    tunnel->ifname, rtable);
 	if (route->tunnel->inner_remote == route->ipnet) {
 		tunnel_rebase(route->tunnel, route, rtable);
 		return addroute(route, tunnel, rtable);
@@ -739,6 +853,7 @@ chroute(Route *route, Tunnel *tunnel, int rtable)
 	size_t len = buildrtmsg(RTM_CHANGE, route, tunnel, rtable, &rtmsg);
 	if (write(rtfd, &rtmsg, len) != len) {
 		if (errno == ESRCH) {
+			statinc(kernelfailures);
 			rmroute(route, rtable);
 			return addroute(route, tunnel, rtable);
 		}
@@ -765,6 +880,8 @@ rmroute(Route *route, int rtable)
 	// route being lost then said tunnel needs to be reconfigured
 	// to point to a new endpoint.
 	//
+	PROBE4(kernel__rmroute, route->ipnet,
+	    netmask2cidr(route->subnetmask), route->tunnel->ifname, rtable);
 	if (route->tunnel->inner_remote == route->ipnet) {
 		// Rebase the tunnel. By not re-adding the route afterwards
 		// we will have effectively removed it.
@@ -777,6 +894,7 @@ rmroute(Route *route, int rtable)
 
 	len = buildrtmsg(RTM_DELETE, route, NULL, rtable, &rtmsg);
 	if (write(rtfd, &rtmsg, len) != len) {
+		statinc(kernelfailures);
 		if (errno != ESRCH) {
 			char net[INET_ADDRSTRLEN];
 			ipaddrstr(route->ipnet, net);
@@ -828,6 +946,8 @@ tunnel_rebase(Tunnel *tunnel, Route *route, int rtable)
 	//
 	tunnel->inner_remote = newrt->ipnet;
 	tunnel_configure_inner(tunnel, TUN_ADDR_ADD);
+	record(REC_TUNNEL_REBASE, newrt->ipnet, 32,
+	    tunnel->outer_remote, tunnel->ifnum, route->ipnet);
 
 	//
 	// Add back all the other routes that were attached to this interface.
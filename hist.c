@@ -0,0 +1,105 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bits.h"
+#include "hist.h"
+
+// Index of the most significant set bit of 'v', which is not zero.
+static unsigned int
+msb(uint64_t v)
+{
+	return 63 - clz64(v);
+}
+
+size_t
+histbucket(uint64_t value)
+{
+	unsigned int e;
+
+	if (value < HIST_SUB)
+		return value;
+	e = msb(value);
+	if (e >= HIST_MAXEXP)
+		return HIST_BUCKETS - 1;
+
+	return HIST_SUB + (e - HIST_SUBBITS)*HIST_SUB +
+	    ((value >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+// The largest value counted in 'bucket'.
+uint64_t
+histbucketmax(size_t bucket)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	if (bucket >= HIST_BUCKETS - 1)
+		return UINT64_MAX;
+	shift = (bucket - HIST_SUB)/HIST_SUB;
+	sub = (bucket - HIST_SUB) % HIST_SUB;
+
+	return (((uint64_t)HIST_SUB + sub + 1) << shift) - 1;
+}
+
+void
+histrecord(Hist *h, uint64_t value)
+{
+	uint64_t max;
+
+	atomic_fetch_add_explicit(&h->buckets[histbucket(value)], 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (value > max &&
+	    !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+	    memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+//
+// The smallest bucket bound at or below which 'percentile' percent
+// of the recorded values lie, capped at the largest value seen.
+//
+uint64_t
+histpercentile(const Hist *h, double percentile)
+{
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total = 0, seen = 0, rank, max;
+
+	for (size_t k = 0; k < HIST_BUCKETS; k++) {
+		counts[k] = atomic_load_explicit(&h->buckets[k],
+		    memory_order_relaxed);
+		total += counts[k];
+	}
+	if (total == 0)
+		return 0;
+	rank = (uint64_t)(percentile/100.0*total + 0.5);
+	if (rank == 0)
+		rank = 1;
+	if (rank > total)
+		rank = total;
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	for (size_t k = 0; k < HIST_BUCKETS; k++) {
+		seen += counts[k];
+		if (seen >= rank) {
+			uint64_t bound = histbucketmax(k);
+			return (bound < max) ? bound : max;
+		}
+	}
+
+	return max;
+}
+
+void
+histsummary(const Hist *h, HistSummary *s)
+{
+	s->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	s->sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+	s->p50 = histpercentile(h, 50.0);
+	s->p99 = histpercentile(h, 99.0);
+	s->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+}
@@ -0,0 +1,50 @@
+#ifndef RIPD_HIST_H
+#define RIPD_HIST_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Hist Hist;
+typedef struct HistSummary HistSummary;
+
+/*
+ * Log-bucketed latency histograms in the style of HdrHistogram.
+ * Values below HIST_SUB are counted exactly; above that, each power
+ * of two is split into HIST_SUB equal buckets, so any recorded
+ * value is known to within 1/HIST_SUB (about 6%).  Values of
+ * 2^HIST_MAXEXP nanoseconds (about 18 minutes) or more share the
+ * last bucket.
+ *
+ * Recording is a few relaxed atomic adds, so any thread may record
+ * into a histogram while another reads it.
+ */
+enum {
+	HIST_SUBBITS = 4,
+	HIST_SUB = 1 << HIST_SUBBITS,
+	HIST_MAXEXP = 40,
+	HIST_BUCKETS = HIST_SUB + (HIST_MAXEXP - HIST_SUBBITS)*HIST_SUB,
+};
+
+struct Hist {
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast64_t max;
+	atomic_uint_fast64_t buckets[HIST_BUCKETS];
+};
+
+struct HistSummary {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+void histrecord(Hist *h, uint64_t value);
+uint64_t histpercentile(const Hist *h, double percentile);
+void histsummary(const Hist *h, HistSummary *summary);
+size_t histbucket(uint64_t value);
+uint64_t histbucketmax(size_t bucket);
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef RIPD_IPMAPT_H
+#define RIPD_IPMAPT_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bits.h"
+#include "lib.h"
+#include "log.h"
+
+/*
+ * Typed PATRICIA tries, generated per value type.
+ *
+ *	IPMAP_DEFINE(tunnelmap, Tunnel *)
+ *
+ * defines the types tunnelmap, tunnelmapnode and tunnelmapiter and
+ * these static inline functions:
+ *
+ *	tunnelmap *mktunnelmap(void);
+ *	void freetunnelmap(tunnelmap *map);
+ *	Tunnel **tunnelmapfind(tunnelmap *map, uint32_t key, size_t keylen);
+ *	Tunnel **tunnelmapnearest(tunnelmap *map, uint32_t key,
+ *	    size_t keylen);
+ *	Tunnel **tunnelmapinsert(tunnelmap *map, uint32_t key,
+ *	    size_t keylen, Tunnel *value);
+ *	int tunnelmapremove(tunnelmap *map, uint32_t key, size_t keylen,
+ *	    Tunnel **value);
+ *	void tunnelmapwalk(tunnelmap *map, tunnelmapiter *it);
+ *	int tunnelmapnext(tunnelmapiter *it);
+ *	void tunnelmapstats(tunnelmap *map, IPMapStats *stats);
+ *
+ * They behave as their IPMap counterparts, but the value is stored
+ * in the node and returned by address, so a map can hold small
+ * values, or nothing at all, and a key's presence does not depend
+ * on its value being non-NULL.  As with ipmapinsert(), inserting a
+ * key that is already there leaves its value alone.  Iteration is
+ * top-down, in key order, and the loop body is the caller's own
+ * code rather than a thunk, so it can be inlined:
+ *
+ *	tunnelmapiter it;
+ *	for (tunnelmapwalk(map, &it); tunnelmapnext(&it);)
+ *		use(it.key, it.keylen, *it.value);
+ *
+ * The map must not change during a walk.
+ *
+ * Keys are kept whole, in host order, rather than bit-reversed and
+ * split along the path as in IPMap: each node holds its full prefix,
+ * so a lookup compares it directly with the key, and a walk needs
+ * no path.  The root always exists, with an empty prefix.
+ */
+enum {
+	IPMAPT_STACK = 2*32 + 2,	// Pending nodes in a top-down walk.
+};
+
+static inline uint32_t
+ipmaptmask(size_t keylen)
+{
+	return (keylen == 0) ? 0 : ~(uint32_t)0 << (32 - keylen);
+}
+
+// The bit after the first 'depth' of 'key', for depth < 32.
+static inline int
+ipmaptbit(uint32_t key, size_t depth)
+{
+	return (key >> (31 - depth)) & 0x01;
+}
+
+// The number of leading bits 'a' and 'b' have in common.
+static inline size_t
+ipmaptcommon(uint32_t a, uint32_t b)
+{
+	uint32_t x = a ^ b;
+
+	return (x == 0) ? 32 : clz32(x);
+}
+
+#define IPMAP_DEFINE(name, type)					\
+typedef struct name name;						\
+typedef struct name##node name##node;					\
+typedef struct name##iter name##iter;					\
+									\
+struct name##node {							\
+	uint32_t key;							\
+	uint8_t keylen;							\
+	uint8_t present;						\
+	type value;							\
+	name##node *child[2];						\
+};									\
+									\
+struct name {								\
+	name##node *root;						\
+	size_t n;							\
+};									\
+									\
+struct name##iter {							\
+	name##node *stack[IPMAPT_STACK];				\
+	size_t top;							\
+	uint32_t key;							\
+	size_t keylen;							\
+	type *value;							\
+};									\
+									\
+static inline name##node *						\
+name##mknode(uint32_t key, size_t keylen)				\
+{									\
+	name##node *node = calloc(1, sizeof(*node));			\
+	if (node == NULL)						\
+		fatal("malloc");					\
+	node->key = key & ipmaptmask(keylen);				\
+	node->keylen = keylen;						\
+	return node;							\
+}									\
+									\
+static inline name *							\
+mk##name(void)								\
+{									\
+	name *map = calloc(1, sizeof(*map));				\
+	if (map == NULL)						\
+		fatal("malloc");					\
+	map->root = name##mknode(0, 0);					\
+	return map;							\
+}									\
+									\
+static inline void							\
+free##name(name *map)							\
+{									\
+	name##node *stack[IPMAPT_STACK], *node;				\
+	size_t top = 0;							\
+									\
+	if (map == NULL)						\
+		return;							\
+	stack[top++] = map->root;					\
+	while (top > 0) {						\
+		node = stack[--top];					\
+		if (node->child[0] != NULL)				\
+			stack[top++] = node->child[0];			\
+		if (node->child[1] != NULL)				\
+			stack[top++] = node->child[1];			\
+		free(node);						\
+	}								\
+	free(map);							\
+}									\
+									\
+static inline type *							\
+name##find(name *map, uint32_t key, size_t keylen)			\
+{									\
+	name##node *node = map->root;					\
+									\
+	while (node != NULL && node->keylen <= keylen &&		\
+	    ((key ^ node->key) & ipmaptmask(node->keylen)) == 0) {	\
+		if (node->keylen == keylen)				\
+			return node->present ? &node->value : NULL;	\
+		node = node->child[ipmaptbit(key, node->keylen)];	\
+	}								\
+	return NULL;							\
+}									\
+									\
+static inline type *							\
+name##nearest(name *map, uint32_t key, size_t keylen)			\
+{									\
+	name##node *node = map->root;					\
+	type *best = NULL;						\
+									\
+	while (node != NULL && node->keylen <= keylen &&		\
+	    ((key ^ node->key) & ipmaptmask(node->keylen)) == 0) {	\
+		if (node->present)					\
+			best = &node->value;				\
+		if (node->keylen == keylen)				\
+			break;						\
+		node = node->child[ipmaptbit(key, node->keylen)];	\
+	}								\
+	return best;							\
+}									\
+									\
+static inline type *							\
+name##insert(name *map, uint32_t key, size_t keylen, type value)	\
+{									\
+	name##node *node = map->root, *child, *low;			\
+	size_t common;							\
+									\
+	assert(keylen <= 32);						\
+	key &= ipmaptmask(keylen);					\
+	while (node->keylen != keylen) {				\
+		int bit = ipmaptbit(key, node->keylen);			\
+		child = node->child[bit];				\
+		if (child == NULL) {					\
+			child = name##mknode(key, keylen);		\
+			node->child[bit] = child;			\
+			node = child;					\
+			break;						\
+		}							\
+		if (child->keylen <= keylen && ((key ^ child->key) &	\
+		    ipmaptmask(child->keylen)) == 0) {			\
+			node = child;					\
+			continue;					\
+		}							\
+		/*							\
+		 * Split the child where the keys part.  Its node	\
+		 * stays where it is, as the upper half, so that the	\
+		 * top of the trie stays in the oldest, densest		\
+		 * allocations; the lower half is the new node.	\
+		 */							\
+		common = ipmaptcommon(key, child->key);			\
+		if (common > keylen)					\
+			common = keylen;				\
+		low = name##mknode(child->key, child->keylen);		\
+		*low = *child;						\
+		child->key &= ipmaptmask(common);			\
+		child->keylen = common;					\
+		child->present = 0;					\
+		child->child[0] = NULL;					\
+		child->child[1] = NULL;					\
+		child->child[ipmaptbit(low->key, common)] = low;	\
+		node = child;						\
+		if (common < keylen) {					\
+			child = name##mknode(key, keylen);		\
+			node->child[ipmaptbit(key, common)] = child;	\
+			node = child;					\
+		}							\
+		break;							\
+	}								\
+	if (!node->present) {						\
+		node->present = 1;					\
+		node->value = value;					\
+		map->n++;						\
+	}								\
+	return &node->value;						\
+}									\
+									\
+static inline int							\
+name##remove(name *map, uint32_t key, size_t keylen, type *value)	\
+{									\
+	name##node *node = map->root, *parent = NULL, *only;		\
+	name##node **slot = NULL, **pslot = NULL;			\
+									\
+	while (node != NULL && node->keylen < keylen &&			\
+	    ((key ^ node->key) & ipmaptmask(node->keylen)) == 0) {	\
+		pslot = slot;						\
+		parent = node;						\
+		slot = &node->child[ipmaptbit(key, node->keylen)];	\
+		node = *slot;						\
+	}								\
+	if (node == NULL || node->keylen != keylen ||			\
+	    ((key ^ node->key) & ipmaptmask(keylen)) != 0 ||		\
+	    !node->present)						\
+		return 0;						\
+	if (value != NULL)						\
+		*value = node->value;					\
+	node->present = 0;						\
+	map->n--;							\
+	if (slot == NULL || (node->child[0] != NULL &&			\
+	    node->child[1] != NULL))					\
+		return 1;						\
+	*slot = (node->child[0] != NULL) ? node->child[0] :		\
+	    node->child[1];						\
+	free(node);							\
+	if (*slot != NULL || pslot == NULL || parent->present)		\
+		return 1;						\
+	only = (parent->child[0] != NULL) ? parent->child[0] :		\
+	    parent->child[1];						\
+	*pslot = only;							\
+	free(parent);							\
+	return 1;							\
+}									\
+									\
+static inline void							\
+name##walk(name *map, name##iter *it)					\
+{									\
+	it->stack[0] = map->root;					\
+	it->top = 1;							\
+}									\
+									\
+static inline int							\
+name##next(name##iter *it)						\
+{									\
+	while (it->top > 0) {						\
+		name##node *node = it->stack[--it->top];		\
+		if (node->child[1] != NULL)				\
+			it->stack[it->top++] = node->child[1];		\
+		if (node->child[0] != NULL)				\
+			it->stack[it->top++] = node->child[0];		\
+		if (node->present) {					\
+			it->key = node->key;				\
+			it->keylen = node->keylen;			\
+			it->value = &node->value;			\
+			return 1;					\
+		}							\
+	}								\
+	return 0;							\
+}									\
+									\
+static inline void							\
+name##stats(name *map, IPMapStats *stats)				\
+{									\
+	name##node *stack[IPMAPT_STACK], *node;				\
+	size_t depths[IPMAPT_STACK], top = 0, depth;			\
+									\
+	memset(stats, 0, sizeof(*stats));				\
+	stack[top] = map->root;						\
+	depths[top++] = 0;						\
+	while (top > 0) {						\
+		node = stack[--top];					\
+		depth = depths[top];					\
+		stats->nodes++;						\
+		if (depth > stats->maxdepth)				\
+			stats->maxdepth = depth;			\
+		if (node->present) {					\
+			stats->data++;					\
+			stats->depth[depth]++;				\
+		}							\
+		for (int k = 0; k < 2; k++) {				\
+			if (node->child[k] == NULL)			\
+				continue;				\
+			stack[top] = node->child[k];			\
+			depths[top++] = depth + 1;			\
+		}							\
+	}								\
+	stats->bytes = stats->nodes*sizeof(name##node);			\
+}
+
+#endif
@@ -1,10 +1,13 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "bits.h"
 #include "dat.h"
 #include "lib.h"
 #include "log.h"
@@ -23,29 +26,96 @@ isvalidnetmask(uint32_t netmask)
 int
 netmask2cidr(uint32_t netmask)
 {
-	int cidr = 32;
-
 	if (!isvalidnetmask(netmask)) return -1;
-	while (cidr > 0 && (netmask & 0x01) == 0) {
-		netmask >>= 1;
-		cidr--;
-	}
+	if (netmask == 0) return 0;
 
-	return cidr;
+	return 32 - ctz32(netmask);
 }
 
 /*
- * Reverse the bits of an unsigned 32-bit integer.  See Hacker's
- * Delight, second edition, for more details.
+ * Reverse the bits of an unsigned 32-bit integer.  See bits.h.
  */
 uint32_t
 revbits(uint32_t w)
 {
-	w = (w & 0x55555555) << 1 | ((w >> 1) & 0x55555555);
-	w = (w & 0x33333333) << 2 | ((w >> 2) & 0x33333333);
-	w = (w & 0x0F0F0F0F) << 4 | ((w >> 4) & 0x0F0F0F0F);
-	w = w << 24 | (w & 0xFF00) << 8 | ((w >> 8) & 0xFF00) | w >> 24;
-	return w;
+	return brev32(w);
+}
+
+//
+// The low 'n' bits of a word, and a word shifted right by 'n', for
+// any 0 <= n <= 32.  A node directly under the root can hold all 32
+// bits of a host key, and shifting a 32-bit word by 32 is undefined.
+//
+static inline uint32_t
+lowbits(size_t n)
+{
+	return (n >= 32) ? 0xFFFFFFFF : ((uint32_t)1 << n) - 1;
+}
+
+static inline uint32_t
+shiftout(uint32_t w, size_t n)
+{
+	return (n >= 32) ? 0 : w >> n;
+}
+
+const char *ipmapopnames[IPMAP_NOPS] = {
+	[IPMAP_FIND] = "find",
+	[IPMAP_NEAREST] = "nearest",
+	[IPMAP_INSERT] = "insert",
+	[IPMAP_REMOVE] = "remove",
+};
+
+//
+// With IPMAP_STATS, each operation counts the nodes it visits in a
+// local and adds it to a shared total once, on the way out; the
+// totals are read by the metrics thread.  Without it, the counting
+// compiles away.
+//
+#ifdef IPMAP_STATS
+typedef struct IPMapOpStats IPMapOpStats;
+struct IPMapOpStats {
+	atomic_uint_fast64_t calls;
+	atomic_uint_fast64_t visits;
+};
+
+static IPMapOpStats opstats[IPMAP_NOPS];
+
+static void
+countop(int op, size_t visits)
+{
+	atomic_fetch_add_explicit(&opstats[op].calls, 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&opstats[op].visits, visits,
+	    memory_order_relaxed);
+}
+
+#define VISIT(n)	((n)++)
+#define COUNT(op, n)	countop((op), (n))
+#else
+#define VISIT(n)	((void)0)
+#define COUNT(op, n)	((void)(n))
+#endif
+
+//
+// Copy out the operation and node visit counts.  Returns 0, with
+// both zeroed, if lib.c was built without IPMAP_STATS.
+//
+int
+ipmapvisits(uint64_t calls[IPMAP_NOPS], uint64_t visits[IPMAP_NOPS])
+{
+#ifdef IPMAP_STATS
+	for (int k = 0; k < IPMAP_NOPS; k++) {
+		calls[k] = atomic_load_explicit(&opstats[k].calls,
+		    memory_order_relaxed);
+		visits[k] = atomic_load_explicit(&opstats[k].visits,
+		    memory_order_relaxed);
+	}
+	return 1;
+#else
+	memset(calls, 0, IPMAP_NOPS*sizeof(calls[0]));
+	memset(visits, 0, IPMAP_NOPS*sizeof(visits[0]));
+	return 0;
+#endif
 }
 
 void *
@@ -53,24 +123,27 @@ ipmapnearest(IPMap *map, uint32_t key, size_t keylen)
 {
 	uint32_t rkey = revbits(key);
 	IPMap *parent = NULL;
+	size_t visits = 0;
 
 	while (map != NULL && map->keylen <= keylen) {
-		uint32_t rkeymask = (1 << map->keylen) - 1;
-		uint32_t rkeyfrag = rkey & rkeymask;
+		VISIT(visits);
+		uint32_t rkeyfrag = rkey & lowbits(map->keylen);
 		if (map->key != rkeyfrag)
 			break;
-		rkey >>= map->keylen;
+		rkey = shiftout(rkey, map->keylen);
 		keylen -= map->keylen;
 		if (keylen == 0) {
-			if (map->datum != NULL)
+			if (map->datum != NULL) {
+				COUNT(IPMAP_NEAREST, visits);
 				return map->datum;
-			else
+			} else
 				break;
 		}
 		if (map->datum != NULL)
 			parent = map;
 		map = (rkey & 0x01) ? map->right : map->left;
 	}
+	COUNT(IPMAP_NEAREST, visits);
 	if (parent == NULL)
 		return NULL;
 
@@ -81,22 +154,29 @@ void *
 ipmapfind(IPMap *map, uint32_t key, size_t keylen)
 {
 	uint32_t rkey = revbits(key);
+	size_t visits = 0;
 
 	while (map != NULL && map->keylen <= keylen) {
-		uint32_t rkeymask = (1 << map->keylen) - 1;
-		uint32_t rkeyfrag = rkey & rkeymask;
+		VISIT(visits);
+		uint32_t rkeyfrag = rkey & lowbits(map->keylen);
 		if (map->key != rkeyfrag)
 			break;
-		rkey >>= map->keylen;
+		rkey = shiftout(rkey, map->keylen);
 		keylen -= map->keylen;
-		if (keylen == 0)
+		if (keylen == 0) {
+			COUNT(IPMAP_FIND, visits);
 			return map->datum;
+		}
 		map = (rkey & 0x01) ? map->right : map->left;
 	}
+	COUNT(IPMAP_FIND, visits);
 
 	return NULL;
 }
 
+// Nodes in all maps, for monitoring; read from other threads.
+static atomic_size_t livenodes;
+
 static IPMap *
 mknode(uint32_t key, size_t keylen, void *datum)
 {
@@ -105,6 +185,7 @@ mknode(uint32_t key, size_t keylen, void *datum)
 	newnode = calloc(1, sizeof(*newnode));
 	if (newnode == NULL)
 		fatal("malloc failed");
+	atomic_fetch_add_explicit(&livenodes, 1, memory_order_relaxed);
 	newnode->key = key;
 	newnode->keylen = keylen;
 	newnode->datum = datum;
@@ -114,20 +195,26 @@ mknode(uint32_t key, size_t keylen, void *datum)
 	return newnode;
 }
 
-// Return the number of common low-order bits in 'a' and 'b'.
+static void
+freenode(IPMap *node)
+{
+	atomic_fetch_sub_explicit(&livenodes, 1, memory_order_relaxed);
+	free(node);
+}
+
+size_t
+ipmaplivenodes(void)
+{
+	return atomic_load_explicit(&livenodes, memory_order_relaxed);
+}
+
+// Return the number of common low-order bits in 'a' and 'b', up to 'n'.
 static size_t
 cprefix(size_t n, uint32_t a, uint32_t b)
 {
-	size_t bits;
-
-	bits = 0;
-	while (n-- > 0 && (a & 0x01) == (b & 0x01)) {
-		a >>= 1;
-		b >>= 1;
-		bits++;
-	}
+	uint32_t diff = (a ^ b) & lowbits(n);
 
-	return bits;
+	return (diff == 0) ? n : (size_t)ctz32(diff);
 }
 
 static inline size_t
@@ -150,7 +237,7 @@ freeipmap(IPMap *map, void (*freedatum)(void *datum))
 	freeipmap(map->right, freedatum);
 	if (map->datum != NULL)
 		freedatum(map->datum);
-	free(map);
+	freenode(map);
 }
 
 void *
@@ -158,13 +245,16 @@ ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
 {
 	IPMap *map;
 	uint32_t rkey = revbits(key);		// Reverse key bits.
+	size_t visits = 0;
 
 	map = root;
 	while (map != NULL) {
 		IPMap *node = NULL, *newchild = NULL;
 		size_t nkcp = 0;		// Common prefix bits.
 
+		VISIT(visits);
 		if (keylen == map->keylen && rkey == map->key) {
+			COUNT(IPMAP_INSERT, visits);
 			if (map->datum == NULL)
 				map->datum = datum;
 			return map->datum;
@@ -186,6 +276,7 @@ ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
 				assert(map->right == NULL);
 				map->right = mknode(rkey, keylen, datum);
 			}
+			COUNT(IPMAP_INSERT, visits);
 			return datum;
 		}
 		if (nkcp == keylen) {
@@ -204,6 +295,7 @@ ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
 				map->left = NULL;
 				map->right = node;
 			}
+			COUNT(IPMAP_INSERT, visits);
 			return datum;
 		}
 
@@ -215,7 +307,7 @@ ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
 		newchild->left = map->left;
 		newchild->right = map->right;
 		node = mknode(rkey >> nkcp, keylen - nkcp, datum);
-		map->key = rkey & ((1 << nkcp) - 1);
+		map->key = rkey & lowbits(nkcp);
 		map->keylen = nkcp;
 		map->datum = NULL;
 		if (newchild->key & 0x01) {
@@ -227,8 +319,10 @@ ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
 			map->left = newchild;
 			map->right = node;
 		}
+		COUNT(IPMAP_INSERT, visits);
 		return datum;
         }
+	COUNT(IPMAP_INSERT, visits);
 
 	return NULL;
 }
@@ -240,17 +334,20 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
 	uint32_t rkey = revbits(key);		// Reverse key bits.
 	size_t keylen = akeylen;
 	char pkey[INET_ADDRSTRLEN];
+	size_t visits = 0;
 
-	ipaddrstr(key, pkey);
 	pmap = NULL;
 	parent = NULL;
 	map = root;
 	while (map != NULL) {
 		size_t nkcp = 0;		// Common prefix bits.
 
+		VISIT(visits);
 		if (keylen == map->keylen && rkey == map->key) {
 			void *datum = map->datum;
 
+			COUNT(IPMAP_REMOVE, visits);
+
 			if (map->left != NULL && map->right != NULL) {
 				map->datum = NULL;
 			} else if (map->left == NULL && map->right == NULL) {
@@ -263,7 +360,7 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
 
 				// Don't free the root; it is stable.
 				if (map != root)
-					free(map);
+					freenode(map);
 
 				// If we are the root, or our parent has data,
 				// skip the rest of the logic and return the
@@ -290,7 +387,7 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
 				parent->datum = child->datum;
 				parent->left = child->left;
 				parent->right = child->right;
-				free(child);
+				freenode(child);
 			} else {
 				IPMap *child = (map->left != NULL) ?
 				                   map->left : map->right;
@@ -300,13 +397,16 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
 				map->datum = child->datum;
 				map->left = child->left;
 				map->right = child->right;
-				free(child);
+				freenode(child);
 			}
 
 			return datum;
                 }
 		nkcp = cprefix(nmin(keylen, map->keylen), rkey, map->key);
 		if (nkcp != 0 && nkcp != map->keylen) {
+			COUNT(IPMAP_REMOVE, visits);
+			if (logging(LOG_NOTICE))
+				ipaddrstr(key, pkey);
 			notice("ipmapremove: divergent key for %s/%zu (nkcp = %zu, keylen = %zu)",
 			    pkey, akeylen, nkcp, map->keylen);
 			return NULL;
@@ -323,6 +423,9 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
 			map = map->right;
 		}
 	}
+	COUNT(IPMAP_REMOVE, visits);
+	if (logging(LOG_NOTICE))
+		ipaddrstr(key, pkey);
 	notice("ipmapremove: key %s/%zu not found", pkey, akeylen);
 
 	return NULL;
@@ -379,6 +482,731 @@ ipmapdotopdown(IPMap *map,
 		ipmapdorectopdown(map, 0, 0, thunk, arg);
 }
 
+//
+// Find the node heading the subtree of everything under the prefix
+// 'rkey'/'keylen': the first node on the way down whose path covers
+// the whole prefix.  Returns NULL if the map has nothing under it.
+// '*depth' is the length of the path above the node, and '*parent'
+// its parent, or NULL for the root.
+//
+static IPMap *
+subtree(IPMap *map, uint32_t rkey, size_t keylen, size_t *depth,
+    IPMap **parent)
+{
+	size_t d = 0, rem;
+
+	*parent = NULL;
+	while (map != NULL) {
+		rem = keylen - d;
+		if (rem <= map->keylen) {
+			if (cprefix(rem, map->key, shiftout(rkey, d)) != rem)
+				return NULL;
+			*depth = d;
+			return map;
+		}
+		if (cprefix(map->keylen, map->key, shiftout(rkey, d)) !=
+		    map->keylen)
+			return NULL;
+		d += map->keylen;
+		*parent = map;
+		map = ((shiftout(rkey, d) & 0x01) == 0) ?
+		    map->left : map->right;
+	}
+
+	return NULL;
+}
+
+//
+// Call 'thunk' on everything under 'key'/'keylen', the prefix
+// itself included, in the order of ipmapdotopdown().  Only the
+// path down to the prefix and the subtree below it are visited.
+//
+void
+ipmapsubtreedo(IPMap *map, uint32_t key, size_t keylen,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg),
+    void *arg)
+{
+	uint32_t rkey = revbits(key) & lowbits(keylen);
+	IPMap *node, *parent;
+	size_t depth;
+
+	node = subtree(map, rkey, keylen, &depth, &parent);
+	if (node != NULL)
+		ipmapdorectopdown(node, rkey & lowbits(depth), depth, thunk,
+		    arg);
+}
+
+//
+// Detach everything under 'key'/'keylen' and return it as a map of
+// its own, or NULL if there was nothing there.  The subtree is cut
+// off whole: its top node takes on the path above it and goes under
+// a new root, and at most one node is merged to close the gap, so
+// this takes no longer than a lookup however much it removes.  The
+// caller frees the returned map.
+//
+IPMap *
+ipmapsubtreeremove(IPMap *map, uint32_t key, size_t keylen)
+{
+	uint32_t rkey = revbits(key) & lowbits(keylen);
+	IPMap *node, *parent, *root, *child;
+	size_t depth;
+
+	node = subtree(map, rkey, keylen, &depth, &parent);
+	if (node == NULL || (node->datum == NULL && node->left == NULL &&
+	    node->right == NULL))
+		return NULL;
+	if (parent == NULL) {
+		// Everything goes; the root itself stays put.
+		root = mknode(node->key, node->keylen, node->datum);
+		root->left = node->left;
+		root->right = node->right;
+		node->key = 0;
+		node->keylen = 0;
+		node->datum = NULL;
+		node->left = NULL;
+		node->right = NULL;
+		return root;
+	}
+	if (parent->left == node)
+		parent->left = NULL;
+	else
+		parent->right = NULL;
+	node->key = (rkey & lowbits(depth)) | (node->key << depth);
+	node->keylen += depth;
+	root = mknode(0, 0, NULL);
+	if ((node->key & 0x01) == 0)
+		root->left = node;
+	else
+		root->right = node;
+
+	// A parent without a datum is left with one child: merge them.
+	if (parent != map && parent->datum == NULL) {
+		child = (parent->left != NULL) ? parent->left : parent->right;
+		assert(child != NULL);
+		parent->key |= child->key << parent->keylen;
+		parent->keylen += child->keylen;
+		parent->datum = child->datum;
+		parent->left = child->left;
+		parent->right = child->right;
+		freenode(child);
+	}
+
+	return root;
+}
+
+//
+// Sort entries by network number, shorter prefixes first among
+// equal ones, so that every prefix precedes the prefixes it
+// covers.  Host bits below each key's length are cleared first.
+// The sort is a stable LSD radix sort, on the length and then a
+// byte of the key at a time, so it takes linear time and entries
+// with equal keys keep their order.
+//
+void
+ipmapsortentries(IPMapEntry *entries, size_t n)
+{
+	size_t count[256], pos;
+	IPMapEntry *tmp, *from, *to, *swap;
+
+	if (n < 2)
+		return;
+	tmp = calloc(n, sizeof(*tmp));
+	if (tmp == NULL)
+		fatal("malloc");
+	for (size_t k = 0; k < n; k++) {
+		assert(entries[k].keylen <= 32);
+		entries[k].key &= ~lowbits(32 - entries[k].keylen);
+	}
+	from = entries;
+	to = tmp;
+	for (int pass = 0; pass < 5; pass++) {
+		memset(count, 0, sizeof(count));
+		for (size_t k = 0; k < n; k++) {
+			size_t b = (pass == 0) ? from[k].keylen :
+			    (from[k].key >> 8*(pass - 1)) & 0xFF;
+			count[b]++;
+		}
+		pos = 0;
+		for (size_t b = 0; b < 256; b++) {
+			size_t c = count[b];
+			count[b] = pos;
+			pos += c;
+		}
+		for (size_t k = 0; k < n; k++) {
+			size_t b = (pass == 0) ? from[k].keylen :
+			    (from[k].key >> 8*(pass - 1)) & 0xFF;
+			to[count[b]++] = from[k];
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != entries)
+		memcpy(entries, from, n*sizeof(*entries));
+	free(tmp);
+}
+
+//
+// Bulk-load an empty map from 'entries', which are sorted in place
+// with ipmapsortentries().  As with ipmapinsert(), the first datum
+// given for a key is the one kept; after the sort the others
+// directly follow it in 'entries', where the caller can find them.
+// Returns the number of distinct keys.
+//
+// In sorted order each key goes in on the rightmost path of the
+// trie built so far, so rather than descend from the root, we keep
+// that path on a stack, pop the nodes that the new key diverges
+// from, and split or extend below the first that covers it.  Every
+// node is pushed and popped at most once, so building takes time
+// linear in the number of entries, and allocates the nodes in key
+// order, which keeps neighbouring prefixes close together.
+//
+static size_t
+buildsorted(IPMap *map, const IPMapEntry *entries, size_t n)
+{
+	struct {
+		IPMap *node;
+		size_t depth;	// Bits from the root to the node's end.
+	} stack[IPMAP_MAXDEPTH + 2];
+	uint32_t rkey, prevrkey = 0;
+	size_t top = 0, prevlen = 0, nkeys = 0;
+
+	assert(map->keylen == 0 && map->datum == NULL);
+	assert(map->left == NULL && map->right == NULL);
+	stack[0].node = map;
+	stack[0].depth = 0;
+	for (size_t k = 0; k < n; k++) {
+		size_t len = entries[k].keylen, common, depth;
+		void *datum = entries[k].datum;
+		IPMap *parent, *child, *node, **slot;
+
+		rkey = revbits(entries[k].key);
+		if (k > 0 && len == prevlen && rkey == prevrkey)
+			continue;
+		nkeys++;
+
+		// The stack is the path to the previous key.
+		common = cprefix(nmin(len, prevlen), rkey, prevrkey);
+		while (stack[top].depth > common)
+			top--;
+		parent = stack[top].node;
+		depth = stack[top].depth;
+		prevrkey = rkey;
+		prevlen = len;
+		if (depth == len) {
+			if (parent->datum == NULL)
+				parent->datum = datum;
+			continue;
+		}
+		slot = ((shiftout(rkey, depth) & 0x01) == 0) ?
+		    &parent->left : &parent->right;
+		child = *slot;
+		if (child != NULL) {
+			// Split the popped child where the keys diverge.
+			assert(common > depth);
+			node = mknode(shiftout(rkey, depth) &
+			    lowbits(common - depth), common - depth, NULL);
+			child->key = shiftout(child->key, common - depth);
+			child->keylen -= common - depth;
+			if ((child->key & 0x01) == 0)
+				node->left = child;
+			else
+				node->right = child;
+			*slot = node;
+			stack[++top].node = node;
+			stack[top].depth = common;
+			if (common == len) {
+				node->datum = datum;
+				continue;
+			}
+			parent = node;
+			depth = common;
+			slot = ((shiftout(rkey, depth) & 0x01) == 0) ?
+			    &parent->left : &parent->right;
+			assert(*slot == NULL);
+		}
+		node = mknode(shiftout(rkey, depth) & lowbits(len - depth),
+		    len - depth, datum);
+		*slot = node;
+		stack[++top].node = node;
+		stack[top].depth = len;
+	}
+
+	return nkeys;
+}
+
+size_t
+ipmapbuild(IPMap *map, IPMapEntry *entries, size_t n)
+{
+	ipmapsortentries(entries, n);
+	return buildsorted(map, entries, n);
+}
+
+//
+// Two maps compared in lockstep.  A top-down walk of a map meets
+// its keys in the order ipmapsortentries() puts them in, so walking
+// two maps at once and always stepping whichever is behind visits
+// the keys of both in order, with any key in both met at once by
+// both walks: a merge, in time linear in the size of the two maps.
+// The walks keep their own stacks, so they can be interleaved.
+//
+typedef struct IPMapIter IPMapIter;
+struct IPMapIter {
+	struct {
+		IPMap *node;
+		uint32_t key;		// Bit-reversed path to the node.
+		size_t keylen;
+	} stack[IPMAP_MAXDEPTH + 3];
+	size_t top;
+
+	// The current key, with 'datum' NULL once the walk is done.
+	uint32_t key;
+	size_t keylen;
+	void *datum;
+};
+
+static void
+iternext(IPMapIter *it)
+{
+	while (it->top > 0) {
+		IPMap *node = it->stack[--it->top].node;
+		uint32_t key = it->stack[it->top].key;
+		size_t keylen = it->stack[it->top].keylen;
+
+		key |= node->key << keylen;
+		keylen += node->keylen;
+		if (node->right != NULL) {
+			it->stack[it->top].node = node->right;
+			it->stack[it->top].key = key;
+			it->stack[it->top++].keylen = keylen;
+		}
+		if (node->left != NULL) {
+			it->stack[it->top].node = node->left;
+			it->stack[it->top].key = key;
+			it->stack[it->top++].keylen = keylen;
+		}
+		if (node->datum != NULL) {
+			it->key = revbits(key & lowbits(keylen));
+			it->keylen = keylen;
+			it->datum = node->datum;
+			return;
+		}
+	}
+	it->datum = NULL;
+}
+
+static void
+iterinit(IPMapIter *it, IPMap *map)
+{
+	it->top = 0;
+	if (map != NULL) {
+		it->stack[0].node = map;
+		it->stack[0].key = 0;
+		it->stack[0].keylen = 0;
+		it->top = 1;
+	}
+	iternext(it);
+}
+
+//
+// Which of the current keys of two walks comes first: negative for
+// 'a', positive for 'b', zero if they are the same.  A walk that is
+// done comes after everything.
+//
+static int
+itercmp(const IPMapIter *a, const IPMapIter *b)
+{
+	if (a->datum == NULL || b->datum == NULL)
+		return (a->datum == NULL) - (b->datum == NULL);
+	if (a->key != b->key)
+		return (a->key < b->key) ? -1 : 1;
+	if (a->keylen != b->keylen)
+		return (a->keylen < b->keylen) ? -1 : 1;
+	return 0;
+}
+
+//
+// Compare 'old' with 'new', calling 'removed' for each key only in
+// 'old', 'added' for each key only in 'new', and 'changed' for each
+// key in both whose datum differs, in key order.  Any may be NULL.
+// As with ipmapdo(), a callback returning non-zero stops the diff.
+//
+void
+ipmapdiff(IPMap *old, IPMap *new, const IPMapDiff *diff, void *arg)
+{
+	IPMapIter a, b;
+	int c, stop;
+
+	iterinit(&a, old);
+	iterinit(&b, new);
+	while (a.datum != NULL || b.datum != NULL) {
+		stop = 0;
+		c = itercmp(&a, &b);
+		if (c < 0) {
+			if (diff->removed != NULL)
+				stop = diff->removed(a.key, a.keylen, a.datum,
+				    arg);
+			iternext(&a);
+		} else if (c > 0) {
+			if (diff->added != NULL)
+				stop = diff->added(b.key, b.keylen, b.datum,
+				    arg);
+			iternext(&b);
+		} else {
+			if (a.datum != b.datum && diff->changed != NULL)
+				stop = diff->changed(a.key, a.keylen, a.datum,
+				    b.datum, arg);
+			iternext(&a);
+			iternext(&b);
+		}
+		if (stop)
+			return;
+	}
+}
+
+//
+// Merge two maps into a new one holding the keys in either or, with
+// 'both', only those in both.  Where both have a key the datum from
+// 'a' is used.
+//
+static IPMap *
+merge(IPMap *a, IPMap *b, int both)
+{
+	IPMapEntry *entries = NULL, *e;
+	size_t n = 0, max = 0;
+	IPMapIter ia, ib;
+	IPMap *map;
+	int c;
+
+	iterinit(&ia, a);
+	iterinit(&ib, b);
+	while (ia.datum != NULL || ib.datum != NULL) {
+		IPMapIter *from;
+		c = itercmp(&ia, &ib);
+		from = (c <= 0) ? &ia : &ib;
+		if (!both || c == 0) {
+			if (n == max) {
+				max = max ? 2*max : 64;
+				e = reallocarray(entries, max, sizeof(*e));
+				if (e == NULL)
+					fatal("malloc");
+				entries = e;
+			}
+			entries[n].key = from->key;
+			entries[n].keylen = from->keylen;
+			entries[n++].datum = from->datum;
+		}
+		if (c <= 0)
+			iternext(&ia);
+		if (c >= 0)
+			iternext(&ib);
+	}
+	map = mkipmap();
+	buildsorted(map, entries, n);
+	free(entries);
+
+	return map;
+}
+
+IPMap *
+ipmapunion(IPMap *a, IPMap *b)
+{
+	return merge(a, b, 0);
+}
+
+IPMap *
+ipmapintersect(IPMap *a, IPMap *b)
+{
+	return merge(a, b, 1);
+}
+
+static int
+covers(uint32_t key, size_t keylen, uint32_t net, size_t netlen)
+{
+	return netlen <= keylen && ((key ^ net) & ~lowbits(32 - netlen)) == 0;
+}
+
+//
+// Call 'thunk' for each key in 'map', in key order, with the datum
+// of the longest prefix in 'cover' that covers it, or NULL if none
+// does.  A key covers itself.  The prefixes of 'cover' around the
+// current key always nest, so they are kept on a stack, and any
+// that stops covering the current key covers no later one either.
+//
+void
+ipmapcoveredby(IPMap *map, IPMap *cover,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *cover,
+	void *arg),
+    void *arg)
+{
+	struct {
+		uint32_t key;
+		size_t keylen;
+		void *datum;
+	} stack[IPMAP_MAXDEPTH + 1];
+	IPMapIter a, b;
+	size_t top = 0;
+
+	iterinit(&a, map);
+	iterinit(&b, cover);
+	while (a.datum != NULL) {
+		// On a tie, take the cover first: it covers itself.
+		int fromb = b.datum != NULL && itercmp(&a, &b) >= 0;
+		IPMapIter *it = fromb ? &b : &a;
+
+		while (top > 0 && !covers(it->key, it->keylen,
+		    stack[top - 1].key, stack[top - 1].keylen))
+			top--;
+		if (fromb) {
+			assert(top <= IPMAP_MAXDEPTH);
+			stack[top].key = b.key;
+			stack[top].keylen = b.keylen;
+			stack[top++].datum = b.datum;
+			iternext(&b);
+			continue;
+		}
+		if (thunk(a.key, a.keylen, a.datum,
+		    (top > 0) ? stack[top - 1].datum : NULL, arg))
+			return;
+		iternext(&a);
+	}
+}
+
+//
+// Path-copying updates, for maps shared with concurrent readers.
+// Rather than change any node in place, these copy every node on
+// the path from the root to the change and return the new root,
+// sharing everything off the path with the old tree; the old tree
+// stays intact for readers already in it.  Each node the new tree
+// no longer uses is passed to 'retire', to be freed with
+// ipmapfreenode() once no reader can be looking at it.  The root
+// is always copied, and always keeps an empty key.
+//
+typedef struct CopyUpdate CopyUpdate;
+struct CopyUpdate {
+	void (*retire)(IPMap *node, void *arg);
+	void *arg;
+	void *result;
+};
+
+static IPMap *
+copynode(const IPMap *node, CopyUpdate *u)
+{
+	IPMap *copy;
+
+	copy = mknode(node->key, node->keylen, node->datum);
+	copy->left = node->left;
+	copy->right = node->right;
+	u->retire((IPMap *)node, u->arg);
+
+	return copy;
+}
+
+static IPMap *
+copyinsert(IPMap *map, uint32_t rkey, size_t keylen, void *datum,
+    CopyUpdate *u)
+{
+	IPMap *node, *child, *newchild;
+	size_t nkcp;
+
+	if (keylen == map->keylen && rkey == map->key) {
+		if (map->datum != NULL) {
+			u->result = map->datum;
+			return map;
+		}
+		node = copynode(map, u);
+		node->datum = datum;
+		u->result = datum;
+		return node;
+	}
+	nkcp = cprefix(nmin(keylen, map->keylen), rkey, map->key);
+	if (nkcp == 0 || nkcp == map->keylen) {
+		assert(nkcp < keylen);
+		rkey >>= nkcp;
+		keylen -= nkcp;
+		child = ((rkey & 0x01) == 0) ? map->left : map->right;
+		if (child != NULL)
+			newchild = copyinsert(child, rkey, keylen, datum, u);
+		else {
+			newchild = mknode(rkey, keylen, datum);
+			u->result = datum;
+		}
+		if (newchild == child)
+			return map;
+		node = copynode(map, u);
+		if ((rkey & 0x01) == 0)
+			node->left = newchild;
+		else
+			node->right = newchild;
+		return node;
+	}
+	u->result = datum;
+	if (nkcp == keylen) {
+		// The new key is a prefix of this node's: split it.
+		uint32_t tkey = map->key >> keylen;
+		child = mknode(tkey, map->keylen - keylen, map->datum);
+		child->left = map->left;
+		child->right = map->right;
+		node = mknode(rkey, keylen, datum);
+		if ((tkey & 0x01) == 0)
+			node->left = child;
+		else
+			node->right = child;
+		u->retire(map, u->arg);
+		return node;
+	}
+
+	// The keys diverge partway through this node.
+	assert(nkcp < map->keylen);
+	assert(nkcp < keylen);
+	child = mknode(map->key >> nkcp, map->keylen - nkcp, map->datum);
+	child->left = map->left;
+	child->right = map->right;
+	newchild = mknode(rkey >> nkcp, keylen - nkcp, datum);
+	node = mknode(rkey & lowbits(nkcp), nkcp, NULL);
+	if (child->key & 0x01) {
+		node->left = newchild;
+		node->right = child;
+	} else {
+		node->left = child;
+		node->right = newchild;
+	}
+	u->retire(map, u->arg);
+
+	return node;
+}
+
+IPMap *
+ipmapcopyinsert(IPMap *root, uint32_t key, size_t keylen, void *datum,
+    void **result, void (*retire)(IPMap *node, void *arg), void *arg)
+{
+	CopyUpdate u = { retire, arg, NULL };
+	IPMap *newroot;
+
+	assert(root->keylen == 0);
+	newroot = copyinsert(root, revbits(key), keylen, datum, &u);
+	*result = u.result;
+
+	return newroot;
+}
+
+//
+// A copy of 'node', which has no datum and one child, merged with
+// that child.
+//
+static IPMap *
+copymerge(IPMap *node, CopyUpdate *u)
+{
+	IPMap *child, *merged;
+
+	child = (node->left != NULL) ? node->left : node->right;
+	assert(child != NULL && node->datum == NULL);
+	merged = mknode(node->key | (child->key << node->keylen),
+	    node->keylen + child->keylen, child->datum);
+	merged->left = child->left;
+	merged->right = child->right;
+	u->retire(node, u->arg);
+	u->retire(child, u->arg);
+
+	return merged;
+}
+
+static IPMap *
+copyremove(IPMap *map, uint32_t rkey, size_t keylen, int isroot,
+    CopyUpdate *u)
+{
+	IPMap *node, *child, *newchild;
+	size_t nkcp;
+
+	if (keylen == map->keylen && rkey == map->key) {
+		if (map->datum == NULL)
+			return map;
+		u->result = map->datum;
+		if (isroot || (map->left != NULL && map->right != NULL)) {
+			node = copynode(map, u);
+			node->datum = NULL;
+			return node;
+		}
+		if (map->left == NULL && map->right == NULL) {
+			u->retire(map, u->arg);
+			return NULL;
+		}
+		node = copynode(map, u);
+		node->datum = NULL;
+		return copymerge(node, u);
+	}
+	nkcp = cprefix(nmin(keylen, map->keylen), rkey, map->key);
+	if ((nkcp != 0 && nkcp != map->keylen) || nkcp >= keylen)
+		return map;
+	rkey >>= nkcp;
+	keylen -= nkcp;
+	child = ((rkey & 0x01) == 0) ? map->left : map->right;
+	if (child == NULL)
+		return map;
+	newchild = copyremove(child, rkey, keylen, 0, u);
+	if (newchild == child)
+		return map;
+	node = copynode(map, u);
+	if ((rkey & 0x01) == 0)
+		node->left = newchild;
+	else
+		node->right = newchild;
+	if (!isroot && node->datum == NULL &&
+	    (node->left == NULL) != (node->right == NULL))
+		return copymerge(node, u);
+
+	return node;
+}
+
+IPMap *
+ipmapcopyremove(IPMap *root, uint32_t key, size_t keylen, void **result,
+    void (*retire)(IPMap *node, void *arg), void *arg)
+{
+	CopyUpdate u = { retire, arg, NULL };
+	IPMap *newroot;
+
+	assert(root->keylen == 0);
+	newroot = copyremove(root, revbits(key), keylen, 1, &u);
+	*result = u.result;
+
+	return newroot;
+}
+
+void
+ipmapfreenode(IPMap *node)
+{
+	freenode(node);
+}
+
+static void
+ipmapstatsrec(IPMap *map, size_t depth, IPMapStats *stats)
+{
+	if (map == NULL)
+		return;
+	assert(depth <= IPMAP_MAXDEPTH);
+	stats->nodes++;
+	if (depth > stats->maxdepth)
+		stats->maxdepth = depth;
+	if (map->datum != NULL) {
+		stats->data++;
+		stats->depth[depth]++;
+	}
+	ipmapstatsrec(map->left, depth + 1, stats);
+	ipmapstatsrec(map->right, depth + 1, stats);
+}
+
+//
+// Describe the shape of a map.  'bytes' counts the nodes only, not
+// the allocator's overhead or the data they point to.
+//
+void
+ipmapstats(IPMap *map, IPMapStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	ipmapstatsrec(map, 0, stats);
+	stats->bytes = stats->nodes*sizeof(IPMap);
+}
+
 Bitvec *
 mkbitvec(void)
 {
@@ -390,34 +1218,46 @@ freebitvec(Bitvec *bits)
 {
 	assert(bits != NULL);
 	free(bits->words);
+	free(bits->full);
 	free(bits);
 }
 
+// Make room for 'word', doubling the arrays.
+static void
+growbitvec(Bitvec *bits, size_t word)
+{
+	size_t nwords = (bits->nwords == 0) ? 64 : bits->nwords;
+	uint64_t *words, *full;
+
+	while (nwords <= word)
+		nwords *= 2;
+	words = reallocarray(bits->words, nwords, sizeof(uint64_t));
+	full = reallocarray(bits->full, nwords/64, sizeof(uint64_t));
+	if (words == NULL || full == NULL)
+		fatal("malloc failed");
+	memset(&words[bits->nwords], 0,
+	    sizeof(words[0])*(nwords - bits->nwords));
+	memset(&full[bits->nwords/64], 0,
+	    sizeof(full[0])*(nwords - bits->nwords)/64);
+	bits->words = words;
+	bits->full = full;
+	bits->nwords = nwords;
+}
+
 void
 bitset(Bitvec *bits, size_t bit)
 {
-	uint64_t *words;
 	size_t word;
 
 	assert(bits != NULL);
 	word = bit/64;
-	if (word >= bits->nwords) {
-		words = reallocarray(bits->words, word + 1, sizeof(uint64_t));
-		if (words == NULL)
-			fatal("malloc failed");
-		bits->words = words;
-		size_t newwords = word - bits->nwords + 1;
-		memset(&bits->words[bits->nwords], 0,
-		    sizeof(words[0])*newwords);
-		bits->nwords = word + 1;
-	}
+	if (word >= bits->nwords)
+		growbitvec(bits, word);
 	bits->words[word] |= (1ULL << (bit%64));
-	if (bit == bits->firstclr) {
-		const uint64_t noclr = ~0ULL;
-		while (word < bits->nwords && bits->words[word] == noclr)
-			word++;
-		bits->firstclr = word*64;
-	}
+	if (bits->words[word] == ~0ULL)
+		bits->full[word/64] |= (1ULL << (word%64));
+	if (bit == bits->firstclr)
+		bits->firstclr++;
 }
 
 void
@@ -430,6 +1270,7 @@ bitclr(Bitvec *bits, size_t bit)
 	if (word >= bits->nwords)
 		return;
 	bits->words[word] &= ~(1ULL << (bit%64));
+	bits->full[word/64] &= ~(1ULL << (word%64));
 	if (bit < bits->firstclr)
 		bits->firstclr = bit;
 }
@@ -446,11 +1287,85 @@ bitget(const Bitvec *bits, size_t bit)
 	return (bits->words[word] >> (bit%64)) & 0x01;
 }
 
+//
+// Nothing below 'firstclr' is clear, so look in its word first,
+// then use the summary to find the next word that is not full.
+//
 size_t
 nextbit(Bitvec *bits)
 {
+	size_t word, sum, nsum;
+	uint64_t clr;
+
 	assert(bits != NULL);
-	while (bitget(bits, bits->firstclr) == 1)
-		++bits->firstclr;
+	word = bits->firstclr/64;
+	if (word >= bits->nwords)
+		return bits->firstclr;
+	clr = ~bits->words[word] & (~0ULL << (bits->firstclr%64));
+	if (clr == 0) {
+		word++;
+		nsum = bits->nwords/64;
+		sum = word/64;
+		clr = 0;
+		if (sum < nsum)
+			clr = ~bits->full[sum] & (~0ULL << (word%64));
+		while (clr == 0 && ++sum < nsum)
+			clr = ~bits->full[sum];
+		if (clr == 0) {
+			bits->firstclr = bits->nwords*64;
+			return bits->firstclr;
+		}
+		word = sum*64 + ctz64(clr);
+		clr = ~bits->words[word];
+	}
+	bits->firstclr = word*64 + ctz64(clr);
 	return bits->firstclr;
 }
+
+//
+// Each tunnel's routes are a doubly linked list threaded through
+// the routes themselves.  'rprev' points at whatever points at the
+// route, the tunnel's head or the previous route's 'rnext', so a
+// route comes off the list without a search, and is NULL once it
+// is off, so unlinking a route twice is harmless.
+//
+void
+linkroute(Tunnel *tunnel, Route *route)
+{
+	route->rnext = tunnel->routes;
+	if (route->rnext != NULL)
+		route->rnext->rprev = &route->rnext;
+	route->rprev = &tunnel->routes;
+	tunnel->routes = route;
+	route->tunnel = tunnel;
+	route->gateway = tunnel->outer_remote;
+	++tunnel->nref;
+}
+
+void
+unlinkroute(Tunnel *tunnel, Route *route)
+{
+	if (tunnel == NULL || route->rprev == NULL)
+		return;
+	assert(route->tunnel == tunnel);
+	*route->rprev = route->rnext;
+	if (route->rnext != NULL)
+		route->rnext->rprev = route->rprev;
+	route->rnext = NULL;
+	route->rprev = NULL;
+	route->gateway = 0;
+	--tunnel->nref;
+}
+
+/*
+ * Nanoseconds on the monotonic clock.  Only useful for measuring
+ * intervals.
+ */
+uint64_t
+nanotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
@@ -7,16 +7,25 @@
 
 typedef struct Bitvec Bitvec;
 typedef struct IPMap IPMap;
+typedef struct IPMapDiff IPMapDiff;
+typedef struct IPMapEntry IPMapEntry;
+typedef struct IPMapStats IPMapStats;
 typedef struct RIPPacket RIPPacket;
 typedef struct RIPResponse RIPResponse;
+typedef struct Route Route;
+typedef struct Tunnel Tunnel;
 
 /*
  * We use a bit vector to keep track of allocated interfaces.
+ * 'full' summarises 'words': its bit w is set when words[w] is
+ * all ones, so nextbit() skips 64 full words at a time.  Both
+ * arrays grow by doubling; bits beyond 'nwords' words are clear.
  */
 struct Bitvec {
 	uint64_t *words;
-	size_t nwords;
-	size_t firstclr;
+	uint64_t *full;		// One bit per word of 'words'.
+	size_t nwords;		// Allocated, a multiple of 64.
+	size_t firstclr;	// No bit below this is clear.
 };
 
 /*
@@ -32,6 +41,55 @@ struct IPMap {
 	IPMap *right;
 };
 
+/*
+ * One key and datum for ipmapbuild().
+ */
+struct IPMapEntry {
+	uint32_t key;
+	size_t keylen;
+	void *datum;
+};
+
+/*
+ * Callbacks for ipmapdiff().
+ */
+struct IPMapDiff {
+	int (*added)(uint32_t key, size_t keylen, void *datum, void *arg);
+	int (*removed)(uint32_t key, size_t keylen, void *datum, void *arg);
+	int (*changed)(uint32_t key, size_t keylen, void *old, void *new,
+	    void *arg);
+};
+
+enum {
+	IPMAP_MAXDEPTH = 32,	// Each node below the root takes a bit.
+};
+
+/*
+ * The shape of a map, from ipmapstats().  A node's depth is the
+ * number of nodes above it; 'depth' counts the data at each depth,
+ * which is the number of nodes a lookup for them visits, less one.
+ */
+struct IPMapStats {
+	size_t nodes;
+	size_t data;
+	size_t bytes;
+	size_t maxdepth;
+	size_t depth[IPMAP_MAXDEPTH + 1];
+};
+
+/*
+ * Operations counted when lib.c is built with IPMAP_STATS.
+ */
+enum {
+	IPMAP_FIND,
+	IPMAP_NEAREST,
+	IPMAP_INSERT,
+	IPMAP_REMOVE,
+	IPMAP_NOPS,
+};
+
+extern const char *ipmapopnames[IPMAP_NOPS];
+
 bool isvalidnetmask(uint32_t netmask);
 int netmask2cidr(uint32_t netmask);
 uint32_t revbits(uint32_t w);
@@ -39,10 +97,32 @@ IPMap *mkipmap(void);
 void freeipmap(IPMap *map, void (*freedatum)(void *));
 void ipmapdo(IPMap *map, int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg), void *arg);
 void ipmapdotopdown(IPMap *map, int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg), void *arg);
+void ipmapsubtreedo(IPMap *map, uint32_t key, size_t keylen,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg),
+    void *arg);
+IPMap *ipmapsubtreeremove(IPMap *map, uint32_t key, size_t keylen);
 void *ipmapinsert(IPMap *map, uint32_t key, size_t keylen, void *datum);
 void *ipmapremove(IPMap *map, uint32_t key, size_t keylen);
 void *ipmapnearest(IPMap *map, uint32_t key, size_t keylen);
 void *ipmapfind(IPMap *map, uint32_t key, size_t keylen);
+size_t ipmapbuild(IPMap *map, IPMapEntry *entries, size_t n);
+void ipmapsortentries(IPMapEntry *entries, size_t n);
+void ipmapdiff(IPMap *old, IPMap *new, const IPMapDiff *diff, void *arg);
+IPMap *ipmapunion(IPMap *a, IPMap *b);
+IPMap *ipmapintersect(IPMap *a, IPMap *b);
+void ipmapcoveredby(IPMap *map, IPMap *cover,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *cover,
+	void *arg),
+    void *arg);
+IPMap *ipmapcopyinsert(IPMap *root, uint32_t key, size_t keylen,
+    void *datum, void **result, void (*retire)(IPMap *node, void *arg),
+    void *arg);
+IPMap *ipmapcopyremove(IPMap *root, uint32_t key, size_t keylen,
+    void **result, void (*retire)(IPMap *node, void *arg), void *arg);
+void ipmapfreenode(IPMap *node);
+size_t ipmaplivenodes(void);
+void ipmapstats(IPMap *map, IPMapStats *stats);
+int ipmapvisits(uint64_t calls[IPMAP_NOPS], uint64_t visits[IPMAP_NOPS]);
 void ipaddrstr(uint32_t addr, char buf[static INET_ADDRSTRLEN]);
 Bitvec *mkbitvec(void);
 void freebitvec(Bitvec *bits);
@@ -50,6 +130,9 @@ int bitget(const Bitvec *bits, size_t bit);
 void bitset(Bitvec *bits, size_t bit);
 void bitclr(Bitvec *bits, size_t bit);
 size_t nextbit(Bitvec *bits);
+void linkroute(Tunnel *tunnel, Route *route);
+void unlinkroute(Tunnel *tunnel, Route *route);
+uint64_t nanotime(void);
 
 #ifdef USE_COMPAT
 void *reallocarray(void *p, size_t nelem, size_t size);
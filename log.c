@@ -1,48 +1,647 @@
+/*
+ * Logging.
+ *
+ * Until startlogger() is called, messages go straight to syslog.
+ * Afterwards, logmsg() only copies its arguments into a lock-free
+ * ring and a background thread formats and ships them, so a slow
+ * syslogd or console never stalls packet processing.  Records hold
+ * the raw arguments, not the formatted text: the format string is
+ * kept by pointer and walked once to capture each argument by type,
+ * with string arguments copied into the record.
+ *
+ * The ring is a bounded multi-producer queue; each slot carries a
+ * sequence number that says whether it is free for the producer
+ * claiming that position or ready for the logger thread.  When the
+ * ring is full the newest message is dropped and counted, and the
+ * logger reports the number dropped once it catches up.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
-#include <syslog.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
 
 #include "log.h"
 
+typedef struct Conv Conv;
+typedef union LogArg LogArg;
+typedef struct LogRecord LogRecord;
+
+enum {
+	LOG_RING_SIZE = 2048,		// Must be a power of two.
+	LOG_MAX_ARGS = 12,
+	LOG_STRSIZE = 192,
+	LOG_LINESIZE = 1024,
+	LOG_SPECSIZE = 48,
+	LOG_MAXSPEC = LOG_SPECSIZE - 2*12,	// Room to expand two '*'s.
+	FLUSH_WAIT_MS = 2000,
+};
+
+enum ArgKind {
+	ARG_NONE,
+	ARG_INT,
+	ARG_UINT,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR,
+};
+
+enum LengthMod {
+	LEN_NONE,
+	LEN_HH,
+	LEN_H,
+	LEN_L,
+	LEN_LL,
+	LEN_J,
+	LEN_Z,
+	LEN_T,
+	LEN_LD,
+};
+
+// One printf conversion specification within a format.
+struct Conv {
+	const char *start;	// The '%'.
+	const char *end;	// Just past the conversion character.
+	int stars;		// Width and precision arguments.
+	enum LengthMod length;
+	char conv;
+};
+
+union LogArg {
+	intmax_t i;
+	uintmax_t u;
+	double d;
+	const void *p;
+	size_t str;		// Offset into the record's strings.
+};
+
+struct LogRecord {
+	atomic_size_t seq;
+	int level;
+	int err;		// errno at the time of the call, for %m.
+	const char *fmt;
+	int nargs;
+	LogArg args[LOG_MAX_ARGS];
+	char strs[LOG_STRSIZE];
+};
+
+int loglevel = LOG_INFO;
+
+static const struct {
+	const char *name;
+	int level;
+} levels[] = {
+	{ "debug", LOG_DEBUG },
+	{ "info", LOG_INFO },
+	{ "notice", LOG_NOTICE },
+	{ "warning", LOG_WARNING },
+	{ "error", LOG_WARNING },	// The level error() logs at.
+};
+
+static LogRecord *ring;
+static atomic_size_t enqpos;		// Next position producers claim.
+static size_t deqpos;			// Next position the logger ships.
+static atomic_size_t shipped;		// Positions shipped so far.
+static atomic_uint_fast64_t dropped;
+static uint64_t reported;
+static atomic_int running;
+static atomic_int stopping;
+static sem_t ready;
+static pthread_t logger;
+
+static void shipsyslog(int level, const char *msg);
+static void (*sink)(int level, const char *msg) = shipsyslog;
+
 void
 initlog(void)
 {
 	openlog("44ripd", LOG_CONS | LOG_PERROR | LOG_PID, LOG_LOCAL0);
+	setlogmask(LOG_UPTO(loglevel));
 }
 
 void
-debug(const char *fmt, ...)
+setloglevel(int level)
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_DEBUG, fmt, ap);
-	va_end(ap);
+	loglevel = level;
+	setlogmask(LOG_UPTO(level));
+}
+
+int
+parseloglevel(const char *name)
+{
+	for (size_t k = 0; k < sizeof(levels)/sizeof(levels[0]); k++)
+		if (strcmp(levels[k].name, name) == 0)
+			return levels[k].level;
+	return -1;
 }
 
 void
-info(const char *fmt, ...)
+setlogsink(void (*fn)(int level, const char *msg))
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_INFO, fmt, ap);
-	va_end(ap);
+	sink = (fn != NULL) ? fn : shipsyslog;
+}
+
+static void
+shipsyslog(int level, const char *msg)
+{
+	syslog(level, "%s", msg);
+}
+
+//
+// Parse the conversion specification starting at the next '%' in
+// 'fmt' into 'c'.  Returns a pointer just past it, or NULL if there
+// are no more conversions.
+//
+static const char *
+nextconv(const char *fmt, Conv *c)
+{
+	const char *p = strchr(fmt, '%');
+
+	if (p == NULL)
+		return NULL;
+	c->start = p++;
+	c->stars = 0;
+	c->length = LEN_NONE;
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+	if (*p == '*') {
+		c->stars++;
+		p++;
+	} else {
+		while (isdigit((unsigned char)*p))
+			p++;
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			c->stars++;
+			p++;
+		} else {
+			while (isdigit((unsigned char)*p))
+				p++;
+		}
+	}
+	switch (*p) {
+	case 'h':
+		c->length = (*++p == 'h') ? (p++, LEN_HH) : LEN_H;
+		break;
+	case 'l':
+		c->length = (*++p == 'l') ? (p++, LEN_LL) : LEN_L;
+		break;
+	case 'j':
+		c->length = LEN_J;
+		p++;
+		break;
+	case 'z':
+		c->length = LEN_Z;
+		p++;
+		break;
+	case 't':
+		c->length = LEN_T;
+		p++;
+		break;
+	case 'L':
+		c->length = LEN_LD;
+		p++;
+		break;
+	}
+	c->conv = *p;
+	if (*p != '\0')
+		p++;
+	c->end = p;
+
+	return p;
+}
+
+static enum ArgKind
+argkind(int conv)
+{
+	switch (conv) {
+	case 'd': case 'i': case 'c':
+		return ARG_INT;
+	case 'o': case 'u': case 'x': case 'X':
+		return ARG_UINT;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		return ARG_DOUBLE;
+	case 'p':
+		return ARG_PTR;
+	case 's':
+		return ARG_STR;
+	}
+	return ARG_NONE;
+}
+
+//
+// Copy the arguments described by 'fmt' out of 'ap' into 'r'.
+// Conversions beyond LOG_MAX_ARGS are left unconverted.
+//
+static void
+capture(LogRecord *r, int level, int err, const char *fmt, va_list ap)
+{
+	const char *p;
+	size_t used = 0;
+	Conv c;
+
+	r->level = level;
+	r->err = err;
+	r->fmt = fmt;
+	r->nargs = 0;
+	r->strs[LOG_STRSIZE - 1] = '\0';
+	for (p = fmt; (p = nextconv(p, &c)) != NULL;) {
+		enum ArgKind kind = argkind(c.conv);
+		if (r->nargs + c.stars + (kind != ARG_NONE) > LOG_MAX_ARGS)
+			break;
+		for (int k = 0; k < c.stars; k++)
+			r->args[r->nargs++].i = va_arg(ap, int);
+		LogArg *arg = &r->args[r->nargs];
+		switch (kind) {
+		case ARG_NONE:
+			continue;
+		case ARG_INT:
+			switch (c.length) {
+			case LEN_L: arg->i = va_arg(ap, long); break;
+			case LEN_LL: arg->i = va_arg(ap, long long); break;
+			case LEN_J: arg->i = va_arg(ap, intmax_t); break;
+			case LEN_Z: arg->i = va_arg(ap, ssize_t); break;
+			case LEN_T: arg->i = va_arg(ap, ptrdiff_t); break;
+			default: arg->i = va_arg(ap, int); break;
+			}
+			break;
+		case ARG_UINT:
+			switch (c.length) {
+			case LEN_L: arg->u = va_arg(ap, unsigned long); break;
+			case LEN_LL:
+				arg->u = va_arg(ap, unsigned long long);
+				break;
+			case LEN_J: arg->u = va_arg(ap, uintmax_t); break;
+			case LEN_Z: arg->u = va_arg(ap, size_t); break;
+			case LEN_T: arg->u = va_arg(ap, ptrdiff_t); break;
+			default: arg->u = va_arg(ap, unsigned int); break;
+			}
+			break;
+		case ARG_DOUBLE:
+			if (c.length == LEN_LD)
+				arg->d = va_arg(ap, long double);
+			else
+				arg->d = va_arg(ap, double);
+			break;
+		case ARG_PTR:
+			arg->p = va_arg(ap, void *);
+			break;
+		case ARG_STR: {
+			const char *s = va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			if (used >= LOG_STRSIZE - 1) {
+				arg->str = LOG_STRSIZE - 1;
+				break;
+			}
+			size_t n = strnlen(s, LOG_STRSIZE - 1 - used);
+			memcpy(r->strs + used, s, n);
+			r->strs[used + n] = '\0';
+			arg->str = used;
+			used += n + 1;
+			break;
+		}
+		}
+		r->nargs++;
+	}
+}
+
+static size_t
+append(char *buf, size_t len, size_t n, const char *s, size_t slen)
+{
+	if (n + slen >= len)
+		slen = len - 1 - n;
+	memcpy(buf + n, s, slen);
+	n += slen;
+	buf[n] = '\0';
+
+	return n;
+}
+
+//
+// Format the record 'r' into 'buf' as syslog would have.
+//
+static void
+render(const LogRecord *r, char *buf, size_t len)
+{
+	const char *p, *q;
+	size_t n = 0;
+	int arg = 0;
+	Conv c;
+
+	buf[0] = '\0';
+	for (p = r->fmt; (q = nextconv(p, &c)) != NULL; p = q) {
+		n = append(buf, len, n, p, c.start - p);
+		if (c.conv == '%') {
+			n = append(buf, len, n, "%", 1);
+			continue;
+		}
+		if (c.conv == 'm') {
+			const char *s = strerror(r->err);
+			n = append(buf, len, n, s, strlen(s));
+			continue;
+		}
+		enum ArgKind kind = argkind(c.conv);
+		if (kind == ARG_NONE ||
+		    arg + c.stars + 1 > r->nargs ||
+		    c.end - c.start >= LOG_MAXSPEC)
+		{
+			n = append(buf, len, n, c.start, c.end - c.start);
+			continue;
+		}
+
+		// Rebuild the specification with any '*' filled in.
+		char spec[LOG_SPECSIZE];
+		size_t sn = 0;
+		for (const char *s = c.start; s < c.end; s++) {
+			if (*s == '*')
+				sn += snprintf(spec + sn, sizeof(spec) - sn,
+				    "%d", (int)r->args[arg++].i);
+			else if (*s != 'L')
+				spec[sn++] = *s;
+		}
+		spec[sn] = '\0';
+
+		const LogArg *a = &r->args[arg++];
+		char *out = buf + n;
+		size_t room = len - n;
+		int w = 0;
+		switch (kind) {
+		case ARG_INT:
+			switch (c.length) {
+			case LEN_L:
+				w = snprintf(out, room, spec, (long)a->i);
+				break;
+			case LEN_LL:
+				w = snprintf(out, room, spec, (long long)a->i);
+				break;
+			case LEN_J: w = snprintf(out, room, spec, a->i); break;
+			case LEN_Z:
+				w = snprintf(out, room, spec, (ssize_t)a->i);
+				break;
+			case LEN_T:
+				w = snprintf(out, room, spec, (ptrdiff_t)a->i);
+				break;
+			default:
+				w = snprintf(out, room, spec, (int)a->i);
+				break;
+			}
+			break;
+		case ARG_UINT:
+			switch (c.length) {
+			case LEN_L:
+				w = snprintf(out, room, spec,
+				    (unsigned long)a->u);
+				break;
+			case LEN_LL:
+				w = snprintf(out, room, spec,
+				    (unsigned long long)a->u);
+				break;
+			case LEN_J: w = snprintf(out, room, spec, a->u); break;
+			case LEN_Z:
+			case LEN_T:
+				w = snprintf(out, room, spec, (size_t)a->u);
+				break;
+			default:
+				w = snprintf(out, room, spec,
+				    (unsigned int)a->u);
+				break;
+			}
+			break;
+		case ARG_DOUBLE:
+			w = snprintf(out, room, spec, a->d);
+			break;
+		case ARG_PTR:
+			w = snprintf(out, room, spec, a->p);
+			break;
+		case ARG_STR:
+			w = snprintf(out, room, spec, r->strs + a->str);
+			break;
+		case ARG_NONE:
+			break;
+		}
+		if (w > 0)
+			n += ((size_t)w < room) ? (size_t)w : room - 1;
+	}
+	append(buf, len, n, p, strlen(p));
+}
+
+//
+// Claim the next free slot in the ring, or return NULL if the ring
+// is full.  The slot's position is returned through 'posp'.
+//
+static LogRecord *
+claim(size_t *posp)
+{
+	size_t pos = atomic_load_explicit(&enqpos, memory_order_relaxed);
+
+	for (;;) {
+		LogRecord *r = &ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&r->seq,
+		    memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&enqpos,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+			{
+				*posp = pos;
+				return r;
+			}
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&enqpos,
+			    memory_order_relaxed);
+		}
+	}
+}
+
+static void
+enqueue(int level, const char *fmt, va_list ap)
+{
+	int err = errno;
+	size_t pos;
+	LogRecord *r;
+
+	r = claim(&pos);
+	if (r == NULL) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return;
+	}
+	capture(r, level, err, fmt, ap);
+	atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+	sem_post(&ready);
+	errno = err;
+}
+
+//
+// Ship everything that has been published.  Only one thread, the
+// logger or whoever stopped it, drains at a time.
+//
+static void
+drain(void)
+{
+	char line[LOG_LINESIZE];
+
+	for (;;) {
+		LogRecord *r = &ring[deqpos & (LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&r->seq,
+		    memory_order_acquire);
+		if (seq != deqpos + 1)
+			break;
+		int level = r->level;
+		render(r, line, sizeof(line));
+		atomic_store_explicit(&r->seq, deqpos + LOG_RING_SIZE,
+		    memory_order_release);
+		deqpos++;
+		sink(level, line);
+		atomic_store_explicit(&shipped, deqpos, memory_order_release);
+	}
+	uint64_t ndropped = atomic_load_explicit(&dropped,
+	    memory_order_relaxed);
+	if (ndropped != reported) {
+		snprintf(line, sizeof(line),
+		    "log ring full: %" PRIu64 " messages dropped",
+		    ndropped - reported);
+		reported = ndropped;
+		sink(LOG_WARNING, line);
+	}
+}
+
+static void *
+logthread(void *unused)
+{
+	(void)unused;
+	while (!atomic_load(&stopping)) {
+		while (sem_wait(&ready) < 0 && errno == EINTR)
+			;
+		drain();
+	}
+	drain();
+
+	return NULL;
+}
+
+//
+// A forked child has no logger thread, so it logs synchronously.
+//
+static void
+forked(void)
+{
+	atomic_store(&running, 0);
 }
 
 void
-notice(const char *fmt, ...)
+startlogger(void)
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_NOTICE, fmt, ap);
-	va_end(ap);
+	static int atfork;
+
+	if (atomic_load(&running))
+		return;
+	if (!atfork && pthread_atfork(NULL, NULL, forked) != 0)
+		fatal("pthread_atfork");
+	atfork = 1;
+	ring = calloc(LOG_RING_SIZE, sizeof(*ring));
+	if (ring == NULL)
+		fatal("malloc");
+	for (size_t k = 0; k < LOG_RING_SIZE; k++)
+		atomic_init(&ring[k].seq, k);
+	atomic_store(&enqpos, 0);
+	atomic_store(&shipped, 0);
+	deqpos = 0;
+	atomic_store(&stopping, 0);
+	if (sem_init(&ready, 0, 0) < 0)
+		fatal_err("sem_init");
+	if (pthread_create(&logger, NULL, logthread, NULL) != 0)
+		fatal("cannot create logger thread");
+	atomic_store_explicit(&running, 1, memory_order_release);
+}
+
+void
+stoplogger(void)
+{
+	if (!atomic_load(&running))
+		return;
+	atomic_store_explicit(&running, 0, memory_order_release);
+	atomic_store(&stopping, 1);
+	sem_post(&ready);
+	pthread_join(logger, NULL);
+	// Catch anything that raced with the logger's last pass.
+	drain();
+	sem_destroy(&ready);
+	free(ring);
+	ring = NULL;
+}
+
+//
+// Wait, for a bounded time, until everything logged so far has been
+// shipped.
+//
+void
+flushlog(void)
+{
+	struct timespec ts = { 0, 1000000 };
+	size_t target;
+
+	if (!atomic_load_explicit(&running, memory_order_acquire))
+		return;
+	target = atomic_load(&enqpos);
+	sem_post(&ready);
+	for (int k = 0; k < FLUSH_WAIT_MS; k++) {
+		if (atomic_load_explicit(&shipped, memory_order_acquire) >=
+		    target)
+			break;
+		nanosleep(&ts, NULL);
+	}
+}
+
+uint64_t
+logdropped(void)
+{
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+//
+// Write a message on the calling thread.
+//
+static void
+logsync(int level, int err, const char *fmt, va_list ap)
+{
+	if (sink != shipsyslog) {
+		LogRecord r;
+		char line[LOG_LINESIZE];
+		capture(&r, level, err, fmt, ap);
+		render(&r, line, sizeof(line));
+		sink(level, line);
+	} else {
+		errno = err;
+		vsyslog(level, fmt, ap);
+	}
 }
 
 void
-error(const char *fmt, ...)
+logmsg(int level, const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	vsyslog(LOG_WARNING, fmt, ap);
+	if (atomic_load_explicit(&running, memory_order_acquire))
+		enqueue(level, fmt, ap);
+	else
+		logsync(level, errno, fmt, ap);
 	va_end(ap);
 }
 
@@ -50,15 +649,28 @@ void
 fatal(const char *fmt, ...)
 {
 	va_list ap;
+	int err = errno;
+	flushlog();
 	va_start(ap, fmt);
-	vsyslog(LOG_ERR, fmt, ap);
+	logsync(LOG_ERR, err, fmt, ap);
 	va_end(ap);
 	exit(EXIT_FAILURE);
 }
 
+static void
+fatal_errmsg(int err, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	logsync(LOG_ERR, err, fmt, ap);
+	va_end(ap);
+}
+
 void
 fatal_err(const char *msg)
 {
-	syslog(LOG_ERR, "%s: %m", msg);
+	int err = errno;
+	flushlog();
+	fatal_errmsg(err, "%s: %m", msg);
 	exit(EXIT_FAILURE);
 }
@@ -1,11 +1,54 @@
 #ifndef RIPD_LOG_H
 #define RIPD_LOG_H
 
+#include <stdint.h>
+#include <syslog.h>
+
+/*
+ * Messages above the current log level are discarded before their
+ * arguments are evaluated.  Callers that do extra work just to
+ * build a message (e.g. formatting addresses) should check
+ * logging() first.
+ *
+ * Building with NO_DEBUG_LOG removes debug messages entirely.
+ *
+ * Once startlogger() has been called, messages are queued and
+ * written by a background thread, so the format string passed to
+ * logmsg() must outlive the call; in practice it should always be a
+ * string literal.  fatal() flushes the queue before it exits.
+ */
+#ifdef NO_DEBUG_LOG
+#define MAX_LOG_LEVEL	LOG_INFO
+#else
+#define MAX_LOG_LEVEL	LOG_DEBUG
+#endif
+
+extern int loglevel;
+
+#define logging(level)	((level) <= MAX_LOG_LEVEL && (level) <= loglevel)
+
+#define debug(...)	do { \
+	if (logging(LOG_DEBUG)) logmsg(LOG_DEBUG, __VA_ARGS__); \
+} while (0)
+#define info(...)	do { \
+	if (logging(LOG_INFO)) logmsg(LOG_INFO, __VA_ARGS__); \
+} while (0)
+#define notice(...)	do { \
+	if (logging(LOG_NOTICE)) logmsg(LOG_NOTICE, __VA_ARGS__); \
+} while (0)
+#define error(...)	do { \
+	if (logging(LOG_WARNING)) logmsg(LOG_WARNING, __VA_ARGS__); \
+} while (0)
+
 void initlog(void);
-void debug(const char *restrict fmt, ...);
-void info(const char *restrict fmt, ...);
-void notice(const char *restrict fmt, ...);
-void error(const char *restrict fmt, ...);
+void setloglevel(int level);
+int parseloglevel(const char *name);
+void setlogsink(void (*sink)(int level, const char *msg));
+void startlogger(void);
+void stoplogger(void);
+void flushlog(void);
+uint64_t logdropped(void);
+void logmsg(int level, const char *restrict fmt, ...);
 void fatal(const char *restrict fmt, ...);
 void fatal_err(const char *restrict msg);
 
@@ -14,8 +14,8 @@
  * maintains an internal copy of the AMPRNet routing table as
  * well as a set of active tunnels.
  *
- * After processing a RIP packet, the daemon walks through the
- * routing table, looking for routes to expire.  If a route
+ * After processing a RIP packet, the daemon scans the expiry
+ * times of the routes, looking for routes to expire.  If a route
  * expires it is noted for removal from the table.  Expiration
  * time is much greater than the expected interval between
  * RIP broadcasts.
@@ -32,6 +32,11 @@
  * creates and destroys these interfaces as required.  A bitmap
  * of active interfaces is kept and the lowest unused interface
  * number is always allocated when a new tunnel is created.
+ *
+ * On a fresh system the first full RIP cycle creates a tunnel for
+ * nearly every site in the mesh.  Until that first cycle converges,
+ * tunnel bring-up and route installation are handed off to a pool
+ * of worker threads (see pool.c) so they proceed in parallel.
  */
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -41,8 +46,11 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,15 +58,37 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "cap.h"
+#include "ctl.h"
 #include "dat.h"
+#include "dump.h"
+#include "ipmapt.h"
 #include "lib.h"
 #include "log.h"
+#include "metrics.h"
+#include "policy.h"
+#include "pool.h"
+#include "probes.h"
+#include "rec.h"
 #include "rip.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "sys.h"
 
 static int init(int argc, char *argv[]);
 static void learnsys(int rtable);
+static int warmstart(const char *path, int rtable);
+static void loadroutes(IPMapEntry *entries, size_t n);
+static void check_snapshot_tunnel(const char *name, int num,
+    uint32_t outer_local, uint32_t outer_remote, uint32_t inner_local,
+    uint32_t inner_remote, void *arg);
+static void savesnapshot(time_t now);
+static void onsignal(int sig);
+static void dosignals(void);
+static void logphases(void);
 static void cleanup(void);
+static size_t countmap(IPMap *map);
 static void learn_interface_callback(const char *name, int num,
     uint32_t outer_local, uint32_t outer_remote, uint32_t inner_local,
     uint32_t inner_remote, void *arg);
@@ -67,51 +97,68 @@ static void learn_route_callback(uint32_t ipnet, uint32_t mask,
 static int set_expire_time(uint32_t key, size_t keylen, void *routep,
     void *arg);
 static unsigned int strnum(const char *restrict str);
+static void serve(int sd);
 static void riptide(int sd);
+static void parsequery(char *spec);
+static void sendquery(int sd);
+static uint64_t querydeadline(void);
+static int querytimeout(uint64_t now);
+static void querycheck(uint64_t now);
+static void coldstartnote(uint32_t source, uint64_t start, size_t before);
+static int coldstarttimeout(uint64_t now);
+static void coldstartcheck(uint64_t now);
+static void coldstartdone(void);
 static void ripresponse(RIPResponse *response, time_t now);
 static Route *mkroute(uint32_t ipnet, uint32_t subnetmask, uint32_t gateway);
+static void freeroute(void *route);
 static Tunnel *mktunnel(uint32_t outer_local, uint32_t outer_remote,
     uint32_t inner_local, uint32_t inner_remote);
 static void alloctunif(Tunnel *tunnel, Bitvec *interfaces);
-static void unlinkroute(Tunnel *tunnel, Route *route);
-static void linkroute(Tunnel *tunnel, Route *route);
 static void walkexpired(time_t now);
-static int destroy(uint32_t key, size_t keylen, void *routep, void *unused);
+static int destroy(uint32_t key, size_t keylen, void *routep, void *why);
 static void collapse(Tunnel *tunnel);
-static int expire(uint32_t key, size_t keylen, void *routep, void *statep);
+static int expire(void *expiresp, void *routep, void *statep);
 static void usage(const char *restrict prog);
-static int tunnelfindbyname(uint32_t key, size_t keylen, void *datum,
-   void *arg);
-static int tunnelfindbydest(uint32_t key, size_t keylen, void *datum,
-   void *arg);
-static int fix_overlaps(uint32_t key, size_t keylen, void *tunnelp, void *arg);
-static int find_empty(uint32_t key, size_t keylen, void *tunnelp, void *arg);
+static Tunnel *findtunnel(uint32_t outer_remote);
+static void fix_overlaps(Tunnel *tunnel);
 static int unlink_redundant(uint32_t key, size_t keylen, void *routep,
    void *arg);
-static void dump_all(FILE *out);
+static void dummy_free(void *unused);
+static Policy *buildpolicy(void);
+static void reloadpolicy(void);
+
+//
+// Sets of prefixes, specialized with ipmapt.h.  The tunnelmap is in
+// dat.h.
+//
+IPMAP_DEFINE(netset, uint8_t)
 
 typedef struct SystemBuildContext SystemBuildContext;
-typedef struct TunnelFindByNameParams TunnelFindByNameParams;
-typedef struct TunnelFindByDestParams TunnelFindByDestParams;
 typedef struct UnlinkRedundantParams UnlinkRedundantParams;
 typedef struct TunnelList TunnelList;
+typedef struct ColdStart ColdStart;
+typedef struct SnapshotCheck SnapshotCheck;
+typedef struct RIPQuery RIPQuery;
 
 struct SystemBuildContext {
-	IPMap *acceptableroutes;
-	IPMap *tunnels;
+	const Policy *policy;
+	tunnelmap *tunnels;
 	IPMap *routes;
 	const Bitvec *staticinterfaces;
 	Bitvec *interfaces;
-};
-
-struct TunnelFindByNameParams {
-	const char *name;
-	Tunnel *tunnel;
-};
 
-struct TunnelFindByDestParams {
-	uint32_t destaddr;
-	Tunnel *tunnel;
+	//
+	// Indices of the discovered tunnels, so that each discovered
+	// route can find its tunnel without scanning them all.
+	//
+	tunnelmap *tunnelsbyinner;
+	Tunnel **tunnelsbyifnum;
+	size_t ntunnelsbyifnum;
+
+	// Discovered routes, for loadroutes() once all are known.
+	IPMapEntry *found;
+	size_t nfound;
+	size_t maxfound;
 };
 
 struct UnlinkRedundantParams {
@@ -124,22 +171,66 @@ struct TunnelList {
 	TunnelList *next;
 };
 
+//
+// Progress of the first full RIP cycle.  A cycle is sent as one
+// burst, so the first is over once its source, the responder asked
+// with -Q or else the first router heard, has been quiet for
+// COLDSTART_QUIET_MS; with -Q, once the request is finished.
+//
+struct ColdStart {
+	int active;
+	uint32_t source;	// Network order; 0 until the first packet.
+	uint64_t last;		// Nanoseconds; last packet from 'source'.
+	uint64_t began;		// Nanoseconds; first packet with new work.
+	uint64_t finished;	// Nanoseconds; last new work completed.
+	size_t ntunnels;
+	size_t nroutes;
+};
+
+//
+// A whole-table request sent at startup, and the responses to it.
+// The table is considered complete once the responder has been
+// quiet for QUERY_QUIET_MS.
+//
+struct RIPQuery {
+	int pending;
+	struct sockaddr_in to;
+	uint64_t sent;		// Nanoseconds.
+	uint64_t last;		// Nanoseconds; last response received.
+	size_t npackets;
+	size_t nentries;
+};
+
+struct SnapshotCheck {
+	IPMap *tunnels;		// Snapshot tunnels by outer remote address.
+	size_t matched;
+	int mismatch;
+};
+
 enum {
 	CIDR_HOST = 32,
 	RIPV2_PORT = 520,
 	DEFAULT_ROUTE_TABLE = 44,
+	DEFAULT_WORKERS = 8,
+	SNAPSHOT_INTERVAL = 15*60,	// 15 minutes
+	SNAPSHOT_RETRY = 60,		// While a dump is running.
+	QUERY_TIMEOUT_MS = 5000,
+	QUERY_QUIET_MS = 500,
+	COLDSTART_QUIET_MS = 2000,
 	TIMEOUT = 7*24*60*60,	// 7 days
 };
 
 static const char *RIPV2_GROUP = "224.0.0.9";
 static const char *PASSWORD = "pLaInTeXtpAsSwD";
 
-static void * const IGNORE = (void *)0x10;	// Arbitrary.
-static void * const ACCEPT = (void *)0x11;	// Arbitrary.
 
-static IPMap *acceptableroutes;
+static Policy *policy;		// Compiled; replaced on SIGHUP.
+static Policy *cmdpolicy;	// Rules from -A and -I.
+static const char *policypath;
 static IPMap *routes;
-static IPMap *tunnels;
+static tunnelmap *tunnels;
+static Slab *routeslab;		// Hot records are expiry times.
+static Slab *tunnelslab;
 static Bitvec *interfaces;
 static Bitvec *staticinterfaces;
 
@@ -148,6 +239,21 @@ static uint32_t local_outer_addr;
 static uint32_t local_inner_addr;
 static int routetable_bind, routetable_create;
 static int read_from_file;
+static ColdStart coldstart;
+static const char *snapshotpath;
+static const char *recpath;
+static const char *cappath;
+static const char *ctlpath;
+static const char *metricspath;
+static const char *dumppath;
+static CapReader *replay;
+static RIPQuery query;
+static time_t nextsnapshot;
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t dumplatency;
+static volatile sig_atomic_t dumptables;
+static volatile sig_atomic_t reload;
+static sigset_t waitmask;	// Signals are only taken while waiting.
 
 int
 main(int argc, char *argv[])
@@ -155,8 +261,19 @@ main(int argc, char *argv[])
 	int sd;
 
 	sd = init(argc, argv);
-	for (;;)
-		riptide(sd);
+	while (!quit)
+		serve(sd);
+	stoppool();
+	if (snapshotpath != NULL) {
+		waitdumps();
+		writesnapshot(snapshotpath, routetable_create, tunnels, routes);
+	}
+	notice("exiting on signal");
+	closerec();
+	closecapture();
+	finictl();
+	stopmetrics();
+	stoplogger();
 	close(sd);
 
 	return 0;
@@ -167,14 +284,14 @@ init(int argc, char *argv[])
 {
 	const char *local_outer_ip, *local_inner_ip;
 	char *slash;
-	int sd, ch, daemonize, dump;
-	size_t acceptcount;
+	int sd, ch, daemonize, dump, nworkers;
 	struct in_addr addr;
 
 	slash = strrchr(argv[0], '/');
 	prog = (slash == NULL) ? argv[0] : slash + 1;
 	daemonize = 1;
 	dump = 0;
+	nworkers = DEFAULT_WORKERS;
 	read_from_file = 0;
 	interfaces = mkbitvec();
 	staticinterfaces = mkbitvec();
@@ -183,10 +300,13 @@ init(int argc, char *argv[])
 	local_outer_ip = NULL;
 	local_inner_ip = NULL;
 	routes = mkipmap();
-	tunnels = mkipmap();
-	acceptableroutes = mkipmap();
-	acceptcount = 0;
-	while ((ch = getopt(argc, argv, "A:B:DI:T:df:s:")) != -1) {
+	tunnels = mktunnelmap();
+	routeslab = mkslab(sizeof(Route), sizeof(time_t));
+	tunnelslab = mkslab(sizeof(Tunnel), 0);
+	cmdpolicy = mkpolicy();
+	while ((ch = getopt(argc, argv, "A:B:C:DF:I:M:O:P:Q:R:S:T:U:df:l:s:"))
+	    != -1)
+	{
 		switch (ch) {
 		case 'd':
 			daemonize = 0;
@@ -200,11 +320,44 @@ init(int argc, char *argv[])
 		case 'B':
 			routetable_bind = strnum(optarg);
 			break;
+		case 'P':
+			nworkers = strnum(optarg);
+			break;
+		case 'Q':
+			parsequery(optarg);
+			break;
+		case 'l': {
+			int level = parseloglevel(optarg);
+			if (level < 0)
+				fatal("bad log level: %s", optarg);
+			setloglevel(level);
+			break;
+		}
+		case 'C':
+			cappath = optarg;
+			break;
+		case 'R':
+			recpath = optarg;
+			break;
+		case 'U':
+			ctlpath = optarg;
+			break;
+		case 'M':
+			metricspath = optarg;
+			break;
+		case 'O':
+			dumppath = optarg;
+			break;
+		case 'S':
+			snapshotpath = optarg;
+			break;
+		case 'F':
+			policypath = optarg;
+			break;
 		case 'A':
 		case 'I': {
-			void *ignore_accept = (ch == 'A' ? ACCEPT : IGNORE);
 			struct in_addr iroute;
-			size_t icidr;
+			unsigned int icidr;
 
 			slash = strchr(optarg, '/');
 			if (slash == NULL)
@@ -214,9 +367,9 @@ init(int argc, char *argv[])
 				fatal("Bad route addr: %s", optarg);
 			iroute.s_addr = ntohl(iroute.s_addr);
 			icidr = strnum(slash);
-			ipmapinsert(acceptableroutes, iroute.s_addr, icidr,
-			    ignore_accept);
-			acceptcount++;
+			if (icidr > CIDR_HOST)
+				fatal("Bad route cidr: %s", slash);
+			policyadd(cmdpolicy, iroute.s_addr, icidr, ch == 'A');
 			break;
 		}
 		case 's': {
@@ -229,6 +382,11 @@ init(int argc, char *argv[])
 			if (read_from_file)
 				fatal("Can only read from one file.");
 			read_from_file = 1;
+			replay = opencapreader(optarg);
+			if (replay != NULL) {
+				sd = -1;
+				break;
+			}
 			sd = open(optarg, O_RDONLY);
 			if (sd < 0)
 				fatal("Can't open '%s'", optarg);
@@ -247,9 +405,9 @@ init(int argc, char *argv[])
 	if (argc < 2)
 		usage(prog);
 
-	if (acceptcount == 0)
-		// Accept everything by default
-		ipmapinsert(acceptableroutes, 0, 0, ACCEPT);
+	policy = buildpolicy();
+	if (policy == NULL)
+		fatal("cannot load policy");
 
 	local_outer_ip = argv[0];
 	local_inner_ip = argv[1];
@@ -261,11 +419,19 @@ init(int argc, char *argv[])
 	local_inner_addr = ntohl(addr.s_addr);
 
 	initlog();
+	if (recpath != NULL && openrec(recpath, REC_DEFAULT_SLOTS) < 0)
+		fatal("cannot open flight recorder %s", recpath);
+	if (cappath != NULL && !read_from_file &&
+	    opencapture(cappath, CAP_DEFAULT_SIZE) < 0)
+		fatal("cannot open packet capture %s", cappath);
 
-	learnsys(routetable_create);
+	if (snapshotpath == NULL || !warmstart(snapshotpath, routetable_create))
+		learnsys(routetable_create);
+	nextsnapshot = time(NULL) + SNAPSHOT_INTERVAL;
 
+	initdump(policy, tunnels);
 	if (dump) {
-		dump_all(stdout);
+		dumptext(stdout);
 		exit(0);
 	}
 
@@ -273,8 +439,46 @@ init(int argc, char *argv[])
 
 	if (!read_from_file)
 		sd = initsock(RIPV2_GROUP, RIPV2_PORT, routetable_bind);
+	if (ctlpath != NULL)
+		initctl(ctlpath, routes, tunnels);
 
 	cleanup();
+	statset(routes, countmap(routes));
+	statset(tunnels, tunnels->n);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onsignal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;	// No SA_RESTART: interrupt ppoll().
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	//
+	// A control client that goes away before reading its reply must
+	// not kill the daemon: the write fails with EPIPE instead, and
+	// the client is dropped.
+	//
+	signal(SIGPIPE, SIG_IGN);
+
+	//
+	// Block the signals except while serve() waits in ppoll(), so
+	// that a flag set by onsignal() is always acted on before the
+	// next wait.  The threads started below inherit the mask.
+	//
+	sigset_t block;
+	sigemptyset(&block);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGUSR1);
+	sigaddset(&block, SIGUSR2);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &waitmask);
 
 	if (daemonize) {
 		const int no_chdir = 0;
@@ -282,9 +486,123 @@ init(int argc, char *argv[])
 		daemon(no_chdir, no_close);
 	}
 
+	//
+	// Threads do not survive daemon(), so the logger, the pool and
+	// the metrics exporter must be started afterwards.
+	//
+	startlogger();
+	initpool(nworkers, routetable_create);
+	if (metricspath != NULL)
+		startmetrics(metricspath);
+	coldstart.active = 1;
+
+	if (query.to.sin_family != 0 && !read_from_file)
+		sendquery(sd);
+
 	return sd;
 }
 
+//
+// Parse an 'address[:port]' to send a whole-table request to.
+//
+static void
+parsequery(char *spec)
+{
+	char *colon;
+	int port = RIPV2_PORT;
+
+	colon = strchr(spec, ':');
+	if (colon != NULL) {
+		*colon++ = '\0';
+		port = strnum(colon);
+		if (port == 0 || port > 65535)
+			fatal("bad query port: %s", colon);
+	}
+	memset(&query.to, 0, sizeof(query.to));
+	query.to.sin_family = AF_INET;
+	query.to.sin_port = htons(port);
+	if (inet_pton(AF_INET, spec, &query.to.sin_addr) != 1)
+		fatal("bad query address: %s", spec);
+}
+
+static void
+sendquery(int sd)
+{
+	octet packet[MIN_RIP_PACKET_SIZE + 2*RIP_RESPONSE_SIZE];
+	size_t len;
+
+	len = mkriprequest(packet, sizeof(packet), PASSWORD);
+	assert(len != 0);
+	query.sent = nanotime();
+	if (sendto(sd, packet, len, 0, (struct sockaddr *)&query.to,
+	    sizeof(query.to)) < 0)
+	{
+		error("cannot send RIP request: %m");
+		return;
+	}
+	query.pending = 1;
+	coldstart.source = query.to.sin_addr.s_addr;
+	info("sent RIP request to %s:%d", inet_ntoa(query.to.sin_addr),
+	    ntohs(query.to.sin_port));
+}
+
+//
+// The time by which the request is finished: a while after it was
+// sent if nothing has come back, else once the responder has been
+// quiet for QUERY_QUIET_MS.
+//
+static uint64_t
+querydeadline(void)
+{
+	if (query.npackets == 0)
+		return query.sent + (uint64_t)QUERY_TIMEOUT_MS*1000000;
+	return query.last + (uint64_t)QUERY_QUIET_MS*1000000;
+}
+
+//
+// Milliseconds for serve() to wait before the outstanding request
+// is due to finish, or -1 if there is none.
+//
+static int
+querytimeout(uint64_t now)
+{
+	uint64_t deadline;
+
+	if (!query.pending)
+		return -1;
+	deadline = querydeadline();
+	if (now >= deadline)
+		return 0;
+	return (deadline - now + 999999) / 1000000;
+}
+
+//
+// Once the deadline has passed, the table is complete (or the
+// responder never answered) and the time taken is reported.
+//
+static void
+querycheck(uint64_t now)
+{
+	if (!query.pending || now < querydeadline())
+		return;
+	query.pending = 0;
+	if (query.npackets == 0) {
+		notice("no response to RIP request from %s",
+		    inet_ntoa(query.to.sin_addr));
+		// Wait for the first cycle from whichever router sends it.
+		coldstart.source = 0;
+		coldstart.last = 0;
+		return;
+	}
+	uint64_t elapsed = query.last - query.sent;
+	notice("full table from %s: %zu entries in %zu packets, "
+	    "%" PRIu64 ".%03" PRIu64 " ms after request",
+	    inet_ntoa(query.to.sin_addr), query.nentries, query.npackets,
+	    elapsed / 1000000, elapsed / 1000 % 1000);
+	if (coldstart.active)
+		coldstartdone();
+}
+
 enum {
 	MAX_NUM = (1 << 20),
 };
@@ -293,22 +611,34 @@ static void
 learnsys(int rtable)
 {
 	SystemBuildContext ctx;
-	ctx.acceptableroutes = acceptableroutes;
+	tunnelmapiter it;
+	ctx.policy = policy;
 	ctx.tunnels = tunnels;
 	ctx.routes = routes;
 	ctx.staticinterfaces = staticinterfaces;
 	ctx.interfaces = interfaces;
+	ctx.tunnelsbyinner = mktunnelmap();
+	ctx.tunnelsbyifnum = NULL;
+	ctx.ntunnelsbyifnum = 0;
+	ctx.found = NULL;
+	ctx.nfound = 0;
+	ctx.maxfound = 0;
 
 	//
 	// Build an in-memory view of all the tunnels and routes on the
 	// system that appear to be part of the AMPR mesh.
 	//
 	discover(rtable, learn_interface_callback, learn_route_callback, &ctx);
+	freetunnelmap(ctx.tunnelsbyinner);
+	free(ctx.tunnelsbyifnum);
+	loadroutes(ctx.found, ctx.nfound);
+	free(ctx.found);
 
 	//
 	// Find and remove redundant routes from in-memory view.
 	//
-	ipmapdo(tunnels, fix_overlaps, &ctx);
+	for (tunnelmapwalk(tunnels, &it); tunnelmapnext(&it);)
+		fix_overlaps(*it.value);
 
 	//
 	// Give reasonable expiration times for the routes we've discovered.
@@ -318,6 +648,215 @@ learnsys(int rtable)
 	ipmapdo(routes, set_expire_time, &expire);
 }
 
+//
+// Rebuild the in-memory tables from a snapshot written by a previous
+// run, provided the tunnel interfaces on the system still match it
+// exactly and the acceptance policy still accepts every route.  The
+// routes themselves are not checked against the kernel.  Returns 0
+// if the snapshot was not used, in which case the caller should
+// discover the system from scratch.
+//
+static int
+warmstart(const char *path, int rtable)
+{
+	Snapshot *snap;
+	const SnapHeader *header;
+	SnapshotCheck check;
+	IPMapEntry *entries;
+	tunnelmapiter it;
+	uint64_t start;
+	int ok;
+
+	start = nanotime();
+	snap = opensnapshot(path);
+	if (snap == NULL)
+		return 0;
+	header = snap->header;
+	if (header->rtable != rtable) {
+		notice("snapshot %s is for route table %" PRIu32
+		    ", not %d; ignoring", path, header->rtable, rtable);
+		closesnapshot(snap);
+		return 0;
+	}
+
+	check.tunnels = mkipmap();
+	check.matched = 0;
+	check.mismatch = 0;
+	for (uint32_t k = 0; k < header->ntunnels; k++) {
+		const SnapTunnel *st = &snap->tunnels[k];
+		if (st->outer_local != local_outer_addr ||
+		    st->inner_local != local_inner_addr ||
+		    bitget(staticinterfaces, st->ifnum))
+			check.mismatch = 1;
+		ipmapinsert(check.tunnels, st->outer_remote, CIDR_HOST,
+		    (void *)st);
+	}
+	for (uint32_t k = 0; k < header->nroutes && !check.mismatch; k++) {
+		const SnapRoute *sr = &snap->routes[k];
+		int cidr = netmask2cidr(sr->subnetmask);
+		if (cidr < 0 || !policyaccepts(policy, sr->ipnet, cidr) ||
+		    ipmapfind(check.tunnels, sr->gateway, CIDR_HOST) == NULL)
+			check.mismatch = 1;
+	}
+	if (!check.mismatch)
+		discovertunnels(rtable, check_snapshot_tunnel, &check);
+	freeipmap(check.tunnels, dummy_free);
+	ok = !check.mismatch && check.matched == header->ntunnels;
+	if (!ok) {
+		notice("snapshot %s does not match the system; ignoring", path);
+		closesnapshot(snap);
+		return 0;
+	}
+
+	for (uint32_t k = 0; k < header->ntunnels; k++) {
+		const SnapTunnel *st = &snap->tunnels[k];
+		Tunnel *tunnel = mktunnel(st->outer_local, st->outer_remote,
+		    st->inner_local, st->inner_remote);
+		tunnel->ifnum = st->ifnum;
+		memcpy(tunnel->ifname, st->ifname, sizeof(tunnel->ifname));
+		tunnel->ifname[sizeof(tunnel->ifname) - 1] = '\0';
+		tunnelmapinsert(tunnels, tunnel->outer_remote, CIDR_HOST,
+		    tunnel);
+		bitset(interfaces, tunnel->ifnum);
+	}
+	entries = calloc(header->nroutes, sizeof(*entries));
+	if (entries == NULL && header->nroutes != 0)
+		fatal("malloc");
+	for (uint32_t k = 0; k < header->nroutes; k++) {
+		const SnapRoute *sr = &snap->routes[k];
+		Route *route = mkroute(sr->ipnet, sr->subnetmask, sr->gateway);
+		setrouteexpires(route, sr->expires);
+		entries[k].key = route->ipnet;
+		entries[k].keylen = netmask2cidr(route->subnetmask);
+		entries[k].datum = route;
+	}
+	loadroutes(entries, header->nroutes);
+	free(entries);
+
+	//
+	// Unlink the redundant routes, as learnsys() does, so a warm start
+	// leaves the tunnels as a cold start would.
+	//
+	for (tunnelmapwalk(tunnels, &it); tunnelmapnext(&it);)
+		fix_overlaps(*it.value);
+	notice("warm start from %s: %" PRIu32 " tunnels, %" PRIu32
+	    " routes in %" PRIu64 " us", path, header->ntunnels,
+	    header->nroutes, (nanotime() - start) / 1000);
+	closesnapshot(snap);
+
+	return 1;
+}
+
+//
+// Match one of the system's tunnel interfaces against the snapshot.
+//
+static void
+check_snapshot_tunnel(const char *name, int num,
+    uint32_t outer_local, uint32_t outer_remote, uint32_t inner_local,
+    uint32_t inner_remote, void *arg)
+{
+	SnapshotCheck *check = arg;
+	const SnapTunnel *st;
+
+	if (bitget(staticinterfaces, num))
+		return;
+	st = ipmapfind(check->tunnels, outer_remote, CIDR_HOST);
+	if (st == NULL || st->ifnum != num ||
+	    strncmp(st->ifname, name, sizeof(st->ifname)) != 0 ||
+	    st->outer_local != outer_local ||
+	    st->inner_local != inner_local ||
+	    st->inner_remote != inner_remote)
+	{
+		check->mismatch = 1;
+		return;
+	}
+	check->matched++;
+}
+
+//
+// Write the periodic snapshot from a forked child, as a dump is
+// written, so formatting the tables and the fsync() stay off the
+// packet path.  The final snapshot at exit is written in place.
+//
+static void
+savesnapshot(time_t now)
+{
+	pid_t pid;
+
+	pid = forkdump();
+	if (pid < 0) {
+		nextsnapshot = now + SNAPSHOT_RETRY;
+		return;
+	}
+	if (pid == 0) {
+		if (writesnapshot(snapshotpath, routetable_create,
+		    tunnels, routes) < 0)
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+	nextsnapshot = now + SNAPSHOT_INTERVAL;
+}
+
+static void
+onsignal(int sig)
+{
+	switch (sig) {
+	case SIGUSR1:
+		dumplatency = 1;
+		break;
+	case SIGUSR2:
+		dumptables = 1;
+		break;
+	case SIGHUP:
+		reload = 1;
+		break;
+	case SIGCHLD:
+		break;		// Just interrupt poll(); serve() reaps.
+	default:
+		quit = 1;
+	}
+}
+
+//
+// Act on the signals taken during the last wait.
+//
+static void
+dosignals(void)
+{
+	if (dumplatency) {
+		dumplatency = 0;
+		logphases();
+	}
+	if (dumptables) {
+		dumptables = 0;
+		if (dumppath != NULL)
+			dumpfile(dumppath);
+		else
+			notice("no dump file given with -O");
+	}
+	if (reload) {
+		reload = 0;
+		reloadpolicy();
+	}
+}
+
+//
+// Log a summary of each phase's latency histogram.
+//
+static void
+logphases(void)
+{
+	for (int k = 0; k < NPHASES; k++) {
+		HistSummary s;
+		histsummary(&latency[k], &s);
+		if (s.count == 0)
+			continue;
+		notice("latency %s: count %" PRIu64 " p50 %" PRIu64
+		    "ns p99 %" PRIu64 "ns max %" PRIu64 "ns",
+		    phasenames[k], s.count, s.p50, s.p99, s.max);
+	}
+}
+
 static void
 cleanup(void)
 {
@@ -325,7 +864,21 @@ cleanup(void)
 	// Find all tunnels that serve no networks at all.
 	//
 	TunnelList *emptytunnel = NULL;
-	ipmapdo(tunnels, find_empty, &emptytunnel);
+	tunnelmapiter it;
+	for (tunnelmapwalk(tunnels, &it); tunnelmapnext(&it);) {
+		Tunnel *tunnel = *it.value;
+		if (tunnel->routes != NULL) {
+			assert(tunnel->nref > 0);
+			continue;
+		}
+		assert(tunnel->nref == 0);
+		TunnelList *entry = malloc(sizeof(TunnelList));
+		if (entry == NULL)
+			fatal("malloc");
+		entry->tunnel = tunnel;
+		entry->next = emptytunnel;
+		emptytunnel = entry;
+	}
 
 	//
 	// Bring down the empty tunnels.
@@ -338,6 +891,31 @@ cleanup(void)
 	}
 }
 
+static int
+countone(uint32_t key, size_t keylen, void *datum, void *countp)
+{
+	size_t *count = countp;
+
+	(*count)++;
+
+	return 0;
+}
+
+//
+// Number of entries in a map, for seeding the gauges once the
+// tables have been learned.  The gauges are kept up to date from
+// then on.
+//
+static size_t
+countmap(IPMap *map)
+{
+	size_t count = 0;
+
+	ipmapdo(map, countone, &count);
+
+	return count;
+}
+
 static void
 learn_interface_callback(const char *name, int num,
     uint32_t outer_local, uint32_t outer_remote, uint32_t inner_local,
@@ -350,9 +928,7 @@ learn_interface_callback(const char *name, int num,
 
 	assert(bitget(ctx->interfaces, num) == 0);
 
-	void *accept = ipmapnearest(ctx->acceptableroutes, inner_remote,
-	    CIDR_HOST);
-	if (accept != ACCEPT)
+	if (!policyaccepts(ctx->policy, inner_remote, CIDR_HOST))
 		fatal("interface %s has unacceptable destination", name);
 
 	Tunnel *tunnel = mktunnel(outer_local, outer_remote, inner_local,
@@ -361,12 +937,27 @@ learn_interface_callback(const char *name, int num,
 	tunnel->ifnum = num;
 	strncpy(tunnel->ifname, name, sizeof(tunnel->ifname)-1);
 
-	if (ipmapinsert(ctx->tunnels, outer_remote, CIDR_HOST, tunnel)
+	if (*tunnelmapinsert(ctx->tunnels, outer_remote, CIDR_HOST, tunnel)
 	    != tunnel)
 	{
 		fatal("interface %s duplicates another interface", name);
 	}
 	bitset(ctx->interfaces, num);
+
+	tunnelmapinsert(ctx->tunnelsbyinner, inner_remote, CIDR_HOST, tunnel);
+	if (num >= ctx->ntunnelsbyifnum) {
+		size_t n = 2*ctx->ntunnelsbyifnum;
+		if (n <= num)
+			n = num + 1;
+		Tunnel **t = reallocarray(ctx->tunnelsbyifnum, n, sizeof(*t));
+		if (t == NULL)
+			fatal("malloc");
+		memset(t + ctx->ntunnelsbyifnum, 0,
+		    (n - ctx->ntunnelsbyifnum)*sizeof(*t));
+		ctx->tunnelsbyifnum = t;
+		ctx->ntunnelsbyifnum = n;
+	}
+	ctx->tunnelsbyifnum[num] = tunnel;
 }
 
 static void
@@ -377,93 +968,98 @@ learn_route_callback(uint32_t ipnet, uint32_t mask,
 	char net[INET_ADDRSTRLEN];
 	Tunnel *tunnel;
 
-	ipaddrstr(ipnet, net);
 	int cidr = netmask2cidr(mask);
 	if (cidr == -1) {
+		ipaddrstr(ipnet, net);
 		fatal("unusual netmask found in routed network %s/0x%08" PRIx32,
 		    net, mask);
 	}
 
+	tunnel = NULL;
 	if (isaddr) {
-		TunnelFindByDestParams params;
-		params.destaddr = destaddr;
-		params.tunnel = NULL;
-		ipmapdo(tunnels, tunnelfindbydest, &params);
-		tunnel = params.tunnel;
+		Tunnel **t = tunnelmapfind(ctx->tunnelsbyinner, destaddr,
+		    CIDR_HOST);
+		if (t != NULL)
+			tunnel = *t;
 	} else {
-		TunnelFindByNameParams params;
-		params.name = destif;
-		params.tunnel = NULL;
-		ipmapdo(tunnels, tunnelfindbyname, &params);
-		tunnel = params.tunnel;
+		unsigned int num;
+		char c;
+		if (sscanf(destif, "gif%u%c", &num, &c) == 1 &&
+		    num < ctx->ntunnelsbyifnum)
+			tunnel = ctx->tunnelsbyifnum[num];
 	}
 
-	void *accept = ipmapnearest(ctx->acceptableroutes, ipnet, cidr);
+	int accept = policyaccepts(ctx->policy, ipnet, cidr);
 
 	if (tunnel == NULL) {
-		if (accept == ACCEPT) {
+		if (accept) {
+			ipaddrstr(ipnet, net);
 			fatal("acceptable network %s/%d routed to "
 			    "unknown destination", net, cidr);
 		}
 		return;
 	}
-	if (accept != ACCEPT) {
+	if (!accept) {
+		ipaddrstr(ipnet, net);
 		fatal("unacceptable network %s/%d found with managed tunnel",
 		    net, cidr);
 	}
 	
-	Route *route = mkroute(ipnet, mask, tunnel->outer_remote);
-	Route *existing = ipmapinsert(ctx->routes, ipnet, cidr, route);
-
-	if (existing != route) {
-		if (existing->ipnet != route->ipnet ||
-		    existing->subnetmask != route->subnetmask ||
-		    existing->gateway != route->gateway)
-		{
-			char othernet[INET_ADDRSTRLEN],
-			     othergw[INET_ADDRSTRLEN],
-			     gw[INET_ADDRSTRLEN];
-			int othercidr = netmask2cidr(existing->subnetmask);
-			ipaddrstr(route->gateway, gw);
-			ipaddrstr(existing->ipnet, othernet);
-			ipaddrstr(existing->gateway, othergw);
-			fatal("duplicate route for %s/%d->%s detected (other "
-			      "%s/%d->%s", net, cidr, gw, othernet, othercidr,
-			      othergw);
-		}
-		free(route);
-		return;
-	}
-
-	linkroute(tunnel, route);
-}
-
-static int
-tunnelfindbydest(uint32_t key, size_t keylen, void *datum, void *arg)
-{
-	Tunnel *tunnel = datum;
-	TunnelFindByDestParams *params = arg;
-
-	if (tunnel->inner_remote == params->destaddr) {
-		params->tunnel = tunnel;
-		return 1;
+	if (ctx->nfound == ctx->maxfound) {
+		size_t n = ctx->maxfound ? 2*ctx->maxfound : 1024;
+		IPMapEntry *e = reallocarray(ctx->found, n, sizeof(*e));
+		if (e == NULL)
+			fatal("malloc");
+		ctx->found = e;
+		ctx->maxfound = n;
 	}
-
-	return 0;
+	Route *route = mkroute(ipnet, mask, tunnel->outer_remote);
+	ctx->found[ctx->nfound].key = ipnet;
+	ctx->found[ctx->nfound].keylen = cidr;
+	ctx->found[ctx->nfound].datum = route;
+	ctx->nfound++;
 }
 
-static int
-tunnelfindbyname(uint32_t key, size_t keylen, void *datum, void *arg)
+//
+// Bulk-load the empty routes table with the routes in 'entries',
+// and link each to its tunnel.  The same route found twice is
+// dropped, but two different routes for one network are fatal.
+//
+static void
+loadroutes(IPMapEntry *entries, size_t n)
 {
-	Tunnel *tunnel = datum;
-	TunnelFindByNameParams *params = arg;
+	Route *kept = NULL;
 
-	if (strcmp(tunnel->ifname, params->name) == 0) {
-		params->tunnel = tunnel;
-		return 1;
+	ipmapbuild(routes, entries, n);
+	for (size_t k = 0; k < n; k++) {
+		Route *route = entries[k].datum;
+		if (k > 0 && entries[k].key == entries[k - 1].key &&
+		    entries[k].keylen == entries[k - 1].keylen)
+		{
+			if (kept->ipnet != route->ipnet ||
+			    kept->subnetmask != route->subnetmask ||
+			    kept->gateway != route->gateway)
+			{
+				char net[INET_ADDRSTRLEN],
+				     othernet[INET_ADDRSTRLEN],
+				     othergw[INET_ADDRSTRLEN],
+				     gw[INET_ADDRSTRLEN];
+				int cidr = entries[k].keylen;
+				int othercidr = netmask2cidr(kept->subnetmask);
+				ipaddrstr(route->ipnet, net);
+				ipaddrstr(route->gateway, gw);
+				ipaddrstr(kept->ipnet, othernet);
+				ipaddrstr(kept->gateway, othergw);
+				fatal("duplicate route for %s/%d->%s detected "
+				      "(other %s/%d->%s", net, cidr, gw,
+				      othernet, othercidr, othergw);
+			}
+			freeroute(route);
+			continue;
+		}
+		kept = route;
+		linkroute(findtunnel(route->gateway), route);
 	}
-
-	return 0;
 }
 
 static int
@@ -472,7 +1068,7 @@ set_expire_time(uint32_t key, size_t keylen, void *routep, void *arg)
 	Route *route = routep;
 	time_t *when = arg;
 
-	route->expires = *when;
+	setrouteexpires(route, *when);
 
 	return 0;
 }
@@ -491,10 +1087,9 @@ dummy_free(void *unused)
 // routes need to be detected and removed from the discovered route
 // list.
 //
-static int
-fix_overlaps(uint32_t key, size_t keylen, void *tunnelp, void *arg)
+static void
+fix_overlaps(Tunnel *tunnel)
 {
-	Tunnel *tunnel = tunnelp;
 	IPMap *coverage = mkipmap();
 
 	for (Route *route = tunnel->routes; route; route = route->rnext) {
@@ -509,32 +1104,6 @@ fix_overlaps(uint32_t key, size_t keylen, void *tunnelp, void *arg)
 	ipmapdotopdown(coverage, unlink_redundant, &p);
 
 	freeipmap(coverage, dummy_free);
-
-	return 0;
-}
-
-//
-// Find tunnels with no allocated routes.
-//
-static int
-find_empty(uint32_t key, size_t keylen, void *tunnelp, void *tlst_ptr)
-{
-	Tunnel *tunnel = tunnelp;
-	TunnelList **tlst = tlst_ptr;
-
-	if (tunnel->routes == NULL) {
-		assert(tunnel->nref == 0);
-		TunnelList *entry = malloc(sizeof(TunnelList));
-		if (entry == NULL)
-			fatal("malloc");
-		entry->tunnel = tunnel;
-		entry->next = *tlst;
-		*tlst = entry;
-	} else {
-		assert(tunnel->nref > 0);
-	}
-
-	return 0;
 }
 
 static int
@@ -571,6 +1140,63 @@ strnum(const char *restrict str)
 	return (unsigned int)r;
 }
 
+//
+// Wait for a datagram or a control request and handle it.
+//
+void
+serve(int sd)
+{
+	struct pollfd fds[1 + CTL_NFDS];
+	struct timespec ts, *timeout = NULL;
+	uint64_t now;
+	int nfds = 1, ms, cms;
+
+	dosignals();
+	if (read_from_file) {
+		riptide(sd);
+		// Take any signals that arrived while reading.
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		ppoll(NULL, 0, &ts, &waitmask);
+		return;
+	}
+	//
+	// Wait here rather than in recvfrom(), so the time measured
+	// for recvfrom() is the cost of the call and not the wait.
+	// While a whole-table request is outstanding, wake up in time
+	// to finish it even if nothing arrives.
+	//
+	fds[0].fd = sd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	if (ctlactive()) {
+		ctlpollfds(fds + 1);
+		nfds += CTL_NFDS;
+	}
+	reapdumps();
+	now = nanotime();
+	ms = querytimeout(now);
+	cms = coldstarttimeout(now);
+	if (ms < 0 || (cms >= 0 && cms < ms))
+		ms = cms;
+	if (ms >= 0) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (long)(ms % 1000)*1000000;
+		timeout = &ts;
+	}
+	if (ppoll(fds, nfds, timeout, &waitmask) < 0) {
+		if (errno != EINTR)
+			fatal_err("ppoll");
+		return;		// The next call acts on the signal.
+	}
+	if (ctlactive())
+		ctlservice(fds + 1);
+	if (fds[0].revents != 0)
+		riptide(sd);
+	now = nanotime();
+	querycheck(now);
+	coldstartcheck(now);
+}
 
 void
 riptide(int sd)
@@ -580,31 +1206,73 @@ riptide(int sd)
 	socklen_t remotelen;
 	ssize_t n;
 	time_t now;
+	int64_t when;
+	int ok;
 	RIPPacket pkt;
 	octet packet[IP_MAXPACKET];
 
 	memset(&remote, 0, sizeof(remote));
-	remotelen = 0;
+	remotelen = sizeof(remote);
 	rem = (struct sockaddr *)&remote;
-	if (read_from_file) {
+	if (replay != NULL) {
+		n = capread(replay, packet, sizeof(packet), &remote, &when);
+	} else if (read_from_file) {
 		n = read(sd, packet, sizeof(packet));
-		if (n == 0)
-			fatal("done");
 	} else {
-		n = recvfrom(sd, packet, sizeof(packet), 0, rem, &remotelen);
+		timed(PHASE_RECV, n = recvfrom(sd, packet, sizeof(packet), 0,
+		    rem, &remotelen));
+		if (n > 0 && cappath != NULL) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			when = (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+			cappacket(packet, n, &remote, when);
+		}
 	}
-	if (n < 0)
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
 		fatal("socket error");
+	}
+	if (n == 0 && read_from_file) {
+		// The whole file was the first cycle.
+		if (coldstart.active)
+			coldstartdone();
+		fatal("done");
+	}
+	statinc(packets);
+	PROBE3(packet__receive, ntohl(remote.sin_addr.s_addr),
+	    ntohs(remote.sin_port), n);
 	memset(&pkt, 0, sizeof(pkt));
-	if (parserippkt(packet, n, &pkt) < 0) {
+	timed(PHASE_PARSE, ok = parserippkt(packet, n, &pkt));
+	PROBE2(packet__parse, ntohl(remote.sin_addr.s_addr), ok);
+	if (ok < 0) {
+		statinc(parseerrors);
 		error("packet parse error");
 		return;
 	}
-	if (verifyripauth(&pkt, PASSWORD) < 0) {
+	timed(PHASE_AUTH, ok = verifyripauth(&pkt, PASSWORD));
+	PROBE2(packet__auth, ntohl(remote.sin_addr.s_addr), ok);
+	if (ok < 0) {
+		statinc(authfailures);
 		error("packet authentication failed");
 		return;
 	}
-	now = time(NULL);
+	if (pkt.command != RIP_CMD_RESPONSE) {
+		debug("ignoring RIP command %d", pkt.command);
+		return;
+	}
+	if (query.pending &&
+	    remote.sin_addr.s_addr == query.to.sin_addr.s_addr)
+	{
+		query.last = nanotime();
+		query.npackets++;
+		query.nentries += pkt.nresponse;
+	}
+	// A replayed capture runs on the time it was recorded.
+	now = (replay != NULL) ? when / 1000000000 : time(NULL);
+	uint64_t start = coldstart.active ? nanotime() : 0;
+	size_t before = coldstart.ntunnels + coldstart.nroutes;
+	uint64_t began = nanotime();
 	for (int k = 0; k < pkt.nresponse; k++) {
 		RIPResponse response;
 		memset(&response, 0, sizeof(response));
@@ -614,65 +1282,168 @@ riptide(int sd)
 		}
 		ripresponse(&response, now);
 	}
-	walkexpired(now);
+	histrecord(&latency[PHASE_RESPONSES], nanotime() - began);
+	if (coldstart.active)
+		coldstartnote(remote.sin_addr.s_addr, start, before);
+	timed(PHASE_EXPIRE, walkexpired(now));
+	if (snapshotpath != NULL && now >= nextsnapshot)
+		savesnapshot(now);
+}
+
+//
+// Called after each packet during the first RIP cycle, which began
+// processing at 'start' with 'before' tunnels and routes created.
+// The bring-up work the packet queued is left to the pool.
+//
+static void
+coldstartnote(uint32_t source, uint64_t start, size_t before)
+{
+	if (coldstart.ntunnels + coldstart.nroutes != before) {
+		if (coldstart.began == 0)
+			coldstart.began = start;
+		coldstart.finished = nanotime();
+	}
+	if (coldstart.source == 0)
+		coldstart.source = source;
+	if (source == coldstart.source)
+		coldstart.last = nanotime();
+}
+
+//
+// Milliseconds for serve() to wait before the first cycle is over,
+// or -1 if it has not started or ends with the -Q request.
+//
+static int
+coldstarttimeout(uint64_t now)
+{
+	uint64_t deadline;
+
+	if (!coldstart.active || coldstart.last == 0 || query.pending)
+		return -1;
+	deadline = coldstart.last + (uint64_t)COLDSTART_QUIET_MS*1000000;
+	if (now >= deadline)
+		return 0;
+	return (deadline - now + 999999) / 1000000;
+}
+
+static void
+coldstartcheck(uint64_t now)
+{
+	if (coldstarttimeout(now) == 0)
+		coldstartdone();
+}
+
+//
+// The first cycle is over: wait for the bring-up work still queued,
+// report the time from the first new tunnel or route to the last
+// one installed, and retire the worker pool.
+//
+static void
+coldstartdone(void)
+{
+	uint64_t done;
+
+	pooldrain();
+	done = poollastdone();
+	if (coldstart.began != 0) {
+		if (done > coldstart.finished)
+			coldstart.finished = done;
+		uint64_t elapsed = coldstart.finished - coldstart.began;
+		notice("cold start converged: %zu tunnels, %zu routes "
+		    "in %" PRIu64 ".%03" PRIu64 " seconds",
+		    coldstart.ntunnels, coldstart.nroutes,
+		    elapsed / 1000000000, elapsed / 1000000 % 1000);
+	} else {
+		info("no cold start needed: all routes already present");
+	}
+	coldstart.active = 0;
+	stoppool();
 }
 
 void
 ripresponse(RIPResponse *response, time_t now)
 {
 	Route *route;
-	void *acceptance;
 	Tunnel *tunnel;
 	int cidr;
 	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
 
 	cidr = netmask2cidr(response->subnetmask);
-	ipaddrstr(response->ipaddr, proute);
-	ipaddrstr(response->nexthop, gw);
+
+	//
+	// Every message below is at info level or finer, except for
+	// the malformed route warning.  Only format the addresses if
+	// one of them can be logged.
+	//
+	if (logging(LOG_INFO)) {
+		ipaddrstr(response->ipaddr, proute);
+		ipaddrstr(response->nexthop, gw);
+	}
 	debug("RIPv2 response: %s/%d -> %s", proute, cidr, gw);
-	if (response->ipaddr & ~response->subnetmask)
+	if (response->ipaddr & ~response->subnetmask) {
+		if (logging(LOG_WARNING))
+			ipaddrstr(response->ipaddr, proute);
 		error("route ipaddr %s has more bits than netmask, %d",
 		    proute, cidr);
+	}
 	response->ipaddr &= response->subnetmask;
 	if (response->nexthop == local_outer_addr) {
 		info("skipping route for %s/%d to local address",
 		    proute, cidr);
+		PROBE4(route__skipped, response->ipaddr, cidr,
+		    response->nexthop, "local");
 		return;
 	}
 	if ((response->nexthop & response->subnetmask) == response->ipaddr) {
 		info("skipping gateway inside of subnet (%s/%d -> %s)",
 		    proute, cidr, gw);
+		PROBE4(route__skipped, response->ipaddr, cidr,
+		    response->nexthop, "inside");
 		return;
 	}
-	acceptance = ipmapnearest(acceptableroutes, response->ipaddr, cidr);
-	if (acceptance == NULL || acceptance != ACCEPT) {
+	if (!policyaccepts(policy, response->ipaddr, cidr)) {
 		info("skipping ignored network %s/%d", proute, cidr);
+		PROBE3(route__ignored, response->ipaddr, cidr,
+		    response->nexthop);
 		return;
 	}
-	tunnel = ipmapfind(tunnels, response->nexthop, CIDR_HOST);
+	tunnel = findtunnel(response->nexthop);
 	if (tunnel == NULL) {
 		debug("creating new tunnel for %s/%d -> %s", proute, cidr,
 		    gw);
 		tunnel = mktunnel(local_outer_addr, response->nexthop,
 		    local_inner_addr, response->ipaddr);
 		alloctunif(tunnel, interfaces);
-		uptunnel(tunnel, routetable_create);
-		ipmapinsert(tunnels, response->nexthop, CIDR_HOST, tunnel);
+		if (coldstart.active && poolactive())
+			poolup(tunnel);
+		else
+			timed(PHASE_UPTUNNEL,
+			    uptunnel(tunnel, routetable_create));
+		tunnelmapinsert(tunnels, response->nexthop, CIDR_HOST, tunnel);
+		statinc(tunnelscreated);
+		statadd(tunnels, 1);
+		record(REC_TUNNEL_UP, tunnel->inner_remote, CIDR_HOST,
+		    tunnel->outer_remote, tunnel->ifnum, 0);
+		if (coldstart.active)
+			coldstart.ntunnels++;
 	}
 	route = ipmapfind(routes, response->ipaddr, cidr);
 	if (route == NULL) {
 		Route *cover = ipmapnearest(routes, response->ipaddr, cidr);
 		if (cover != NULL) {
 			char covernet[INET_ADDRSTRLEN];
-			ipaddrstr(cover->ipnet, covernet);
-			int covercidr = netmask2cidr(cover->subnetmask);	
+			if (logging(LOG_INFO))
+				ipaddrstr(cover->ipnet, covernet);
+			int covercidr = netmask2cidr(cover->subnetmask);
 			if (cover->tunnel == tunnel) {
 				info("skipping network %s/%d because it is "
 				    "served by %s/%d", proute, cidr, covernet,
 				    covercidr);
+				PROBE4(route__skipped, response->ipaddr, cidr,
+				    response->nexthop, "covered");
 				return;
 			}
-			debug("branching network %s/%d off of %s/d",
+			debug("branching network %s/%d off of %s/%d",
 			    proute, cidr, covernet, covercidr);
 		}
 		route = mkroute(
@@ -680,25 +1451,46 @@ ripresponse(RIPResponse *response, time_t now)
 		    response->subnetmask,
 		    response->nexthop);
 		ipmapinsert(routes, route->ipnet, cidr, route);
+		statinc(routesadded);
+		statadd(routes, 1);
+		PROBE3(route__new, route->ipnet, cidr, response->nexthop);
 		info("Added route %s/%d -> %s", proute, cidr, gw);
+		if (coldstart.active)
+			coldstart.nroutes++;
 	}
 	if (route->tunnel != tunnel) {
 		// The route is new or moved to a different tunnel.
 		if (route->tunnel == NULL) {
-			debug("no tunnel for %s/%d, adding new route via %s",
-			    proute, cidr, gw, tunnel->ifname);
-			addroute(route, tunnel, routetable_create);
+			debug("no tunnel for %s/%d, adding new route via "
+			    "%s (%s)", proute, cidr, gw, tunnel->ifname);
+			if (coldstart.active && poolactive())
+				pooladd(route, tunnel);
+			else
+				timed(PHASE_ADDROUTE,
+				    addroute(route, tunnel, routetable_create));
+			record(REC_ROUTE_ADD, route->ipnet, cidr,
+			    tunnel->outer_remote, tunnel->ifnum, 0);
 		} else {
 			debug("tunnel for %s/%d changed. %s -> %s",
 			    proute, cidr, route->tunnel->ifname,
 			    tunnel->ifname);
-			chroute(route, tunnel, routetable_create);
+			pooldrain();
+			timed(PHASE_CHROUTE,
+			    chroute(route, tunnel, routetable_create));
+			statinc(routeschanged);
+			PROBE4(route__moved, route->ipnet, cidr,
+			    response->nexthop, route->tunnel->outer_remote);
+			record(REC_ROUTE_CHANGE, route->ipnet, cidr,
+			    tunnel->outer_remote, tunnel->ifnum,
+			    route->tunnel->outer_remote);
 		}
 		unlinkroute(route->tunnel, route);
 		collapse(route->tunnel);
 		linkroute(tunnel, route);
-	}
-	route->expires = now + TIMEOUT;
+	} else
+		PROBE4(route__refreshed, route->ipnet, cidr,
+		    response->nexthop, (int64_t)(now + TIMEOUT));
+	setrouteexpires(route, now + TIMEOUT);
 }
 
 Route *
@@ -706,9 +1498,7 @@ mkroute(uint32_t ipnet, uint32_t subnetmask, uint32_t gateway)
 {
 	Route *route;
 
-	route = calloc(1, sizeof(*route));
-	if (route == NULL)
-		fatal("malloc");
+	route = slaballoc(routeslab);
 	route->ipnet = ipnet;
 	route->subnetmask = subnetmask;
 	route->gateway = gateway;
@@ -716,15 +1506,19 @@ mkroute(uint32_t ipnet, uint32_t subnetmask, uint32_t gateway)
 	return route;
 }
 
+void
+freeroute(void *route)
+{
+	slabfree(routeslab, route);
+}
+
 Tunnel *
 mktunnel(uint32_t outer_local, uint32_t outer_remote, uint32_t inner_local,
     uint32_t inner_remote)
 {
 	Tunnel *tunnel;
 
-	tunnel = calloc(1, sizeof(*tunnel));
-	if (tunnel == NULL)
-		fatal("malloc");
+	tunnel = slaballoc(tunnelslab);
 	tunnel->outer_local = outer_local;
 	tunnel->outer_remote = outer_remote;
 	tunnel->inner_local = inner_local;
@@ -745,82 +1539,172 @@ alloctunif(Tunnel *tunnel, Bitvec *interfaces)
 	info("Allocating tunnel interface %s", tunnel->ifname);
 }
 
-void
-unlinkroute(Tunnel *tunnel, Route *route)
+//
+// The policy from the command line and the policy file, if any.
+// Everything is accepted if neither has any rules.
+//
+static Policy *
+buildpolicy(void)
 {
-	if (tunnel == NULL)
-		return;
-	for (Route *prev = NULL, *tmp = tunnel->routes;
-	    tmp != NULL;
-	    prev = tmp, tmp = tmp->rnext)
-	{
-		if (route->ipnet == tmp->ipnet &&
-		    route->subnetmask == tmp->subnetmask)
-		{
-			if (prev == NULL)
-				tunnel->routes = tmp->rnext;
-			else
-				prev->rnext = tmp->rnext;
-			route->gateway = 0;
-			--tunnel->nref;
-			break;
-		}
+	Policy *next;
+
+	next = duppolicy(cmdpolicy);
+	if (policypath != NULL && policyread(next, policypath) < 0) {
+		freepolicy(next);
+		return NULL;
 	}
+	if (next->size == 0)
+		policyadd(next, 0, 0, 1);
+	policycompile(next);
+
+	return next;
 }
 
-void
-linkroute(Tunnel *tunnel, Route *route)
+typedef struct ReloadState ReloadState;
+struct ReloadState {
+	netset *changed;	// Prefixes whose rules changed.
+	IPMap *rejected;
+	size_t nrejected;
+};
+
+static void
+markchanged(uint32_t net, int cidr, void *changed)
+{
+	netsetinsert(changed, net, cidr, 1);
+}
+
+static int
+recheck(uint32_t key, size_t keylen, void *routep, void *statep)
 {
-	route->rnext = tunnel->routes;
-	tunnel->routes = route;
-	route->tunnel = tunnel;
-	route->gateway = tunnel->outer_remote;
-	++tunnel->nref;
+	ReloadState *state = statep;
+
+	if (policyaccepts(policy, key, keylen))
+		return 0;
+	if (state->rejected == NULL)
+		state->rejected = mkipmap();
+	ipmapinsert(state->rejected, key, keylen, routep);
+	state->nrejected++;
+
+	return 0;
+}
+
+//
+// Rebuild the policy and swap it in.  Only routes within a prefix
+// whose rules changed can be judged differently, so only the
+// subtrees of the routes table under those prefixes are checked
+// again; any the new policy rejects are removed.  Routes it
+// newly accepts were never kept, and are learned from the next RIP
+// update.  If the new policy cannot be built, the old one stays.
+//
+static void
+reloadpolicy(void)
+{
+	ReloadState state = { NULL, NULL, 0 };
+	Policy *next, *old;
+	size_t nchanged;
+	netsetiter it;
+
+	next = buildpolicy();
+	if (next == NULL) {
+		error("policy reload failed; keeping the old policy");
+		return;
+	}
+	state.changed = mknetset();
+	nchanged = policydiff(policy, next, markchanged, state.changed);
+	old = policy;
+	policy = next;
+	initdump(policy, tunnels);
+	freepolicy(old);
+	if (nchanged != 0) {
+		uint32_t lastnet = 0;
+		size_t lastlen = CIDR_HOST + 1;
+
+		// Top-down, a prefix inside the last one checked was
+		// covered by it.
+		pooldrain();
+		for (netsetwalk(state.changed, &it); netsetnext(&it);) {
+			if (lastlen <= it.keylen &&
+			    ((it.key ^ lastnet) & ipmaptmask(lastlen)) == 0)
+				continue;
+			lastnet = it.key;
+			lastlen = it.keylen;
+			ipmapsubtreedo(routes, it.key, it.keylen, recheck,
+			    &state);
+		}
+	}
+	if (state.rejected != NULL) {
+		ipmapdo(state.rejected, destroy, "policy");
+		freeipmap(state.rejected, freeroute);
+	}
+	freenetset(state.changed);
+	notice("policy reloaded: %zu rules, %zu prefixes changed, "
+	    "%zu routes removed", policy->size, nchanged, state.nrejected);
 }
 
 typedef struct WalkState WalkState;
 struct WalkState {
 	time_t now;
 	IPMap *deleting;
+	size_t ndeleting;
+	time_t nextexpiry;	// Earliest expiry of the routes kept.
 };
 
 void
 walkexpired(time_t now)
 {
-	WalkState state = { now, NULL };
+	WalkState state = { now, NULL, 0, 0 };
 
-	ipmapdo(routes, expire, &state);
+	slabscan(routeslab, expire, &state);
 	if (state.deleting != NULL) {
+		// A route may still be on its way into the kernel.
+		pooldrain();
 		ipmapdo(state.deleting, destroy, NULL);
-		freeipmap(state.deleting, free);
+		freeipmap(state.deleting, freeroute);
 	}
+	statset(lastexpired, state.ndeleting);
+	statset(nextexpiry, state.nextexpiry);
 }
 
+//
+// Called with each route's expiry time, from the route slab; the
+// route itself is only read once it has expired.
+//
 int
-expire(uint32_t key, size_t keylen, void *routep, void *statep)
+expire(void *expiresp, void *routep, void *statep)
 {
+	time_t expires = *(time_t *)expiresp;
 	Route *route = routep;
 	WalkState *state = statep;
 	int cidr;
 	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
 
-	if (route->expires > state->now)
+	if (expires > state->now) {
+		if (state->nextexpiry == 0 || expires < state->nextexpiry)
+			state->nextexpiry = expires;
 		return 0;
+	}
 
 	if (state->deleting == NULL)
 		state->deleting = mkipmap(); 
 	cidr = netmask2cidr(route->subnetmask);
-	assert(cidr == keylen);
-	ipaddrstr(route->ipnet, proute);
-	ipaddrstr(route->gateway, gw);
+	if (logging(LOG_INFO)) {
+		ipaddrstr(route->ipnet, proute);
+		ipaddrstr(route->gateway, gw);
+	}
 	info("Expiring route %s/%d -> %s", proute, cidr, gw);
-	ipmapinsert(state->deleting, key, keylen, route);
+	PROBE3(route__expire, route->ipnet, cidr, route->gateway);
+	ipmapinsert(state->deleting, route->ipnet, cidr, route);
+	state->ndeleting++;
 
 	return 0;
 }
 
+//
+// Remove a route that has expired or, if 'why' is not NULL, that
+// the policy no longer accepts.
+//
 int
-destroy(uint32_t key, size_t keylen, void *routep, void *unused)
+destroy(uint32_t key, size_t keylen, void *routep, void *why)
 {
 	Route *route = routep;
 	Tunnel *tunnel;
@@ -828,25 +1712,45 @@ destroy(uint32_t key, size_t keylen, void *routep, void *unused)
 	int cidr;
 	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
 
-	(void)unused;
 	if (route == NULL)
 		return 0;
 	cidr = netmask2cidr(route->subnetmask);
 	assert(cidr == keylen);
-	ipaddrstr(route->ipnet, proute);
-	ipaddrstr(route->gateway, gw);
+	if (logging(LOG_INFO)) {
+		ipaddrstr(route->ipnet, proute);
+		ipaddrstr(route->gateway, gw);
+	}
 	info("Destroying route %s/%d -> %s", proute, cidr, gw);
+	PROBE3(route__destroy, route->ipnet, cidr, route->gateway);
 	datum = ipmapremove(routes, key, keylen);
 	assert(datum == route);
 	tunnel = route->tunnel;
 	assert(tunnel != NULL);
-	rmroute(route, routetable_create);
+	timed(PHASE_RMROUTE, rmroute(route, routetable_create));
+	if (why == NULL)
+		statinc(routesexpired);
+	else
+		statinc(routesrejected);
+	statadd(routes, -1);
+	record(why == NULL ? REC_ROUTE_EXPIRE : REC_ROUTE_REJECT, route->ipnet,
+	    cidr, tunnel->outer_remote, tunnel->ifnum, 0);
 	unlinkroute(tunnel, route);
 	collapse(tunnel);
 
 	return 0;
 }
 
+//
+// The tunnel to 'outer_remote', or NULL if there is none.
+//
+static Tunnel *
+findtunnel(uint32_t outer_remote)
+{
+	Tunnel **tunnel = tunnelmapfind(tunnels, outer_remote, CIDR_HOST);
+
+	return (tunnel != NULL) ? *tunnel : NULL;
+}
+
 void
 collapse(Tunnel *tunnel)
 {
@@ -854,73 +1758,19 @@ collapse(Tunnel *tunnel)
 		return;
 	assert(tunnel->nref >= 0);
 	if (tunnel->nref == 0) {
-		void *datum = ipmapremove(tunnels, tunnel->outer_remote,
-		    CIDR_HOST);
+		Tunnel *datum = NULL;
+		tunnelmapremove(tunnels, tunnel->outer_remote, CIDR_HOST,
+		    &datum);
 		assert(datum == tunnel);
 		info("Tearing down tunnel interface %s", tunnel->ifname);
-		downtunnel(tunnel);
+		timed(PHASE_DOWNTUNNEL, downtunnel(tunnel));
+		statinc(tunnelsdestroyed);
+		statadd(tunnels, -1);
+		record(REC_TUNNEL_DOWN, tunnel->inner_remote, CIDR_HOST,
+		    tunnel->outer_remote, tunnel->ifnum, 0);
 		bitclr(interfaces, tunnel->ifnum);
-		free(tunnel);
-	}
-}
-
-static int
-dump_tunnel(uint32_t key, size_t keylen, void *tunnelp, void *arg)
-{
-	Tunnel *tunnel = tunnelp;
-	FILE *out = arg;
-
-	char outer_local[INET_ADDRSTRLEN], outer_remote[INET_ADDRSTRLEN],
-	     inner_local[INET_ADDRSTRLEN], inner_remote[INET_ADDRSTRLEN];
-
-	ipaddrstr(tunnel->outer_local, outer_local);
-	ipaddrstr(tunnel->outer_remote, outer_remote);
-	ipaddrstr(tunnel->inner_local, inner_local);
-	ipaddrstr(tunnel->inner_remote, inner_remote);
-
-	fprintf(out, "Tunnel interface %s:\n"
-	              "\tOuter %s -> %s\n"
-	              "\tInner %s -> %s\n"
-	              "\tRouted networks:\n",
-	    tunnel->ifname, outer_local, outer_remote, inner_local,
-	    inner_remote);
-
-	Route *route;
-	for (route = tunnel->routes; route; route = route->rnext) {
-		char net[INET_ADDRSTRLEN];
-		size_t cidr;
-
-		assert(route->tunnel == tunnel);
-
-		ipaddrstr(route->ipnet, net);
-		cidr = netmask2cidr(route->subnetmask);
-
-		fprintf(out, "\t\t%s/%zd\n", net, cidr);
+		slabfree(tunnelslab, tunnel);
 	}
-
-	return 0;
-}
-
-static int
-dump_accept_reject(uint32_t key, size_t keylen, void *accept, void *arg)
-{
-	FILE *out = arg;
-	char net[INET_ADDRSTRLEN];
-
-	ipaddrstr(key, net);
-
-	fprintf(out, "\t%s/%zd -> %s\n", net, keylen,
-	    accept == ACCEPT ? "ACCEPT" : "REJECT");
-
-	return 0;
-}
-
-static void
-dump_all(FILE *out)
-{
-	fputs("Acceptance policy:\n", out);
-	ipmapdotopdown(acceptableroutes, dump_accept_reject, out);
-	ipmapdo(tunnels, dump_tunnel, out);
 }
 
 void
@@ -929,7 +1779,11 @@ usage(const char *restrict prog)
 	fprintf(stderr,
 	    "Usage: %s [ -d | -D ] [ -T <create_rtable> ] [ -I <ignorespec> ] "
 	        "[ -A <acceptspec> ] [ -s <static_ifnum> ] [ -f <testfile> ] "
-	        "[ -B <bind_rtable> ] <local-outer-ip> <local-ampr-ip>\n",
+	        "[ -B <bind_rtable> ] [ -P <workers> ] [ -S <snapshot> ] "
+	        "[ -Q <addr[:port]> ] [ -R <recorder> ] [ -C <capture> ] "
+	        "[ -U <ctlsocket> ] [ -M <metrics> ] [ -O <dumpfile> ] "
+	        "[ -F <policyfile> ] [ -l <loglevel> ] "
+	        "<local-outer-ip> <local-ampr-ip>\n",
 	    prog);
 	exit(EXIT_FAILURE);
 }
@@ -0,0 +1,233 @@
+/*
+ * Metrics for Prometheus, in its text exposition format.
+ *
+ * With -M, a thread of its own rewrites the given file every
+ * METRICS_INTERVAL seconds, for node_exporter's textfile collector
+ * to pick up.  The file is written under a temporary name and
+ * renamed into place so the collector never sees half of it.
+ *
+ * Everything is rendered from the atomic counters, gauges and
+ * histograms the packet path already keeps, so a scrape costs the
+ * main thread nothing: it takes no locks and never waits on the
+ * exporter.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+#include "lib.h"
+#include "log.h"
+#include "metrics.h"
+#include "stats.h"
+
+static pthread_t exporter;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int running;
+static int stopping;
+static char *metricspath;
+static char *tmppath;
+
+static void
+header(FILE *out, const char *name, const char *type, const char *help)
+{
+	fprintf(out, "# HELP %s %s\n", name, help);
+	fprintf(out, "# TYPE %s %s\n", name, type);
+}
+
+static void
+gauge(FILE *out, const char *name, const char *help, int64_t value)
+{
+	header(out, name, "gauge", help);
+	fprintf(out, "%s %" PRId64 "\n", name, value);
+}
+
+// Nanoseconds as seconds, without losing precision to a double.
+static void
+seconds(FILE *out, uint64_t ns)
+{
+	fprintf(out, "%" PRIu64 ".%09" PRIu64 "\n", ns / 1000000000,
+	    ns % 1000000000);
+}
+
+static void
+renderlatency(FILE *out)
+{
+	HistSummary s[NPHASES];
+
+	for (int k = 0; k < NPHASES; k++)
+		histsummary(&latency[k], &s[k]);
+	header(out, "ripd_latency_seconds", "summary",
+	    "Time spent in each phase of packet processing and in each "
+	    "kernel operation.");
+	for (int k = 0; k < NPHASES; k++) {
+		fprintf(out, "ripd_latency_seconds{phase=\"%s\","
+		    "quantile=\"0.5\"} ", phasenames[k]);
+		seconds(out, s[k].p50);
+		fprintf(out, "ripd_latency_seconds{phase=\"%s\","
+		    "quantile=\"0.99\"} ", phasenames[k]);
+		seconds(out, s[k].p99);
+		fprintf(out, "ripd_latency_seconds_sum{phase=\"%s\"} ",
+		    phasenames[k]);
+		seconds(out, s[k].sum);
+		fprintf(out, "ripd_latency_seconds_count{phase=\"%s\"} %"
+		    PRIu64 "\n", phasenames[k], s[k].count);
+	}
+	header(out, "ripd_latency_max_seconds", "gauge",
+	    "Longest time spent in each phase since startup.");
+	for (int k = 0; k < NPHASES; k++) {
+		fprintf(out, "ripd_latency_max_seconds{phase=\"%s\"} ",
+		    phasenames[k]);
+		seconds(out, s[k].max);
+	}
+}
+
+// Only present when lib.c is built with IPMAP_STATS.
+static void
+renderipmap(FILE *out)
+{
+	uint64_t calls[IPMAP_NOPS], visits[IPMAP_NOPS];
+
+	if (!ipmapvisits(calls, visits))
+		return;
+	header(out, "ripd_ipmap_calls_total", "counter",
+	    "Trie operations, by kind.");
+	for (int k = 0; k < IPMAP_NOPS; k++)
+		fprintf(out, "ripd_ipmap_calls_total{op=\"%s\"} %" PRIu64 "\n",
+		    ipmapopnames[k], calls[k]);
+	header(out, "ripd_ipmap_visits_total", "counter",
+	    "Trie nodes visited, by kind of operation.");
+	for (int k = 0; k < IPMAP_NOPS; k++)
+		fprintf(out, "ripd_ipmap_visits_total{op=\"%s\"} %" PRIu64
+		    "\n", ipmapopnames[k], visits[k]);
+}
+
+//
+// Write every metric to 'out'.  Safe to call from any thread.
+//
+void
+rendermetrics(FILE *out)
+{
+	char name[64];
+	time_t next, backlog = 0;
+
+	for (size_t k = 0; k < nstatnames; k++) {
+		snprintf(name, sizeof(name), "ripd_%s_total",
+		    statnames[k].name);
+		header(out, name, "counter", statnames[k].help);
+		fprintf(out, "%s %" PRIu64 "\n", name,
+		    statvalue(&statnames[k]));
+	}
+	header(out, "ripd_log_dropped_total", "counter",
+	    "Log messages dropped because the log ring was full.");
+	fprintf(out, "ripd_log_dropped_total %" PRIu64 "\n", logdropped());
+
+	gauge(out, "ripd_routes", "Routes installed.", statget(routes));
+	gauge(out, "ripd_tunnels", "Tunnels up.", statget(tunnels));
+	gauge(out, "ripd_ipmap_nodes", "Trie nodes in all maps.",
+	    ipmaplivenodes());
+	next = statget(nextexpiry);
+	if (next != 0 && time(NULL) > next)
+		backlog = time(NULL) - next;
+	gauge(out, "ripd_expiry_backlog_seconds",
+	    "How long the oldest overdue route has been waiting to expire.",
+	    backlog);
+	gauge(out, "ripd_last_expiry_batch",
+	    "Routes removed by the last expiry walk.", statget(lastexpired));
+
+	renderipmap(out);
+
+	renderlatency(out);
+}
+
+static void
+writemetrics(void)
+{
+	FILE *out;
+
+	out = fopen(tmppath, "w");
+	if (out == NULL) {
+		error("cannot create %s: %m", tmppath);
+		return;
+	}
+	rendermetrics(out);
+	if (fclose(out) != 0) {
+		error("cannot write %s: %m", tmppath);
+		remove(tmppath);
+		return;
+	}
+	if (rename(tmppath, metricspath) < 0) {
+		error("cannot rename %s: %m", tmppath);
+		remove(tmppath);
+	}
+}
+
+static void *
+exportthread(void *arg)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		pthread_mutex_unlock(&lock);
+		writemetrics();
+		pthread_mutex_lock(&lock);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += METRICS_INTERVAL;
+		while (!stopping && pthread_cond_timedwait(&wake, &lock,
+		    &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+//
+// Start rewriting 'path' in the background.  Threads do not survive
+// daemon(), so this must be called after it.
+//
+void
+startmetrics(const char *path)
+{
+	if (running)
+		return;
+	metricspath = strdup(path);
+	tmppath = malloc(strlen(path) + sizeof(".tmp"));
+	if (metricspath == NULL || tmppath == NULL)
+		fatal("malloc");
+	strcpy(tmppath, path);
+	strcat(tmppath, ".tmp");
+	stopping = 0;
+	if (pthread_create(&exporter, NULL, exportthread, NULL) != 0)
+		fatal("cannot create metrics thread");
+	running = 1;
+}
+
+//
+// Stop the exporter, leaving a final set of metrics behind.
+//
+void
+stopmetrics(void)
+{
+	if (!running)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+	pthread_join(exporter, NULL);
+	running = 0;
+	writemetrics();
+	free(metricspath);
+	free(tmppath);
+	metricspath = NULL;
+	tmppath = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef RIPD_METRICS_H
+#define RIPD_METRICS_H
+
+#include <stdio.h>
+
+enum {
+	METRICS_INTERVAL = 15,		// Seconds between rewrites.
+};
+
+void startmetrics(const char *path);
+void stopmetrics(void);
+void rendermetrics(FILE *out);
+
+#endif
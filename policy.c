@@ -0,0 +1,345 @@
+/*
+ * The route acceptance policy.
+ *
+ * Rules come from -A and -I and from a policy file, which can be
+ * reloaded while the daemon runs.  The policy is consulted for
+ * every route in every RIP packet, so rather than a trie it is
+ * compiled into a sorted array per prefix length: a lookup is at
+ * most one binary search per length in use, over memory that is
+ * read sequentially, and a compiled policy is never modified, so a
+ * replacement can be built beside it and swapped in.
+ *
+ * A policy file has one rule per line, 'accept' or 'ignore' followed
+ * by a prefix in CIDR notation.  '#' starts a comment.
+ */
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib.h"
+#include "log.h"
+#include "policy.h"
+
+enum {
+	MAX_POLICY_LINE = 256,
+};
+
+static uint32_t
+prefixmask(int cidr)
+{
+	return (cidr == 0) ? 0 : ~(uint32_t)0 << (32 - cidr);
+}
+
+Policy *
+mkpolicy(void)
+{
+	Policy *policy;
+
+	policy = calloc(1, sizeof(*policy));
+	if (policy == NULL)
+		fatal("malloc");
+
+	return policy;
+}
+
+//
+// Copy a policy's rules into a new, uncompiled policy that more
+// rules can be added to.
+//
+Policy *
+duppolicy(const Policy *policy)
+{
+	Policy *dup;
+
+	dup = mkpolicy();
+	for (int len = 0; len <= POLICY_MAXLEN; len++) {
+		size_t n = policy->nrules[len];
+		if (n == 0)
+			continue;
+		dup->rules[len] = reallocarray(NULL, n, sizeof(PolicyRule));
+		if (dup->rules[len] == NULL)
+			fatal("malloc");
+		memcpy(dup->rules[len], policy->rules[len],
+		    n*sizeof(PolicyRule));
+		dup->nrules[len] = n;
+		dup->maxrules[len] = n;
+	}
+	dup->size = policy->size;
+
+	return dup;
+}
+
+void
+freepolicy(Policy *policy)
+{
+	if (policy == NULL)
+		return;
+	for (int len = 0; len <= POLICY_MAXLEN; len++)
+		free(policy->rules[len]);
+	free(policy);
+}
+
+//
+// Add a rule.  Host bits beyond 'cidr' are ignored.  Of two rules
+// for the same prefix, the one added first wins.
+//
+void
+policyadd(Policy *policy, uint32_t net, int cidr, int accept)
+{
+	PolicyRule *rule;
+
+	assert(!policy->compiled);
+	assert(cidr >= 0 && cidr <= POLICY_MAXLEN);
+	if (policy->nrules[cidr] == policy->maxrules[cidr]) {
+		size_t max = policy->maxrules[cidr]*2;
+		if (max == 0)
+			max = 8;
+		rule = reallocarray(policy->rules[cidr], max,
+		    sizeof(PolicyRule));
+		if (rule == NULL)
+			fatal("malloc");
+		policy->rules[cidr] = rule;
+		policy->maxrules[cidr] = max;
+	}
+	rule = &policy->rules[cidr][policy->nrules[cidr]++];
+	rule->net = net & prefixmask(cidr);
+	rule->order = policy->size++;
+	rule->accept = accept;
+}
+
+static int
+parserule(char *line, uint32_t *net, int *cidr, int *accept)
+{
+	char *verb, *prefix, *slash, *end;
+	struct in_addr in;
+	long n;
+
+	verb = strtok(line, " \t");
+	prefix = strtok(NULL, " \t");
+	if (verb == NULL || prefix == NULL || strtok(NULL, " \t") != NULL)
+		return -1;
+	if (strcmp(verb, "accept") == 0)
+		*accept = 1;
+	else if (strcmp(verb, "ignore") == 0)
+		*accept = 0;
+	else
+		return -1;
+	slash = strchr(prefix, '/');
+	if (slash == NULL)
+		return -1;
+	*slash++ = '\0';
+	n = strtol(slash, &end, 10);
+	if (*slash == '\0' || *end != '\0' || n < 0 || n > POLICY_MAXLEN)
+		return -1;
+	if (inet_pton(AF_INET, prefix, &in) != 1)
+		return -1;
+	*net = ntohl(in.s_addr);
+	*cidr = n;
+
+	return 0;
+}
+
+//
+// Add the rules in the file at 'path'.  On any error, nothing is
+// added and -1 is returned.
+//
+int
+policyread(Policy *policy, const char *path)
+{
+	char line[MAX_POLICY_LINE];
+	Policy *rules;
+	FILE *fp;
+	int lineno = 0, failed = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		error("cannot open policy %s: %m", path);
+		return -1;
+	}
+	rules = mkpolicy();
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		uint32_t net;
+		int cidr, accept;
+		char *p;
+
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			error("%s:%d: line too long", path, lineno);
+			failed = 1;
+			break;
+		}
+		p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0')
+			continue;
+		p[strcspn(p, "\r\n")] = '\0';
+		if (parserule(p, &net, &cidr, &accept) < 0) {
+			error("%s:%d: bad rule", path, lineno);
+			failed = 1;
+			break;
+		}
+		policyadd(rules, net, cidr, accept);
+	}
+	if (ferror(fp)) {
+		error("cannot read policy %s: %m", path);
+		failed = 1;
+	}
+	fclose(fp);
+	if (failed) {
+		freepolicy(rules);
+		return -1;
+	}
+	for (int len = 0; len <= POLICY_MAXLEN; len++)
+		for (size_t k = 0; k < rules->nrules[len]; k++) {
+			const PolicyRule *rule = &rules->rules[len][k];
+			policyadd(policy, rule->net, len, rule->accept);
+		}
+	freepolicy(rules);
+
+	return 0;
+}
+
+static int
+rulecmp(const void *a, const void *b)
+{
+	const PolicyRule *ra = a, *rb = b;
+
+	if (ra->net != rb->net)
+		return (ra->net < rb->net) ? -1 : 1;
+	if (ra->order != rb->order)
+		return (ra->order < rb->order) ? -1 : 1;
+	return 0;
+}
+
+//
+// Sort each length's rules, dropping all but the first of any
+// duplicates, and note which lengths are in use.
+//
+void
+policycompile(Policy *policy)
+{
+	policy->nlens = 0;
+	policy->size = 0;
+	for (int len = POLICY_MAXLEN; len >= 0; len--) {
+		PolicyRule *rules = policy->rules[len];
+		size_t n = policy->nrules[len], kept = 0;
+		if (n == 0)
+			continue;
+		qsort(rules, n, sizeof(PolicyRule), rulecmp);
+		for (size_t k = 0; k < n; k++)
+			if (kept == 0 || rules[kept - 1].net != rules[k].net)
+				rules[kept++] = rules[k];
+		policy->nrules[len] = kept;
+		policy->lens[policy->nlens++] = len;
+		policy->size += kept;
+	}
+	policy->compiled = 1;
+}
+
+static const PolicyRule *
+findrule(const Policy *policy, int len, uint32_t net)
+{
+	const PolicyRule *rules = policy->rules[len];
+	size_t lo = 0, hi = policy->nrules[len];
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		if (rules[mid].net == net)
+			return &rules[mid];
+		if (rules[mid].net < net)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+//
+// Whether the most specific rule covering 'net'/'cidr' accepts it.
+// A prefix no rule covers is not accepted.
+//
+int
+policyaccepts(const Policy *policy, uint32_t net, int cidr)
+{
+	assert(policy->compiled);
+	for (int k = 0; k < policy->nlens; k++) {
+		int len = policy->lens[k];
+		if (len > cidr)
+			continue;
+		const PolicyRule *rule = findrule(policy, len,
+		    net & prefixmask(len));
+		if (rule != NULL)
+			return rule->accept;
+	}
+
+	return 0;
+}
+
+//
+// Call 'thunk' on each rule, shortest prefixes first, stopping if
+// it returns non-zero.
+//
+void
+policydo(const Policy *policy,
+    int (*thunk)(uint32_t net, int cidr, int accept, void *arg), void *arg)
+{
+	assert(policy->compiled);
+	for (int k = policy->nlens - 1; k >= 0; k--) {
+		int len = policy->lens[k];
+		for (size_t j = 0; j < policy->nrules[len]; j++) {
+			const PolicyRule *rule = &policy->rules[len][j];
+			if (thunk(rule->net, len, rule->accept, arg))
+				return;
+		}
+	}
+}
+
+//
+// Call 'thunk' on every prefix that has a rule in one policy but
+// not the other, or different rules in each.  Only prefixes within
+// these can be judged differently by the two.  Returns the number
+// of such prefixes.
+//
+size_t
+policydiff(const Policy *old, const Policy *new,
+    void (*thunk)(uint32_t net, int cidr, void *arg), void *arg)
+{
+	size_t nchanged = 0;
+
+	assert(old->compiled && new->compiled);
+	for (int len = 0; len <= POLICY_MAXLEN; len++) {
+		const PolicyRule *a = old->rules[len], *b = new->rules[len];
+		size_t na = old->nrules[len], nb = new->nrules[len];
+		size_t i = 0, j = 0;
+
+		while (i < na || j < nb) {
+			if (j == nb || (i < na && a[i].net < b[j].net)) {
+				thunk(a[i++].net, len, arg);
+				nchanged++;
+			} else if (i == na || b[j].net < a[i].net) {
+				thunk(b[j++].net, len, arg);
+				nchanged++;
+			} else {
+				if (a[i].accept != b[j].accept) {
+					thunk(a[i].net, len, arg);
+					nchanged++;
+				}
+				i++;
+				j++;
+			}
+		}
+	}
+
+	return nchanged;
+}
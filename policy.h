@@ -0,0 +1,49 @@
+#ifndef RIPD_POLICY_H
+#define RIPD_POLICY_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+typedef struct Policy Policy;
+typedef struct PolicyRule PolicyRule;
+
+enum {
+	POLICY_MAXLEN = 32,
+};
+
+struct PolicyRule {
+	uint32_t net;
+	uint32_t order;		// Position added; the first of duplicates wins.
+	int accept;
+};
+
+/*
+ * An acceptance policy compiled for longest-prefix lookup: for each
+ * prefix length, the rules of that length sorted by network, and
+ * the lengths that have any rules, longest first.  A lookup binary
+ * searches each such length in turn.  Rules may only be added
+ * before policycompile().
+ */
+struct Policy {
+	PolicyRule *rules[POLICY_MAXLEN + 1];
+	size_t nrules[POLICY_MAXLEN + 1];
+	size_t maxrules[POLICY_MAXLEN + 1];
+	int lens[POLICY_MAXLEN + 1];
+	int nlens;
+	size_t size;
+	int compiled;
+};
+
+Policy *mkpolicy(void);
+Policy *duppolicy(const Policy *policy);
+void freepolicy(Policy *policy);
+void policyadd(Policy *policy, uint32_t net, int cidr, int accept);
+int policyread(Policy *policy, const char *path);
+void policycompile(Policy *policy);
+int policyaccepts(const Policy *policy, uint32_t net, int cidr);
+void policydo(const Policy *policy,
+    int (*thunk)(uint32_t net, int cidr, int accept, void *arg), void *arg);
+size_t policydiff(const Policy *old, const Policy *new,
+    void (*thunk)(uint32_t net, int cidr, void *arg), void *arg);
+
+#endif
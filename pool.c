@@ -0,0 +1,252 @@
+/*
+ * A pool of worker threads for bringing up tunnels and installing
+ * routes in parallel.
+ *
+ * When the daemon starts on a system with no existing mesh, the
+ * first full RIP cycle creates hundreds of tunnels, each of which
+ * costs several sequential ioctls.  Rather than make these calls
+ * inline with packet processing, the main thread queues them here
+ * and the workers, each with its own control and routing sockets,
+ * perform them concurrently.
+ *
+ * Jobs work on private copies of the tunnel and route, so the main
+ * thread is free to keep mutating its own structures.  A route added
+ * through a tunnel that is still being brought up is attached to
+ * that tunnel's job and installed by the same worker once the tunnel
+ * is up; thus routes always wait for their tunnels.  Anything that
+ * changes or removes existing kernel state must first call
+ * pooldrain() to wait for all outstanding work.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "log.h"
+#include "pool.h"
+#include "stats.h"
+#include "sys.h"
+
+typedef struct Job Job;
+
+enum {
+	CIDR_HOST = 32,
+	MAX_WORKERS = 64,
+};
+
+enum JobState {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+struct Job {
+	Tunnel tunnel;		// Snapshot taken when queued.
+	int up;			// Bring the tunnel up before adding routes.
+	enum JobState state;
+	Route *routes;		// Snapshots of routes to add, in order.
+	size_t nroutes;
+	size_t maxroutes;
+	size_t nextroute;
+	Job *next;		// Run queue.
+	Job *batch;		// All jobs since the last drain.
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[MAX_WORKERS];
+static int nworkers;
+static int stopping;
+static int rtable;
+static Job *queue, **queuetail = &queue;
+static Job *batch;
+static size_t outstanding;
+static uint64_t lastdone;	// Nanoseconds; when the last job finished.
+
+// Tunnel bring-up jobs in the current batch, by outer remote address.
+// Only touched by the main thread.
+static IPMap *pending;
+
+static void *worker(void *unused);
+
+static void
+dummy_free(void *unused)
+{
+	(void)unused;
+}
+
+void
+initpool(int n, int table)
+{
+	assert(nworkers == 0);
+	if (n <= 0)
+		return;
+	if (n > MAX_WORKERS)
+		n = MAX_WORKERS;
+	rtable = table;
+	pending = mkipmap();
+	for (int k = 0; k < n; k++) {
+		if (pthread_create(&workers[k], NULL, worker, NULL) != 0)
+			fatal("cannot create pool worker");
+		nworkers++;
+	}
+}
+
+void
+stoppool(void)
+{
+	if (nworkers == 0)
+		return;
+	pooldrain();
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+	for (int k = 0; k < nworkers; k++)
+		pthread_join(workers[k], NULL);
+	nworkers = 0;
+	freeipmap(pending, dummy_free);
+	pending = NULL;
+}
+
+int
+poolactive(void)
+{
+	return nworkers > 0;
+}
+
+static void
+appendroute(Job *job, const Route *route)
+{
+	if (job->nroutes == job->maxroutes) {
+		size_t max = (job->maxroutes == 0) ? 4 : 2*job->maxroutes;
+		Route *routes = reallocarray(job->routes, max,
+		    sizeof(Route));
+		if (routes == NULL)
+			fatal("malloc");
+		job->routes = routes;
+		job->maxroutes = max;
+	}
+	job->routes[job->nroutes++] = *route;
+}
+
+// Called with the lock held.
+static Job *
+enqueue(const Tunnel *tunnel, int up)
+{
+	Job *job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		fatal("malloc");
+	job->tunnel = *tunnel;
+	job->tunnel.routes = NULL;
+	job->up = up;
+	job->state = JOB_QUEUED;
+	job->batch = batch;
+	batch = job;
+	*queuetail = job;
+	queuetail = &job->next;
+	++outstanding;
+	pthread_cond_signal(&work);
+
+	return job;
+}
+
+void
+poolup(const Tunnel *tunnel)
+{
+	assert(nworkers > 0);
+	pthread_mutex_lock(&lock);
+	Job *job = enqueue(tunnel, 1);
+	pthread_mutex_unlock(&lock);
+	ipmapinsert(pending, tunnel->outer_remote, CIDR_HOST, job);
+}
+
+void
+pooladd(const Route *route, const Tunnel *tunnel)
+{
+	assert(nworkers > 0);
+	Job *job = ipmapfind(pending, tunnel->outer_remote, CIDR_HOST);
+	pthread_mutex_lock(&lock);
+	if (job == NULL || job->state == JOB_DONE)
+		job = enqueue(tunnel, 0);
+	appendroute(job, route);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+pooldrain(void)
+{
+	if (nworkers == 0)
+		return;
+	pthread_mutex_lock(&lock);
+	while (outstanding > 0)
+		pthread_cond_wait(&idle, &lock);
+	Job *job = batch;
+	batch = NULL;
+	pthread_mutex_unlock(&lock);
+	if (job == NULL)
+		return;
+	while (job != NULL) {
+		Job *next = job->batch;
+		free(job->routes);
+		free(job);
+		job = next;
+	}
+	freeipmap(pending, dummy_free);
+	pending = mkipmap();
+}
+
+uint64_t
+poollastdone(void)
+{
+	uint64_t t;
+
+	pthread_mutex_lock(&lock);
+	t = lastdone;
+	pthread_mutex_unlock(&lock);
+
+	return t;
+}
+
+static void *
+worker(void *unused)
+{
+	(void)unused;
+	initsysthread(rtable);
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (queue == NULL && !stopping)
+			pthread_cond_wait(&work, &lock);
+		if (queue == NULL)
+			break;
+		Job *job = queue;
+		queue = job->next;
+		if (queue == NULL)
+			queuetail = &queue;
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&lock);
+		if (job->up)
+			timed(PHASE_UPTUNNEL, uptunnel(&job->tunnel, rtable));
+		pthread_mutex_lock(&lock);
+		// Routes may be appended while we work; pick them up too.
+		while (job->nextroute < job->nroutes) {
+			Route route = job->routes[job->nextroute++];
+			pthread_mutex_unlock(&lock);
+			timed(PHASE_ADDROUTE,
+			    addroute(&route, &job->tunnel, rtable));
+			pthread_mutex_lock(&lock);
+		}
+		job->state = JOB_DONE;
+		lastdone = nanotime();
+		if (--outstanding == 0)
+			pthread_cond_broadcast(&idle);
+	}
+	pthread_mutex_unlock(&lock);
+	finisysthread();
+
+	return NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef RIPD_POOL_H
+#define RIPD_POOL_H
+
+#include "dat.h"
+
+void initpool(int nworkers, int rtable);
+void stoppool(void);
+int poolactive(void);
+void poolup(const Tunnel *tunnel);
+void pooladd(const Route *route, const Tunnel *tunnel);
+void pooldrain(void);
+uint64_t poollastdone(void);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef RIPD_PROBES_H
+#define RIPD_PROBES_H
+
+/*
+ * Statically defined tracepoints for DTrace and bpftrace.
+ *
+ * Built with -DUSE_SDT on a system with <sys/sdt.h>, each PROBE
+ * below is a single nop in the instruction stream, patched into a
+ * trap only while a tracer is attached; its arguments are computed
+ * only then.  Without USE_SDT the probes compile to nothing.
+ * On Linux, systemtap's <sys/sdt.h> needs nothing more; on FreeBSD
+ * the objects must also be passed through dtrace -G -s probes.d,
+ * and the object it produces linked in.
+ *
+ * The probes, all in provider ripd (dashes in a name are written as
+ * double underscores in the macro):
+ *
+ *	packet-receive	 (addr, port, len)	a datagram arrived
+ *	packet-parse	 (addr, result)		parsed; result < 0 if bad
+ *	packet-auth	 (addr, result)		authenticated; < 0 if not
+ *	route-skipped	 (net, cidr, nexthop, reason)
+ *						a response was skipped;
+ *						reason is a string
+ *	route-ignored	 (net, cidr, nexthop)	the policy rejected it
+ *	route-new	 (net, cidr, nexthop)	a route was learned
+ *	route-moved	 (net, cidr, nexthop, oldnexthop)
+ *						moved to another tunnel
+ *	route-refreshed	 (net, cidr, nexthop, expires)
+ *						its expiry was pushed back
+ *	route-expire	 (net, cidr, nexthop)	found expired
+ *	route-destroy	 (net, cidr, nexthop)	removed
+ *	kernel-uptunnel	 (ifname, outer_remote, inner_local,
+ *			  inner_remote, rtable)
+ *	kernel-downtunnel (ifname)
+ *	kernel-addroute	 (net, cidr, ifname, rtable)
+ *	kernel-chroute	 (net, cidr, oldifname, ifname, rtable)
+ *	kernel-rmroute	 (net, cidr, ifname, rtable)
+ *
+ * Addresses are 32-bit integers in host byte order and interface
+ * names are strings.  The kernel probes fire on entry to the
+ * operation, on whichever thread performs it.
+ */
+#if defined(USE_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RIPD_SDT
+#endif
+#endif
+
+#ifdef RIPD_SDT
+#define PROBE1(name, a)		DTRACE_PROBE1(ripd, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2(ripd, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(ripd, name, a, b, c)
+#define PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(ripd, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(ripd, name, a, b, c, d, e)
+#else
+#define PROBE1(name, a)			do { } while (0)
+#define PROBE2(name, a, b)		do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#define PROBE4(name, a, b, c, d)	do { } while (0)
+#define PROBE5(name, a, b, c, d, e)	do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Read-copy-update for IPMaps.
+ *
+ * The writer never changes a node a reader might be looking at: it
+ * builds a new path from the root to the change, publishes the new
+ * root, and retires the nodes that path replaced.  Reclamation is
+ * epoch-based.  The map keeps a global epoch, and each reader
+ * announces the epoch it saw on entry and clears it on the way out.
+ * Everything retired by an update is stamped with the epoch current
+ * when the update was published, and the epoch is then advanced; a
+ * reader that entered in a later epoch loaded the new root, so an
+ * entry can be freed once no reader is still in its epoch or an
+ * earlier one.
+ *
+ * Readers announce their epoch with a sequentially consistent
+ * store before loading the root, and the writer publishes the root
+ * with one before scanning the readers, so either the writer sees
+ * the reader or the reader sees the new root.
+ */
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lib.h"
+#include "log.h"
+#include "rcu.h"
+
+typedef struct Retired Retired;
+
+enum {
+	RECLAIM_BATCH = 256,
+};
+
+struct Retired {
+	void *p;
+	void (*fn)(void *);
+	uint64_t epoch;
+};
+
+struct RCUMap {
+	_Atomic(IPMap *) root;
+	atomic_uint_fast64_t epoch;
+	RCUReader readers[RCU_MAXREADERS];
+
+	// Writer only: retired entries, oldest first, from 'head'.
+	Retired *retired;
+	size_t head;
+	size_t nretired;
+	size_t maxretired;
+	size_t unstamped;	// Trailing entries of the open update.
+	size_t sincereclaim;
+};
+
+static void
+retire(RCUMap *map, void *p, void (*fn)(void *))
+{
+	Retired *r;
+
+	if (map->nretired == map->maxretired) {
+		if (map->head > 0) {
+			// Slide the live entries down rather than grow.
+			map->nretired -= map->head;
+			for (size_t k = 0; k < map->nretired; k++)
+				map->retired[k] = map->retired[map->head + k];
+			map->head = 0;
+		}
+		if (map->nretired == map->maxretired) {
+			size_t max = map->maxretired ? map->maxretired*2 : 64;
+			r = realloc(map->retired, max*sizeof(*r));
+			if (r == NULL)
+				fatal("realloc");
+			map->retired = r;
+			map->maxretired = max;
+		}
+	}
+	r = &map->retired[map->nretired++];
+	r->p = p;
+	r->fn = fn;
+	r->epoch = 0;
+	map->unstamped++;
+}
+
+static void
+freenodething(void *p)
+{
+	ipmapfreenode(p);
+}
+
+static void
+retirenode(IPMap *node, void *arg)
+{
+	retire(arg, node, freenodething);
+}
+
+//
+// Make 'root' visible to readers and close the update: whatever it
+// retired belongs to the epoch current now, which is then left
+// behind.
+//
+static void
+publish(RCUMap *map, IPMap *root)
+{
+	uint64_t epoch;
+
+	atomic_store(&map->root, root);
+	epoch = atomic_load(&map->epoch);
+	for (size_t k = map->nretired - map->unstamped; k < map->nretired; k++)
+		map->retired[k].epoch = epoch;
+	map->sincereclaim += map->unstamped;
+	map->unstamped = 0;
+	atomic_store(&map->epoch, epoch + 1);
+	if (map->sincereclaim >= RECLAIM_BATCH)
+		rcureclaim(map);
+}
+
+RCUMap *
+mkrcumap(void)
+{
+	RCUMap *map;
+
+	map = calloc(1, sizeof(*map));
+	if (map == NULL)
+		fatal("malloc");
+	atomic_init(&map->root, mkipmap());
+	atomic_init(&map->epoch, 1);
+	for (size_t k = 0; k < RCU_MAXREADERS; k++) {
+		map->readers[k].map = map;
+		atomic_init(&map->readers[k].epoch, 0);
+		atomic_init(&map->readers[k].busy, 0);
+	}
+
+	return map;
+}
+
+//
+// Free the map, its data and everything retired.  No reader may be
+// inside it.
+//
+void
+freercumap(RCUMap *map, void (*freedatum)(void *))
+{
+	if (map == NULL)
+		return;
+	for (size_t k = map->head; k < map->nretired; k++)
+		map->retired[k].fn(map->retired[k].p);
+	free(map->retired);
+	freeipmap(atomic_load(&map->root), freedatum);
+	free(map);
+}
+
+//
+// As ipmapinsert(): returns the datum now at the key, which is not
+// 'datum' if the key was already present.
+//
+void *
+rcuinsert(RCUMap *map, uint32_t key, size_t keylen, void *datum)
+{
+	IPMap *root, *newroot;
+	void *result;
+
+	root = atomic_load_explicit(&map->root, memory_order_relaxed);
+	newroot = ipmapcopyinsert(root, key, keylen, datum, &result,
+	    retirenode, map);
+	if (newroot != root)
+		publish(map, newroot);
+
+	return result;
+}
+
+//
+// As ipmapremove().  Readers may still hold the datum returned;
+// free it with rcudefer().
+//
+void *
+rcuremove(RCUMap *map, uint32_t key, size_t keylen)
+{
+	IPMap *root, *newroot;
+	void *result;
+
+	root = atomic_load_explicit(&map->root, memory_order_relaxed);
+	newroot = ipmapcopyremove(root, key, keylen, &result,
+	    retirenode, map);
+	if (newroot != root)
+		publish(map, newroot);
+
+	return result;
+}
+
+//
+// Call 'fn(p)' once no reader that might have seen 'p' remains.
+//
+void
+rcudefer(RCUMap *map, void *p, void (*fn)(void *))
+{
+	retire(map, p, fn);
+	publish(map, atomic_load_explicit(&map->root, memory_order_relaxed));
+}
+
+//
+// Free what no reader can still see, and return how many entries
+// were freed.  Called from updates every RECLAIM_BATCH retirements;
+// a writer gone quiet can call it directly.
+//
+size_t
+rcureclaim(RCUMap *map)
+{
+	uint64_t oldest = UINT64_MAX, epoch;
+	size_t n = 0;
+
+	assert(map->unstamped == 0);
+	for (size_t k = 0; k < RCU_MAXREADERS; k++) {
+		epoch = atomic_load(&map->readers[k].epoch);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+	while (map->head < map->nretired &&
+	    map->retired[map->head].epoch < oldest) {
+		Retired *r = &map->retired[map->head++];
+		r->fn(r->p);
+		n++;
+	}
+	if (map->head == map->nretired)
+		map->head = map->nretired = 0;
+	map->sincereclaim = 0;
+
+	return n;
+}
+
+// Entries retired but not yet freed.
+size_t
+rcupending(const RCUMap *map)
+{
+	return map->nretired - map->head;
+}
+
+// The current tree, for the writer only.
+IPMap *
+rcuroot(RCUMap *map)
+{
+	return atomic_load_explicit(&map->root, memory_order_relaxed);
+}
+
+//
+// Claim a reader slot for the calling thread, or return NULL if
+// all RCU_MAXREADERS are taken.
+//
+RCUReader *
+rcuregister(RCUMap *map)
+{
+	for (size_t k = 0; k < RCU_MAXREADERS; k++) {
+		int idle = 0;
+		if (atomic_compare_exchange_strong(&map->readers[k].busy,
+		    &idle, 1))
+			return &map->readers[k];
+	}
+
+	return NULL;
+}
+
+void
+rcuunregister(RCUReader *reader)
+{
+	if (reader == NULL)
+		return;
+	assert(atomic_load(&reader->epoch) == 0);
+	atomic_store(&reader->busy, 0);
+}
+
+//
+// Enter the map and return the tree to read.  It stays valid,
+// and unchanging, until rcuunlock().
+//
+IPMap *
+rculock(RCUReader *reader)
+{
+	RCUMap *map = reader->map;
+
+	assert(atomic_load_explicit(&reader->epoch,
+	    memory_order_relaxed) == 0);
+	atomic_store(&reader->epoch, atomic_load(&map->epoch));
+	return atomic_load(&map->root);
+}
+
+void
+rcuunlock(RCUReader *reader)
+{
+	atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
@@ -0,0 +1,50 @@
+#ifndef RIPD_RCU_H
+#define RIPD_RCU_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib.h"
+
+typedef struct RCUMap RCUMap;
+typedef struct RCUReader RCUReader;
+
+/*
+ * An IPMap that other threads can read while one thread updates
+ * it.  Updates copy the path to the change (ipmapcopyinsert() and
+ * ipmapcopyremove()) and publish the new root with one atomic
+ * store, so a reader always sees a whole, consistent tree.  Nodes
+ * the writer replaces are retired and freed once every reader has
+ * left the epoch in which they were retired.
+ *
+ * Only one thread may call rcuinsert(), rcuremove(), rcudefer()
+ * and rcureclaim() at a time.  Any thread may register a reader;
+ * between rculock() and rcuunlock() it can use the returned tree
+ * with ipmapfind(), ipmapnearest() and ipmapdo() without locking,
+ * but must not keep pointers into it afterwards.
+ */
+enum {
+	RCU_MAXREADERS = 64,
+};
+
+struct RCUReader {
+	RCUMap *map;
+	atomic_uint_fast64_t epoch;	// 0 when outside the map.
+	atomic_int busy;
+};
+
+RCUMap *mkrcumap(void);
+void freercumap(RCUMap *map, void (*freedatum)(void *));
+void *rcuinsert(RCUMap *map, uint32_t key, size_t keylen, void *datum);
+void *rcuremove(RCUMap *map, uint32_t key, size_t keylen);
+void rcudefer(RCUMap *map, void *p, void (*fn)(void *));
+size_t rcureclaim(RCUMap *map);
+size_t rcupending(const RCUMap *map);
+IPMap *rcuroot(RCUMap *map);
+RCUReader *rcuregister(RCUMap *map);
+void rcuunregister(RCUReader *reader);
+IPMap *rculock(RCUReader *reader);
+void rcuunlock(RCUReader *reader);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * A flight recorder for route and tunnel events.
+ *
+ * Every route add, change and expiry and every tunnel bring-up,
+ * teardown and rebase is appended as a fixed-size binary record to
+ * a ring in a file that is mapped into memory.  Recording an event
+ * is a handful of stores into the mapping; the kernel writes the
+ * pages back on its own schedule, so the history survives the
+ * daemon crashing.  recdump decodes the file.
+ *
+ * Only the main thread records events.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "rec.h"
+
+#ifdef CLOCK_REALTIME_FAST
+#define REC_CLOCK	CLOCK_REALTIME_FAST
+#else
+#define REC_CLOCK	CLOCK_REALTIME
+#endif
+
+const char REC_MAGIC[8] = "44RIPREC";
+
+static RecHeader *header;
+static RecEvent *events;
+static size_t maplen;
+static uint64_t mask;
+
+static const char *rectypes[] = {
+	[REC_ROUTE_ADD] = "route-add",
+	[REC_ROUTE_CHANGE] = "route-change",
+	[REC_ROUTE_EXPIRE] = "route-expire",
+	[REC_TUNNEL_UP] = "tunnel-up",
+	[REC_TUNNEL_DOWN] = "tunnel-down",
+	[REC_TUNNEL_REBASE] = "tunnel-rebase",
+	[REC_ROUTE_REJECT] = "route-reject",
+};
+
+//
+// Map the recorder at 'path', creating it with 'nslots' events if
+// it does not exist or does not match.  An existing recorder of the
+// right shape is appended to.  'nslots' must be a power of two.
+//
+int
+openrec(const char *path, size_t nslots)
+{
+	struct stat st;
+	int fd, fresh;
+	void *base;
+
+	if (nslots == 0 || (nslots & (nslots - 1)) != 0) {
+		error("recorder size %zu is not a power of two", nslots);
+		return -1;
+	}
+	closerec();
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		error("cannot open recorder %s: %m", path);
+		return -1;
+	}
+	maplen = sizeof(RecHeader) + nslots*sizeof(RecEvent);
+	fresh = fstat(fd, &st) < 0 || (size_t)st.st_size != maplen;
+	if (fresh && ftruncate(fd, 0) < 0) {
+		error("cannot truncate recorder %s: %m", path);
+		close(fd);
+		return -1;
+	}
+	if (fresh && ftruncate(fd, maplen) < 0) {
+		error("cannot size recorder %s: %m", path);
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		error("cannot map recorder %s: %m", path);
+		return -1;
+	}
+	header = base;
+	events = (RecEvent *)(header + 1);
+	if (memcmp(header->magic, REC_MAGIC, sizeof(REC_MAGIC)) != 0 ||
+	    header->version != REC_VERSION ||
+	    header->eventsize != sizeof(RecEvent) ||
+	    header->nslots != nslots)
+	{
+		memset(base, 0, maplen);
+		memcpy(header->magic, REC_MAGIC, sizeof(header->magic));
+		header->version = REC_VERSION;
+		header->eventsize = sizeof(RecEvent);
+		header->nslots = nslots;
+		header->head = 0;
+	}
+	mask = nslots - 1;
+
+	return 0;
+}
+
+void
+closerec(void)
+{
+	if (header == NULL)
+		return;
+	msync(header, maplen, MS_ASYNC);
+	munmap(header, maplen);
+	header = NULL;
+	events = NULL;
+}
+
+void
+record(enum RecType type, uint32_t ipnet, int cidr, uint32_t gateway,
+    unsigned int ifnum, uint32_t aux)
+{
+	struct timespec ts;
+	RecEvent *ev;
+	uint64_t seq;
+
+	if (header == NULL)
+		return;
+	clock_gettime(REC_CLOCK, &ts);
+	seq = header->head;
+	ev = &events[seq & mask];
+	ev->seq = ~(uint64_t)0;
+	atomic_signal_fence(memory_order_release);
+	ev->time = (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	ev->ipnet = ipnet;
+	ev->gateway = gateway;
+	ev->aux = aux;
+	ev->ifnum = ifnum;
+	ev->type = type;
+	ev->cidr = cidr;
+	atomic_signal_fence(memory_order_release);
+	ev->seq = seq;
+	header->head = seq + 1;
+}
+
+const char *
+rectypestr(int type)
+{
+	if (type <= 0 || (size_t)type >= sizeof(rectypes)/sizeof(rectypes[0]))
+		return "unknown";
+	return rectypes[type];
+}
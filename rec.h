@@ -0,0 +1,62 @@
+#ifndef RIPD_REC_H
+#define RIPD_REC_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+typedef struct RecHeader RecHeader;
+typedef struct RecEvent RecEvent;
+
+enum {
+	REC_VERSION = 1,
+	REC_DEFAULT_SLOTS = 65536,
+};
+
+enum RecType {
+	REC_ROUTE_ADD = 1,	// aux unused.
+	REC_ROUTE_CHANGE,	// aux is the old gateway.
+	REC_ROUTE_EXPIRE,	// aux unused.
+	REC_TUNNEL_UP,		// ipnet is the inner remote address.
+	REC_TUNNEL_DOWN,	// ipnet is the inner remote address.
+	REC_TUNNEL_REBASE,	// ipnet is the new inner remote, aux the old.
+	REC_ROUTE_REJECT,	// aux unused.  Removed by a policy reload.
+};
+
+/*
+ * On-disk layout of the flight recorder: a header followed by
+ * 'nslots' events, used as a ring.  The event with sequence
+ * number s lives in slot s % nslots, and 'head' is the sequence
+ * number of the next event to be written.  An event's own 'seq'
+ * is stored last, so a reader can tell a slot that was being
+ * overwritten when the daemon died from a complete one.  All
+ * fields are in host byte order.
+ */
+struct RecHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t eventsize;
+	uint64_t nslots;
+	volatile uint64_t head;
+	char pad[32];
+};
+
+struct RecEvent {
+	int64_t time;		// Nanoseconds since the epoch.
+	uint32_t ipnet;
+	uint32_t gateway;	// Outer remote address of the tunnel.
+	uint32_t aux;
+	uint16_t ifnum;
+	uint8_t type;
+	uint8_t cidr;
+	uint64_t seq;
+};
+
+extern const char REC_MAGIC[8];
+
+int openrec(const char *path, size_t nslots);
+void closerec(void);
+void record(enum RecType type, uint32_t ipnet, int cidr, uint32_t gateway,
+    unsigned int ifnum, uint32_t aux);
+const char *rectypestr(int type);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Decode a flight recorder file written by 44ripd -R.
+ *
+ * Prints the events still in the ring, oldest first, as text or,
+ * with -c, as CSV.  Slots that were being written when the daemon
+ * stopped are skipped.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rec.h"
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [ -c ] <recorder>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+static const char *
+addrstr(uint32_t addr, char buf[static INET_ADDRSTRLEN])
+{
+	struct in_addr in;
+
+	in.s_addr = htonl(addr);
+	return inet_ntop(AF_INET, &in, buf, INET_ADDRSTRLEN);
+}
+
+static void
+printevent(const RecEvent *ev, int csv)
+{
+	char net[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN], aux[INET_ADDRSTRLEN];
+	char when[32];
+	time_t secs = ev->time / 1000000000;
+	struct tm tm;
+
+	addrstr(ev->ipnet, net);
+	addrstr(ev->gateway, gw);
+	addrstr(ev->aux, aux);
+	gmtime_r(&secs, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+	if (csv) {
+		printf("%" PRIu64 ",%s.%09" PRId64 "Z,%s,%s,%d,%s,gif%u,%s\n",
+		    ev->seq, when, ev->time % 1000000000,
+		    rectypestr(ev->type), net, ev->cidr, gw, ev->ifnum,
+		    ev->aux != 0 ? aux : "");
+		return;
+	}
+	printf("%s.%09" PRId64 "Z %-13s %s/%d via %s (gif%u)",
+	    when, ev->time % 1000000000, rectypestr(ev->type), net,
+	    ev->cidr, gw, ev->ifnum);
+	switch (ev->type) {
+	case REC_ROUTE_CHANGE:
+		printf(" from %s", aux);
+		break;
+	case REC_TUNNEL_REBASE:
+		printf(" was %s", aux);
+		break;
+	case REC_ROUTE_REJECT:
+		printf(" by policy");
+		break;
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *prog = argv[0];
+	const RecHeader *header;
+	const RecEvent *events;
+	struct stat st;
+	uint64_t first, seq;
+	void *base;
+	int fd, ch, csv = 0;
+
+	while ((ch = getopt(argc, argv, "c")) != -1) {
+		switch (ch) {
+		case 'c':
+			csv = 1;
+			break;
+		default:
+			usage(prog);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage(prog);
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((size_t)st.st_size < sizeof(RecHeader)) {
+		fprintf(stderr, "%s: not a flight recorder\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	header = base;
+	events = (const RecEvent *)(header + 1);
+	if (memcmp(header->magic, REC_MAGIC, sizeof(REC_MAGIC)) != 0 ||
+	    header->version != REC_VERSION ||
+	    header->eventsize != sizeof(RecEvent) ||
+	    header->nslots == 0 ||
+	    (header->nslots & (header->nslots - 1)) != 0 ||
+	    (uint64_t)st.st_size !=
+	    sizeof(RecHeader) + header->nslots*sizeof(RecEvent))
+	{
+		fprintf(stderr, "%s: not a flight recorder\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (csv)
+		printf("seq,time,event,network,cidr,gateway,interface,aux\n");
+	seq = header->head;
+	first = (seq > header->nslots) ? seq - header->nslots : 0;
+	for (uint64_t s = first; s < seq; s++) {
+		const RecEvent *ev = &events[s & (header->nslots - 1)];
+		if (ev->seq != s)
+			continue;
+		printevent(ev, csv);
+	}
+	munmap(base, st.st_size);
+
+	return 0;
+}
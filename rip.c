@@ -11,6 +11,8 @@
 
 static uint32_t readnet32(const octet data[static 4]);
 static uint16_t readnet16(const octet data[static 2]);
+static void writenet32(octet data[static 4], uint32_t w);
+static void writenet16(octet data[static 2], uint16_t w);
 
 static uint32_t
 readnet32(const octet data[static 4])
@@ -24,6 +26,22 @@ readnet16(const octet data[static 2])
 	return data[0] << 8 | data[1];
 }
 
+static void
+writenet32(octet data[static 4], uint32_t w)
+{
+	data[0] = w >> 24;
+	data[1] = w >> 16;
+	data[2] = w >> 8;
+	data[3] = w;
+}
+
+static void
+writenet16(octet data[static 2], uint16_t w)
+{
+	data[0] = w >> 8;
+	data[1] = w;
+}
+
 int
 parserippkt(const octet *restrict data, size_t len, RIPPacket *restrict packet)
 {
@@ -102,3 +120,77 @@ parseripresponse(const RIPPacket *restrict packet, int k,
 	return parseriprespocts(packet->data + offset,
 	           packet->datalen - offset, response);
 }
+
+// Write a packet header and authentication entry.
+static size_t
+mkripheader(octet *restrict buf, int command, const char *restrict password)
+{
+	buf[0] = command;
+	buf[1] = RIP_VERSION_2;
+	writenet16(buf + 2, 0);
+	writenet16(buf + 4, 0xFFFF);
+	writenet16(buf + 6, RIP_AUTH_PASSWORD);
+	memset(buf + 8, 0, RIP_PASSWORD_SIZE);
+	memcpy(buf + 8, password, strnlen(password, RIP_PASSWORD_SIZE));
+
+	return MIN_RIP_PACKET_SIZE + RIP_RESPONSE_SIZE;
+}
+
+static void
+mkriprespocts(octet *data, const RIPResponse *restrict response)
+{
+	writenet16(data +  0, response->addrfamily);
+	writenet16(data +  2, response->routetag);
+	writenet32(data +  4, response->ipaddr);
+	writenet32(data +  8, response->subnetmask);
+	writenet32(data + 12, response->nexthop);
+	writenet32(data + 16, response->metric);
+}
+
+/*
+ * Build an authenticated request for the responder's whole routing
+ * table (RFC 2453 section 3.9.1: a single entry with address family
+ * zero and an infinite metric).  Returns the packet length, or 0 if
+ * 'buf' is too small.
+ */
+size_t
+mkriprequest(octet *restrict buf, size_t len, const char *restrict password)
+{
+	RIPResponse whole;
+	size_t n;
+
+	assert(buf != NULL);
+	assert(password != NULL);
+	if (len < MIN_RIP_PACKET_SIZE + 2*RIP_RESPONSE_SIZE)
+		return 0;
+	n = mkripheader(buf, RIP_CMD_REQUEST, password);
+	memset(&whole, 0, sizeof(whole));
+	whole.metric = RIP_METRIC_INFINITY;
+	mkriprespocts(buf + n, &whole);
+
+	return n + RIP_RESPONSE_SIZE;
+}
+
+/*
+ * Build an authenticated response carrying the given entries.
+ * Returns the packet length, or 0 if 'buf' is too small.
+ */
+size_t
+mkripresponse(octet *restrict buf, size_t len, const char *restrict password,
+    const RIPResponse *restrict responses, size_t nresponse)
+{
+	size_t n;
+
+	assert(buf != NULL);
+	assert(password != NULL);
+	assert(responses != NULL || nresponse == 0);
+	if (len < MIN_RIP_PACKET_SIZE + (1 + nresponse)*RIP_RESPONSE_SIZE)
+		return 0;
+	n = mkripheader(buf, RIP_CMD_RESPONSE, password);
+	for (size_t k = 0; k < nresponse; k++) {
+		mkriprespocts(buf + n, &responses[k]);
+		n += RIP_RESPONSE_SIZE;
+	}
+
+	return n;
+}
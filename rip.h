@@ -13,6 +13,16 @@ enum {
 	MIN_RIP_PACKET_SIZE = 4,
 };
 
+enum {
+	RIP_CMD_REQUEST = 1,
+	RIP_CMD_RESPONSE = 2,
+	RIP_VERSION_2 = 2,
+	RIP_AUTH_PASSWORD = 2,
+	RIP_METRIC_INFINITY = 16,
+	RIP_MAX_RESPONSES = 25,		// Per packet, not counting auth.
+	RIP_PASSWORD_SIZE = 16,
+};
+
 struct RIPPacket {
 	octet command;
 	octet version;
@@ -38,5 +48,7 @@ struct RIPResponse {
 int parserippkt(const octet *restrict data, size_t len, RIPPacket *restrict packet);
 int verifyripauth(RIPPacket *restrict packet, const char *restrict password);
 int parseripresponse(const RIPPacket *restrict pkt, int k, RIPResponse *restrict response);
+size_t mkriprequest(octet *restrict buf, size_t len, const char *restrict password);
+size_t mkripresponse(octet *restrict buf, size_t len, const char *restrict password, const RIPResponse *restrict responses, size_t nresponse);
 
 #endif
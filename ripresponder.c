@@ -0,0 +1,170 @@
+/*
+ * A stand-in RIPv2 responder for measuring how quickly the daemon
+ * learns a full table when it starts with -Q.
+ *
+ * Reads a table of "network netmask [nexthop]" lines (the format
+ * of the files in testdata/), then answers every authenticated
+ * whole-table request with that table, 25 entries per packet,
+ * unicast back to the requester.  Entries without a next hop are
+ * given distinct ones from 198.18.0.0/15.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "rip.h"
+
+enum {
+	DEFAULT_PORT = 5520,
+	MAX_PACKET = MIN_RIP_PACKET_SIZE +
+	    (1 + RIP_MAX_RESPONSES)*RIP_RESPONSE_SIZE,
+};
+
+static RIPResponse *table;
+static size_t ntable;
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [ -p <port> ] [ -a <password> ] <table>\n",
+	    prog);
+	exit(EXIT_FAILURE);
+}
+
+static void
+readtable(const char *path)
+{
+	char buf[256];
+	size_t max = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	while (fgets(buf, sizeof buf, fp) != NULL) {
+		char *bp = buf;
+		char *ip = strsep(&bp, " \t\r\n");
+		char *mask = strsep(&bp, " \t\r\n");
+		char *nexthop = strsep(&bp, " \t\r\n");
+		RIPResponse *r;
+
+		if (ip == NULL || mask == NULL || *ip == '\0')
+			continue;
+		if (ntable == max) {
+			max = (max == 0) ? 256 : 2*max;
+			table = reallocarray(table, max, sizeof(*table));
+			if (table == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		r = &table[ntable];
+		memset(r, 0, sizeof(*r));
+		r->addrfamily = AF_INET;
+		r->ipaddr = ntohl(inet_addr(ip));
+		r->subnetmask = ntohl(inet_addr(mask));
+		if (nexthop != NULL && *nexthop != '\0')
+			r->nexthop = ntohl(inet_addr(nexthop));
+		else
+			r->nexthop = 0xC6120000 + 1 + ntable;
+		r->metric = 1;
+		if (!isvalidnetmask(r->subnetmask)) {
+			fprintf(stderr, "bad netmask: %s\n", mask);
+			continue;
+		}
+		ntable++;
+	}
+	fclose(fp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *prog = argv[0];
+	const char *password = "pLaInTeXtpAsSwD";
+	struct sockaddr_in sin;
+	int sd, ch, port;
+
+	port = DEFAULT_PORT;
+	while ((ch = getopt(argc, argv, "a:p:")) != -1) {
+		switch (ch) {
+		case 'a':
+			password = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(prog);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage(prog);
+	readtable(argv[0]);
+
+	sd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sd < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "serving %zu routes on port %d\n", ntable, port);
+
+	for (;;) {
+		struct sockaddr_in remote;
+		socklen_t remotelen = sizeof(remote);
+		octet packet[MAX_PACKET];
+		RIPPacket pkt;
+		ssize_t n;
+
+		n = recvfrom(sd, packet, sizeof(packet), 0,
+		    (struct sockaddr *)&remote, &remotelen);
+		if (n < 0) {
+			perror("recvfrom");
+			exit(EXIT_FAILURE);
+		}
+		memset(&pkt, 0, sizeof(pkt));
+		if (parserippkt(packet, n, &pkt) < 0 ||
+		    pkt.command != RIP_CMD_REQUEST ||
+		    verifyripauth(&pkt, password) < 0)
+		{
+			fprintf(stderr, "ignoring bad request\n");
+			continue;
+		}
+		for (size_t k = 0; k < ntable; k += RIP_MAX_RESPONSES) {
+			size_t count = ntable - k;
+			if (count > RIP_MAX_RESPONSES)
+				count = RIP_MAX_RESPONSES;
+			size_t len = mkripresponse(packet, sizeof(packet),
+			    password, &table[k], count);
+			if (sendto(sd, packet, len, 0,
+			    (struct sockaddr *)&remote, remotelen) < 0)
+				perror("sendto");
+		}
+		fprintf(stderr, "answered %s:%d with %zu routes\n",
+		    inet_ntoa(remote.sin_addr), ntohs(remote.sin_port),
+		    ntable);
+	}
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Slab allocation of fixed-size objects, for the routes and tunnels.
+ *
+ * A page starts with its header, then the array of hot records,
+ * then the array of objects, each array starting on a cache line.
+ * Live objects are marked in the header's bitmap, which is what
+ * slabscan() walks; the free list is threaded through the objects
+ * themselves, so a free object costs nothing besides its slot.
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bits.h"
+#include "log.h"
+#include "slab.h"
+
+_Static_assert((SLAB_PAGESIZE & (SLAB_PAGESIZE - 1)) == 0,
+    "the page size must be a power of two");
+
+static size_t
+roundline(size_t n)
+{
+	return (n + SLAB_LINE - 1) & ~(size_t)(SLAB_LINE - 1);
+}
+
+Slab *
+mkslab(size_t size, size_t hotsize)
+{
+	Slab *slab;
+	size_t n;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	slab = calloc(1, sizeof(*slab));
+	if (slab == NULL)
+		fatal("calloc");
+	slab->size = size;
+	slab->hotsize = hotsize;
+	slab->hotoff = roundline(sizeof(SlabPage));
+	n = (SLAB_PAGESIZE - slab->hotoff - SLAB_LINE) / (size + hotsize);
+	if (n > SLAB_MAXOBJS)
+		n = SLAB_MAXOBJS;
+	if (n == 0)
+		fatal("slab objects of %zu bytes do not fit a page", size);
+	slab->nperpage = n;
+	slab->objoff = roundline(slab->hotoff + n*hotsize);
+	assert(slab->objoff + n*size <= SLAB_PAGESIZE);
+
+	return slab;
+}
+
+void
+freeslab(Slab *slab)
+{
+	if (slab == NULL)
+		return;
+	while (slab->pages != NULL) {
+		SlabPage *next = slab->pages->next;
+		free(slab->pages);
+		slab->pages = next;
+	}
+	free(slab);
+}
+
+//
+// Add a page, and put its objects on the free list so that the
+// first is handed out first.
+//
+static void
+growslab(Slab *slab)
+{
+	SlabPage *page;
+	char *objs;
+
+	page = aligned_alloc(SLAB_PAGESIZE, SLAB_PAGESIZE);
+	if (page == NULL)
+		fatal("aligned_alloc");
+	memset(page, 0, sizeof(*page));
+	page->slab = slab;
+	page->next = slab->pages;
+	slab->pages = page;
+	slab->npages++;
+	objs = (char *)page + slab->objoff;
+	for (size_t k = slab->nperpage; k-- > 0;) {
+		void *obj = objs + k*slab->size;
+		*(void **)obj = slab->free;
+		slab->free = obj;
+	}
+}
+
+//
+// Returns a zeroed object with a zeroed hot record.
+//
+void *
+slaballoc(Slab *slab)
+{
+	SlabPage *page;
+	size_t k;
+	void *obj;
+
+	if (slab->free == NULL)
+		growslab(slab);
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	page = slabpage(obj);
+	k = slabindex(page, obj);
+	assert((page->live[k/64] & (1ULL << k%64)) == 0);
+	page->live[k/64] |= 1ULL << k%64;
+	page->nlive++;
+	slab->nlive++;
+	memset(obj, 0, slab->size);
+	memset(slabhot(obj), 0, slab->hotsize);
+
+	return obj;
+}
+
+void
+slabfree(Slab *slab, void *obj)
+{
+	SlabPage *page;
+	size_t k;
+
+	if (obj == NULL)
+		return;
+	page = slabpage(obj);
+	assert(page->slab == slab);
+	k = slabindex(page, obj);
+	assert((page->live[k/64] & (1ULL << k%64)) != 0);
+	page->live[k/64] &= ~(1ULL << k%64);
+	page->nlive--;
+	slab->nlive--;
+	*(void **)obj = slab->free;
+	slab->free = obj;
+}
+
+//
+// Call 'thunk' with the hot record and the object of each live
+// object, page by page, stopping at the first non-zero return.
+// The thunk may free the object it is given, but no other.
+//
+int
+slabscan(Slab *slab, int (*thunk)(void *hot, void *obj, void *arg),
+    void *arg)
+{
+	for (SlabPage *page = slab->pages; page != NULL; page = page->next) {
+		char *hot = (char *)page + slab->hotoff;
+		char *objs = (char *)page + slab->objoff;
+
+		if (page->nlive == 0)
+			continue;
+		for (size_t w = 0; w < SLAB_MAXOBJS/64; w++) {
+			uint64_t live = page->live[w];
+
+			while (live != 0) {
+				size_t k = 64*w + ctz64(live);
+				int rc;
+
+				live &= live - 1;
+				rc = thunk(hot + k*slab->hotsize,
+				    objs + k*slab->size, arg);
+				if (rc != 0)
+					return rc;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef RIPD_SLAB_H
+#define RIPD_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Slab Slab;
+typedef struct SlabPage SlabPage;
+
+/*
+ * A slab of fixed-size objects, carved from pages of SLAB_PAGESIZE
+ * bytes aligned to their size, so that an object finds its page by
+ * masking its address.  Besides the objects, a page may hold a
+ * 'hot' record for each of them, in a dense array of its own: the
+ * few fields that a scan of every object reads are kept there, and
+ * slabscan() visits the hot records of the live objects without
+ * touching the objects.  Freed objects are reused before the slab
+ * grows.  Pages are only given back by freeslab().
+ */
+enum {
+	SLAB_PAGESIZE = 16384,
+	SLAB_MAXOBJS = 512,	// Per page.
+	SLAB_LINE = 64,		// Hot records and objects start on a line.
+};
+
+struct SlabPage {
+	Slab *slab;
+	SlabPage *next;
+	size_t nlive;
+	uint64_t live[SLAB_MAXOBJS/64];
+};
+
+struct Slab {
+	size_t size;		// Of an object.
+	size_t hotsize;		// Of its hot record; may be 0.
+	size_t nperpage;
+	size_t hotoff;		// Offsets of the two arrays in a page.
+	size_t objoff;
+	SlabPage *pages;
+	void *free;		// Freed objects, linked through their start.
+	size_t nlive;
+	size_t npages;
+};
+
+Slab *mkslab(size_t size, size_t hotsize);
+void freeslab(Slab *slab);
+void *slaballoc(Slab *slab);
+void slabfree(Slab *slab, void *obj);
+int slabscan(Slab *slab, int (*thunk)(void *hot, void *obj, void *arg),
+    void *arg);
+
+static inline SlabPage *
+slabpage(const void *obj)
+{
+	return (SlabPage *)((uintptr_t)obj & ~(uintptr_t)(SLAB_PAGESIZE - 1));
+}
+
+static inline size_t
+slabindex(const SlabPage *page, const void *obj)
+{
+	return ((const char *)obj - (const char *)page - page->slab->objoff) /
+	    page->slab->size;
+}
+
+// The hot record of an object from any slab.
+static inline void *
+slabhot(const void *obj)
+{
+	SlabPage *page = slabpage(obj);
+
+	return (char *)page + page->slab->hotoff +
+	    slabindex(page, obj)*page->slab->hotsize;
+}
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * Binary snapshots of the daemon's tunnels and routes.
+ *
+ * A snapshot is written periodically and on shutdown so that a
+ * restarted daemon can pick up where it left off, including the
+ * real expiry time of every route, rather than rediscovering the
+ * system and guessing at expiry times.  Snapshots are written to
+ * a temporary file and renamed into place, so a reader never sees
+ * a partial one, and are read back by mapping them into memory.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "log.h"
+#include "snapshot.h"
+
+typedef struct SnapWriter SnapWriter;
+
+struct SnapWriter {
+	FILE *fp;
+	uint32_t checksum;
+	uint32_t count;
+	int failed;
+};
+
+static const char SNAPSHOT_MAGIC[8] = "44RIPSNP";
+
+static const uint32_t FNV_OFFSET = 2166136261U;
+static const uint32_t FNV_PRIME = 16777619U;
+
+// FNV-1a, continued from 'h'.
+static uint32_t
+fnv1a(uint32_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+static void
+put(SnapWriter *w, const void *rec, size_t len)
+{
+	w->checksum = fnv1a(w->checksum, rec, len);
+	if (fwrite(rec, len, 1, w->fp) != 1)
+		w->failed = 1;
+	w->count++;
+}
+
+static void
+put_tunnel(SnapWriter *w, const Tunnel *tunnel)
+{
+	SnapTunnel rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.outer_local = tunnel->outer_local;
+	rec.outer_remote = tunnel->outer_remote;
+	rec.inner_local = tunnel->inner_local;
+	rec.inner_remote = tunnel->inner_remote;
+	rec.ifnum = tunnel->ifnum;
+	memcpy(rec.ifname, tunnel->ifname, sizeof(rec.ifname));
+	put(w, &rec, sizeof(rec));
+}
+
+static int
+put_route(uint32_t key, size_t keylen, void *routep, void *arg)
+{
+	Route *route = routep;
+	SnapWriter *w = arg;
+	SnapRoute rec;
+
+	if (route->tunnel == NULL)
+		return 0;
+	memset(&rec, 0, sizeof(rec));
+	rec.ipnet = route->ipnet;
+	rec.subnetmask = route->subnetmask;
+	rec.gateway = route->tunnel->outer_remote;
+	rec.expires = routeexpires(route);
+	put(w, &rec, sizeof(rec));
+
+	return w->failed;
+}
+
+int
+writesnapshot(const char *path, int rtable, tunnelmap *tunnels,
+    IPMap *routes)
+{
+	SnapHeader header;
+	SnapWriter w;
+	tunnelmapiter it;
+	char tmp[1024];
+	FILE *fp;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >=
+	    sizeof(tmp))
+	{
+		error("snapshot path too long: %s", path);
+		return -1;
+	}
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		error("cannot create snapshot %s: %m", tmp);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		goto fail;
+	w.fp = fp;
+	w.checksum = FNV_OFFSET;
+	w.count = 0;
+	w.failed = 0;
+	for (tunnelmapwalk(tunnels, &it); !w.failed && tunnelmapnext(&it);)
+		put_tunnel(&w, *it.value);
+	if (w.failed)
+		goto fail;
+	header.ntunnels = w.count;
+	w.count = 0;
+	ipmapdo(routes, put_route, &w);
+	if (w.failed)
+		goto fail;
+	header.nroutes = w.count;
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.rtable = rtable;
+	header.written = time(NULL);
+	header.checksum = w.checksum;
+	if (fseek(fp, 0, SEEK_SET) < 0 ||
+	    fwrite(&header, sizeof(header), 1, fp) != 1)
+		goto fail;
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+		goto fail;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto fail;
+	}
+	if (rename(tmp, path) < 0) {
+		error("cannot rename snapshot %s: %m", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	debug("wrote snapshot %s: %" PRIu32 " tunnels, %" PRIu32 " routes",
+	    path, header.ntunnels, header.nroutes);
+
+	return 0;
+
+fail:
+	error("cannot write snapshot %s: %m", tmp);
+	if (fp != NULL)
+		fclose(fp);
+	unlink(tmp);
+	return -1;
+}
+
+/*
+ * Map the snapshot at 'path' and check that it is complete and
+ * intact.  Returns NULL if there is no usable snapshot.
+ */
+Snapshot *
+opensnapshot(const char *path)
+{
+	struct stat st;
+	Snapshot *snap;
+	const SnapHeader *header;
+	void *base;
+	size_t len, want;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SnapHeader)) {
+		close(fd);
+		return NULL;
+	}
+	len = st.st_size;
+	base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		error("cannot map snapshot %s: %m", path);
+		return NULL;
+	}
+
+	header = base;
+	want = sizeof(SnapHeader) +
+	    (size_t)header->ntunnels*sizeof(SnapTunnel) +
+	    (size_t)header->nroutes*sizeof(SnapRoute);
+	if (memcmp(header->magic, SNAPSHOT_MAGIC,
+	    sizeof(SNAPSHOT_MAGIC)) != 0 ||
+	    header->version != SNAPSHOT_VERSION || len != want ||
+	    fnv1a(FNV_OFFSET, header + 1, len - sizeof(SnapHeader)) !=
+	    header->checksum)
+	{
+		notice("ignoring damaged or incompatible snapshot %s", path);
+		munmap(base, len);
+		return NULL;
+	}
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		fatal("malloc");
+	snap->base = base;
+	snap->len = len;
+	snap->header = header;
+	snap->tunnels = (const SnapTunnel *)(header + 1);
+	snap->routes = (const SnapRoute *)(snap->tunnels + header->ntunnels);
+
+	return snap;
+}
+
+void
+closesnapshot(Snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	munmap(snap->base, snap->len);
+	free(snap);
+}
@@ -0,0 +1,70 @@
+#ifndef RIPD_SNAPSHOT_H
+#define RIPD_SNAPSHOT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "dat.h"
+#include "lib.h"
+
+typedef struct SnapHeader SnapHeader;
+typedef struct SnapTunnel SnapTunnel;
+typedef struct SnapRoute SnapRoute;
+typedef struct Snapshot Snapshot;
+
+enum {
+	SNAPSHOT_VERSION = 1,
+};
+
+/*
+ * On-disk layout of a state snapshot: a header followed by
+ * 'ntunnels' tunnel records and 'nroutes' route records.  All
+ * fields are in host byte order; snapshots are not meant to move
+ * between machines.  The checksum covers everything after the
+ * header.
+ */
+struct SnapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t rtable;
+	int64_t written;
+	uint32_t ntunnels;
+	uint32_t nroutes;
+	uint32_t checksum;
+	uint32_t pad;
+};
+
+struct SnapTunnel {
+	uint32_t outer_local;
+	uint32_t outer_remote;
+	uint32_t inner_local;
+	uint32_t inner_remote;
+	uint32_t ifnum;
+	char ifname[MAX_TUN_IFNAME];
+};
+
+struct SnapRoute {
+	uint32_t ipnet;
+	uint32_t subnetmask;
+	uint32_t gateway;	// Outer remote address of the tunnel.
+	uint32_t pad;
+	int64_t expires;
+};
+
+/*
+ * A snapshot mapped into memory by opensnapshot().
+ */
+struct Snapshot {
+	void *base;
+	size_t len;
+	const SnapHeader *header;
+	const SnapTunnel *tunnels;
+	const SnapRoute *routes;
+};
+
+int writesnapshot(const char *path, int rtable, tunnelmap *tunnels,
+    IPMap *routes);
+Snapshot *opensnapshot(const char *path);
+void closesnapshot(Snapshot *snap);
+
+#endif
@@ -0,0 +1,57 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hist.h"
+#include "stats.h"
+
+Stats stats;
+
+const StatName statnames[] = {
+	{ "packets", "RIP datagrams received.",
+	    offsetof(Stats, packets) },
+	{ "parse_errors", "Datagrams that were not valid RIP packets.",
+	    offsetof(Stats, parseerrors) },
+	{ "auth_failures", "RIP packets that failed authentication.",
+	    offsetof(Stats, authfailures) },
+	{ "routes_added", "Routes learned.",
+	    offsetof(Stats, routesadded) },
+	{ "routes_changed", "Routes moved to a different tunnel.",
+	    offsetof(Stats, routeschanged) },
+	{ "routes_expired", "Routes expired and removed.",
+	    offsetof(Stats, routesexpired) },
+	{ "routes_rejected", "Routes removed by a policy reload.",
+	    offsetof(Stats, routesrejected) },
+	{ "tunnels_created", "Tunnels brought up.",
+	    offsetof(Stats, tunnelscreated) },
+	{ "tunnels_destroyed", "Tunnels torn down.",
+	    offsetof(Stats, tunnelsdestroyed) },
+	{ "kernel_failures", "Kernel route operations that failed.",
+	    offsetof(Stats, kernelfailures) },
+};
+
+const size_t nstatnames = sizeof(statnames)/sizeof(statnames[0]);
+
+Hist latency[NPHASES];
+
+const char *phasenames[NPHASES] = {
+	[PHASE_RECV] = "recvfrom",
+	[PHASE_PARSE] = "parserippkt",
+	[PHASE_AUTH] = "verifyripauth",
+	[PHASE_RESPONSES] = "ripresponse",
+	[PHASE_EXPIRE] = "walkexpired",
+	[PHASE_UPTUNNEL] = "uptunnel",
+	[PHASE_DOWNTUNNEL] = "downtunnel",
+	[PHASE_ADDROUTE] = "addroute",
+	[PHASE_CHROUTE] = "chroute",
+	[PHASE_RMROUTE] = "rmroute",
+};
+
+uint64_t
+statvalue(const StatName *stat)
+{
+	atomic_uint_fast64_t *p = (atomic_uint_fast64_t *)
+	    ((char *)&stats + stat->offset);
+
+	return atomic_load_explicit(p, memory_order_relaxed);
+}
@@ -0,0 +1,87 @@
+#ifndef RIPD_STATS_H
+#define RIPD_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hist.h"
+#include "lib.h"
+
+typedef struct Stats Stats;
+typedef struct StatName StatName;
+
+/*
+ * Event counters and gauges.  They are bumped from the packet path
+ * and from pool workers and read by the control socket and the
+ * metrics exporter, so they are atomic; relaxed ordering is enough
+ * since each is independent.  The gauges are only set by the main
+ * thread.
+ */
+struct Stats {
+	atomic_uint_fast64_t packets;
+	atomic_uint_fast64_t parseerrors;
+	atomic_uint_fast64_t authfailures;
+	atomic_uint_fast64_t routesadded;
+	atomic_uint_fast64_t routeschanged;
+	atomic_uint_fast64_t routesexpired;
+	atomic_uint_fast64_t routesrejected;
+	atomic_uint_fast64_t tunnelscreated;
+	atomic_uint_fast64_t tunnelsdestroyed;
+	atomic_uint_fast64_t kernelfailures;
+
+	atomic_int_fast64_t routes;
+	atomic_int_fast64_t tunnels;
+	atomic_int_fast64_t lastexpired;	// Removed by the last walk.
+	atomic_int_fast64_t nextexpiry;		// Earliest expiry, or 0.
+};
+
+struct StatName {
+	const char *name;
+	const char *help;
+	size_t offset;
+};
+
+/*
+ * Phases of packet processing and kernel operations whose latency,
+ * in nanoseconds, is kept in a histogram.
+ */
+enum Phase {
+	PHASE_RECV,
+	PHASE_PARSE,
+	PHASE_AUTH,
+	PHASE_RESPONSES,
+	PHASE_EXPIRE,
+	PHASE_UPTUNNEL,
+	PHASE_DOWNTUNNEL,
+	PHASE_ADDROUTE,
+	PHASE_CHROUTE,
+	PHASE_RMROUTE,
+	NPHASES
+};
+
+extern Stats stats;
+extern const StatName statnames[];
+extern const size_t nstatnames;
+extern Hist latency[NPHASES];
+extern const char *phasenames[NPHASES];
+
+#define statinc(counter) \
+	atomic_fetch_add_explicit(&stats.counter, 1, memory_order_relaxed)
+#define statadd(gauge, n) \
+	atomic_fetch_add_explicit(&stats.gauge, (n), memory_order_relaxed)
+#define statset(gauge, v) \
+	atomic_store_explicit(&stats.gauge, (v), memory_order_relaxed)
+#define statget(gauge) \
+	atomic_load_explicit(&stats.gauge, memory_order_relaxed)
+
+// Run 'call' and record how long it took against 'phase'.
+#define timed(phase, call) do { \
+	uint64_t timed_start = nanotime(); \
+	call; \
+	histrecord(&latency[phase], nanotime() - timed_start); \
+} while (0)
+
+uint64_t statvalue(const StatName *stat);
+
+#endif
@@ -15,8 +15,11 @@ typedef void (*rt_discovered_thunk)(uint32_t ipnet, uint32_t mask,
         
 void discover(int rtable, if_discovered_thunk ifthunk,
     rt_discovered_thunk rtthunk, void *arg);
+void discovertunnels(int rtable, if_discovered_thunk ifthunk, void *arg);
 int initsock(const char *restrict group, int port, int rtable);
 void initsys(int rtable);
+void initsysthread(int rtable);
+void finisysthread(void);
 int uptunnel(Tunnel *tunnel, int rtable);
 int downtunnel(Tunnel *tunnel);
 int addroute(Route *route, Tunnel *tunnel, int rtable);
@@ -0,0 +1,373 @@
+/*
+ * A Tree Bitmap multibit trie, after Eatherton, Varghese and
+ * Dittia, with a stride of four bits.
+ *
+ * Each node stands for one four-bit chunk of the key and holds two
+ * bitmaps.  The internal bitmap has a bit for each of the fifteen
+ * prefixes that end inside the node, of lengths 0 to 3 below the
+ * node's own depth, numbered as in a heap: position 1 is the node
+ * itself and position p has children 2p and 2p+1.  The external
+ * bitmap has a bit for each of the sixteen possible child nodes.
+ * Children and data are kept in two arrays, in bitmap order, so
+ * the index of either is the number of bits set below its own.
+ *
+ * A lookup masks the internal bitmap with the positions the key's
+ * chunk passes through, remembers the highest match, and moves to
+ * the child for the chunk, if any.  Updates resize one or two of
+ * the arrays, and a remove frees nodes left with nothing in them.
+ * The arrays have exactly as many entries as bits set, so a node
+ * is 24 bytes and each prefix costs a pointer.
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bits.h"
+#include "log.h"
+#include "tbm.h"
+
+typedef struct TBNode TBNode;
+
+_Static_assert(TBM_STRIDE == 4, "the bitmaps assume a stride of four");
+
+enum {
+	NCHUNKS = 1 << TBM_STRIDE,
+	MAXDEPTH = 32 / TBM_STRIDE,	// A host route ends in a node here.
+};
+
+struct TBNode {
+	uint16_t internal;	// Prefixes ending here, by heap position.
+	uint16_t external;	// Children, by chunk.
+	TBNode *children;	// One per bit of 'external'.
+	void **data;		// One per bit of 'internal'.
+};
+
+struct TBMap {
+	TBNode root;
+	size_t count;
+};
+
+//
+// The internal positions a chunk passes through: 1, then one of
+// 2-3, 4-7 and 8-15.  'lenmask[r]' keeps the positions of prefixes
+// at most 'r' bits into the node.
+//
+static const uint16_t matchmask[NCHUNKS] = {
+	0x0116, 0x0116, 0x0216, 0x0216, 0x0426, 0x0426, 0x0826, 0x0826,
+	0x104A, 0x104A, 0x204A, 0x204A, 0x408A, 0x408A, 0x808A, 0x808A,
+};
+
+static const uint16_t lenmask[TBM_STRIDE] = {
+	0x0003, 0x000F, 0x00FF, 0xFFFF,
+};
+
+// The index of the highest bit set in a non-zero 'w'.
+static inline unsigned int
+highbit(unsigned int w)
+{
+	return 31 - clz32(w);
+}
+
+// Entries of an array before the one for bit 'b' of 'bitmap'.
+static inline unsigned int
+rank(unsigned int bitmap, unsigned int b)
+{
+	return pop32(bitmap & ((1U << b) - 1));
+}
+
+// The chunk of 'key' that picks a child of a node at 'depth'.
+static inline unsigned int
+chunk(uint32_t key, size_t depth)
+{
+	return (key >> (32 - TBM_STRIDE*(depth + 1))) & (NCHUNKS - 1);
+}
+
+// The internal position of a prefix 'r' bits into a node.
+static inline unsigned int
+position(uint32_t key, size_t depth, size_t r)
+{
+	if (r == 0)
+		return 1;
+	return (1U << r) | (chunk(key, depth) >> (TBM_STRIDE - r));
+}
+
+static TBNode *
+child(TBNode *node, unsigned int c)
+{
+	if ((node->external & (1U << c)) == 0)
+		return NULL;
+	return &node->children[rank(node->external, c)];
+}
+
+//
+// Open a slot at 'index' in an array of 'n' elements of 'size'
+// bytes, or close the one there.
+//
+static void *
+growarray(void *array, size_t n, size_t size, size_t index)
+{
+	char *p = realloc(array, (n + 1)*size);
+
+	if (p == NULL)
+		fatal("realloc");
+	memmove(p + (index + 1)*size, p + index*size, (n - index)*size);
+
+	return p;
+}
+
+static void *
+shrinkarray(void *array, size_t n, size_t size, size_t index)
+{
+	char *p = array;
+
+	memmove(p + index*size, p + (index + 1)*size, (n - index - 1)*size);
+	if (n == 1) {
+		free(p);
+		return NULL;
+	}
+	p = realloc(p, (n - 1)*size);
+	if (p == NULL)
+		fatal("realloc");
+
+	return p;
+}
+
+TBMap *
+mktbmap(void)
+{
+	TBMap *map = calloc(1, sizeof(*map));
+
+	if (map == NULL)
+		fatal("calloc");
+
+	return map;
+}
+
+static void
+freenodes(TBNode *node, void (*freedatum)(void *))
+{
+	unsigned int nchildren = pop32(node->external);
+	unsigned int ndata = pop32(node->internal);
+
+	for (unsigned int k = 0; k < nchildren; k++)
+		freenodes(&node->children[k], freedatum);
+	free(node->children);
+	for (unsigned int k = 0; k < ndata; k++)
+		freedatum(node->data[k]);
+	free(node->data);
+}
+
+void
+freetbmap(TBMap *map, void (*freedatum)(void *))
+{
+	if (map == NULL)
+		return;
+	freenodes(&map->root, freedatum);
+	free(map);
+}
+
+size_t
+tbmapcount(const TBMap *map)
+{
+	return map->count;
+}
+
+void *
+tbmapnearest(TBMap *map, uint32_t key, size_t keylen)
+{
+	TBNode *node = &map->root, *best = NULL;
+	unsigned int bestpos = 0;
+
+	assert(keylen <= 32);
+	for (size_t depth = 0;; depth++) {
+		size_t r = keylen - TBM_STRIDE*depth;
+		unsigned int c = (depth < MAXDEPTH) ? chunk(key, depth) : 0;
+		unsigned int m;
+
+		m = node->internal & matchmask[c] &
+		    lenmask[(r < TBM_STRIDE) ? r : TBM_STRIDE - 1];
+		if (m != 0) {
+			best = node;
+			bestpos = highbit(m);
+		}
+		if (r < TBM_STRIDE || (node = child(node, c)) == NULL)
+			break;
+	}
+	if (best == NULL)
+		return NULL;
+
+	return best->data[rank(best->internal, bestpos)];
+}
+
+//
+// The node a prefix of 'keylen' bits ends in, or NULL if there is
+// none.
+//
+static TBNode *
+lastnode(TBMap *map, uint32_t key, size_t keylen)
+{
+	TBNode *node = &map->root;
+
+	for (size_t depth = 0; node != NULL && depth < keylen / TBM_STRIDE;
+	    depth++)
+		node = child(node, chunk(key, depth));
+
+	return node;
+}
+
+void *
+tbmapfind(TBMap *map, uint32_t key, size_t keylen)
+{
+	TBNode *node;
+	unsigned int pos;
+
+	assert(keylen <= 32);
+	node = lastnode(map, key, keylen);
+	if (node == NULL)
+		return NULL;
+	pos = position(key, keylen / TBM_STRIDE, keylen % TBM_STRIDE);
+	if ((node->internal & (1U << pos)) == 0)
+		return NULL;
+
+	return node->data[rank(node->internal, pos)];
+}
+
+void *
+tbmapinsert(TBMap *map, uint32_t key, size_t keylen, void *datum)
+{
+	TBNode *node = &map->root;
+	unsigned int pos, index;
+
+	assert(keylen <= 32);
+	assert(datum != NULL);
+	for (size_t depth = 0; depth < keylen / TBM_STRIDE; depth++) {
+		unsigned int c = chunk(key, depth);
+		TBNode *next = child(node, c);
+		if (next == NULL) {
+			index = rank(node->external, c);
+			node->children = growarray(node->children,
+			    pop32(node->external), sizeof(TBNode), index);
+			node->external |= 1U << c;
+			next = &node->children[index];
+			memset(next, 0, sizeof(*next));
+		}
+		node = next;
+	}
+	pos = position(key, keylen / TBM_STRIDE, keylen % TBM_STRIDE);
+	index = rank(node->internal, pos);
+	if ((node->internal & (1U << pos)) != 0)
+		return node->data[index];
+	node->data = growarray(node->data, pop32(node->internal),
+	    sizeof(void *), index);
+	node->internal |= 1U << pos;
+	node->data[index] = datum;
+	map->count++;
+
+	return datum;
+}
+
+//
+// Remove the datum, then free the nodes on the way back up that
+// have been left with no data and no children.  The root stays.
+//
+void *
+tbmapremove(TBMap *map, uint32_t key, size_t keylen)
+{
+	TBNode *path[MAXDEPTH + 1];
+	size_t depth, last = keylen / TBM_STRIDE;
+	unsigned int pos, index;
+	TBNode *node;
+	void *datum;
+
+	assert(keylen <= 32);
+	path[0] = &map->root;
+	for (depth = 0; depth < last; depth++) {
+		path[depth + 1] = child(path[depth], chunk(key, depth));
+		if (path[depth + 1] == NULL)
+			return NULL;
+	}
+	node = path[last];
+	pos = position(key, last, keylen % TBM_STRIDE);
+	if ((node->internal & (1U << pos)) == 0)
+		return NULL;
+	index = rank(node->internal, pos);
+	datum = node->data[index];
+	node->data = shrinkarray(node->data, pop32(node->internal),
+	    sizeof(void *), index);
+	node->internal &= ~(1U << pos);
+	map->count--;
+
+	for (depth = last; depth > 0; depth--) {
+		TBNode *parent = path[depth - 1];
+		unsigned int c = chunk(key, depth - 1);
+		if (path[depth]->internal != 0 || path[depth]->external != 0)
+			break;
+		parent->children = shrinkarray(parent->children,
+		    pop32(parent->external), sizeof(TBNode),
+		    rank(parent->external, c));
+		parent->external &= ~(1U << c);
+	}
+
+	return datum;
+}
+
+//
+// A node's prefixes and children in the order a walk visits them:
+// internal positions in preorder, each of the last row followed by
+// its two children, numbered from NCHUNKS.
+//
+static const uint8_t preorder[2*NCHUNKS - 1] = {
+	1, 2, 4, 8, 16, 17, 9, 18, 19, 5, 10, 20, 21, 11, 22, 23,
+	3, 6, 12, 24, 25, 13, 26, 27, 7, 14, 28, 29, 15, 30, 31,
+};
+
+//
+// Visit everything under 'node', at 'depth', each prefix before
+// those under it.  'key' holds the bits of the path down to the
+// node.
+//
+static int
+walk(TBNode *node, size_t depth, uint32_t key,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg),
+    void *arg)
+{
+	unsigned int internal = node->internal, external = node->external;
+	unsigned int nchildren = 0;
+
+	for (size_t k = 0; (internal | external) != 0; k++) {
+		unsigned int e = preorder[k];
+		if (e >= NCHUNKS) {
+			unsigned int c = e - NCHUNKS;
+			if ((external & (1U << c)) == 0)
+				continue;
+			external &= ~(1U << c);
+			if (walk(&node->children[nchildren++], depth + 1,
+			    key | c << (32 - TBM_STRIDE*(depth + 1)), thunk,
+			    arg))
+				return 1;
+		} else if ((internal & (1U << e)) != 0) {
+			unsigned int r = highbit(e);
+			uint32_t prefix = key;
+			internal &= ~(1U << e);
+			if (r != 0)
+				prefix |= (e - (1U << r)) <<
+				    (32 - TBM_STRIDE*depth - r);
+			if (thunk(prefix, TBM_STRIDE*depth + r,
+			    node->data[rank(node->internal, e)], arg))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+tbmapdo(TBMap *map,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg),
+    void *arg)
+{
+	if (map != NULL)
+		walk(&map->root, 0, 0, thunk, arg);
+}
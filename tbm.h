@@ -0,0 +1,38 @@
+#ifndef RIPD_TBM_H
+#define RIPD_TBM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct TBMap TBMap;
+
+/*
+ * A Tree Bitmap: a multibit trie that consumes TBM_STRIDE bits of
+ * the key per node, so a lookup touches at most nine nodes however
+ * the prefixes are laid out.  It takes the same keys and has the
+ * same contract as an IPMap: tbmapinsert() keeps the first datum
+ * for a key and returns whichever is stored, tbmapremove() returns
+ * the datum removed or NULL, tbmapnearest() returns the datum of
+ * the longest prefix covering 'key'/'keylen' and tbmapfind() only
+ * an exact match.  Keys are in host byte order and bits below
+ * 'keylen' are ignored.  Data must not be NULL.
+ *
+ * tbmapdo() visits the prefixes in the order of ipmapdotopdown():
+ * sorted by key, each prefix before those under it.
+ */
+enum {
+	TBM_STRIDE = 4,
+};
+
+TBMap *mktbmap(void);
+void freetbmap(TBMap *map, void (*freedatum)(void *));
+void *tbmapinsert(TBMap *map, uint32_t key, size_t keylen, void *datum);
+void *tbmapremove(TBMap *map, uint32_t key, size_t keylen);
+void *tbmapnearest(TBMap *map, uint32_t key, size_t keylen);
+void *tbmapfind(TBMap *map, uint32_t key, size_t keylen);
+void tbmapdo(TBMap *map,
+    int (*thunk)(uint32_t key, size_t keylen, void *datum, void *arg),
+    void *arg);
+size_t tbmapcount(const TBMap *map);
+
+#endif
@@ -0,0 +1,120 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bits.h"
+
+static int failed;
+
+// One bit at a time, to check both versions against.
+static int
+slowctz(uint64_t w)
+{
+	int n = 0;
+
+	while ((w & 0x01) == 0) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+}
+
+static int
+slowclz32(uint32_t w)
+{
+	int n = 0;
+
+	while ((w & 0x80000000) == 0) {
+		w <<= 1;
+		n++;
+	}
+	return n;
+}
+
+static int
+slowclz64(uint64_t w)
+{
+	int n = 0;
+
+	while ((w & 0x8000000000000000ULL) == 0) {
+		w <<= 1;
+		n++;
+	}
+	return n;
+}
+
+static int
+slowpop(uint32_t w)
+{
+	int n = 0;
+
+	for (; w != 0; w >>= 1)
+		n += w & 0x01;
+	return n;
+}
+
+static uint32_t
+slowbrev32(uint32_t w)
+{
+	uint32_t r = 0;
+
+	for (int k = 0; k < 32; k++)
+		r |= ((w >> k) & 0x01) << (31 - k);
+	return r;
+}
+
+static void
+check(const char *what, uint64_t w, uint64_t got, uint64_t want)
+{
+	if (got != want) {
+		printf("%s(%016" PRIx64 ") = %" PRIx64 ", expected %" PRIx64
+		    "\n", what, w, got, want);
+		failed = 1;
+	}
+}
+
+static void
+test(uint64_t w64)
+{
+	uint32_t w = w64;
+
+	check("pop32", w, pop32(w), slowpop(w));
+	check("softpop32", w, softpop32(w), slowpop(w));
+	check("brev32", w, brev32(w), slowbrev32(w));
+	check("softbrev32", w, softbrev32(w), slowbrev32(w));
+	check("bswap32", w, bswap32(w), slowbrev32(bytebrev32(w)));
+	check("softbswap32", w, softbswap32(w), slowbrev32(bytebrev32(w)));
+	if (w != 0) {
+		check("ctz32", w, ctz32(w), slowctz(w));
+		check("softctz32", w, softctz32(w), slowctz(w));
+		check("clz32", w, clz32(w), slowclz32(w));
+		check("softclz32", w, softclz32(w), slowclz32(w));
+	}
+	if (w64 != 0) {
+		check("ctz64", w64, ctz64(w64), slowctz(w64));
+		check("softctz64", w64, softctz64(w64), slowctz(w64));
+		check("clz64", w64, clz64(w64), slowclz64(w64));
+		check("softclz64", w64, softclz64(w64), slowclz64(w64));
+	}
+}
+
+int
+main(void)
+{
+	uint64_t seed = 44;
+
+	test(0);
+	test(~0ULL);
+	for (int k = 0; k < 64; k++) {
+		test(1ULL << k);
+		test(~0ULL << k);
+		test(~0ULL >> k);
+	}
+	for (int k = 0; k < 100000; k++) {
+		seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+		test(seed >> (seed % 64));
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
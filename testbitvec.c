@@ -5,6 +5,57 @@
 
 #include "lib.h"
 
+enum {
+	NBITS = 20000,
+	NLIVE = 5000,
+};
+
+//
+// Allocate and free at random against a plain array, holding
+// about NLIVE bits, with one set far out, as for a statically
+// configured interface.
+//
+static void
+testchurn(void)
+{
+	static char ref[NBITS + 64];
+	Bitvec *bv = mkbitvec();
+	uint32_t seed = 44;
+	size_t live = 2;
+
+	bitset(bv, 9000);
+	ref[9000] = 1;
+	bitset(bv, 4095);
+	ref[4095] = 1;
+	for (int k = 0; k < 200000; k++) {
+		size_t bit, want;
+
+		seed = seed*1103515245 + 12345;
+		if (live < NLIVE && (seed >> 28) < 9) {
+			bit = nextbit(bv);
+			for (want = 0; ref[want]; want++)
+				;
+			if (bit != want) {
+				printf("nextbit %zu, expected %zu\n", bit,
+				    want);
+				exit(EXIT_FAILURE);
+			}
+			assert(bit < NBITS);
+			bitset(bv, bit);
+			ref[bit] = 1;
+			live++;
+		} else {
+			bit = (seed >> 8) % (NLIVE + NLIVE/4);
+			bitclr(bv, bit);
+			live -= ref[bit];
+			ref[bit] = 0;
+		}
+	}
+	for (size_t k = 0; k < NBITS + 64; k++)
+		assert(bitget(bv, k) == ref[k]);
+	freebitvec(bv);
+}
+
 int
 main(void)
 {
@@ -23,6 +74,7 @@ main(void)
 	assert(bitget(bv, 1024) == 0);
 
 	freebitvec(bv);
+	testchurn();
 
 	return 0;
 }
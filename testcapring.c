@@ -0,0 +1,128 @@
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cap.h"
+#include "dat.h"
+
+enum {
+	RING_SIZE = 4096,
+	NPACKETS = 1000,
+};
+
+static char path[] = "/tmp/testcapring.XXXXXX";
+
+// Packet 'k' is k%300 + 1 bytes of the value k, from port k.
+static size_t
+mkpacket(int k, octet *packet)
+{
+	size_t len = k % 300 + 1;
+	memset(packet, k & 0xFF, len);
+	return len;
+}
+
+void
+testreplay(int count)
+{
+	struct sockaddr_in from;
+	octet packet[512], got[512];
+	CapReader *r;
+	int64_t when;
+	ssize_t n;
+	int first, k;
+
+	assert(opencapture(path, RING_SIZE) == 0);
+	memset(&from, 0, sizeof(from));
+	from.sin_family = AF_INET;
+	from.sin_addr.s_addr = htonl(0x2C000001);
+	for (k = 0; k < count; k++) {
+		from.sin_port = htons(k);
+		cappacket(packet, mkpacket(k, packet), &from, 1000 + k);
+	}
+	closecapture();
+
+	r = opencapreader(path);
+	assert(r != NULL);
+	first = -1;
+	k = -1;
+	while ((n = capread(r, got, sizeof(got), &from, &when)) > 0) {
+		// Packets come back in order, with none missing.
+		if (first < 0)
+			first = k = when - 1000;
+		else
+			k++;
+		if (when - 1000 != k || k >= count ||
+		    (size_t)n != mkpacket(k, packet) ||
+		    memcmp(got, packet, n) != 0 ||
+		    ntohs(from.sin_port) != k ||
+		    ntohl(from.sin_addr.s_addr) != 0x2C000001)
+		{
+			printf("bad packet %d after %d\n", k, first);
+			exit(EXIT_FAILURE);
+		}
+	}
+	closecapreader(r);
+	if (k != count - 1 || (count == 3 && first != 0)) {
+		printf("last packet %d, want %d\n", k, count - 1);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+testorder(void)
+{
+	struct sockaddr_in from;
+	octet got[512];
+	CapReader *r;
+	int64_t when, prev = -1;
+	int n = 0;
+
+	// Append to the ring left by the previous test.
+	assert(opencapture(path, RING_SIZE) == 0);
+	memset(&from, 0, sizeof(from));
+	for (int k = 0; k < 5; k++)
+		cappacket((const octet *)"x", 1, &from, 5000 + k);
+	closecapture();
+	r = opencapreader(path);
+	while (capread(r, got, sizeof(got), &from, &when) > 0) {
+		if (when <= prev) {
+			printf("timestamps not increasing: %" PRId64 " %" PRId64
+			    "\n", prev, when);
+			exit(EXIT_FAILURE);
+		}
+		prev = when;
+		n++;
+	}
+	closecapreader(r);
+	assert(prev == 5004);
+	assert(n > 5);
+}
+
+int
+main(void)
+{
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	testreplay(3);
+	unlink(path);
+	testreplay(NPACKETS);
+	testorder();
+	// A file that is not a capture is left for the raw reader.
+	FILE *fp = fopen(path, "w");
+	for (int k = 0; k < 100; k++)
+		fputc(k, fp);
+	fclose(fp);
+	assert(opencapreader(path) == NULL);
+	unlink(path);
+
+	return 0;
+}
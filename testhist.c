@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+static Hist h;
+
+// Every value must land in a bucket whose bounds contain it.
+void
+testbuckets(void)
+{
+	for (uint64_t v = 0; v < ((uint64_t)1 << HIST_MAXEXP);
+	    v = (v < 64) ? v + 1 : v + v/7)
+	{
+		size_t b = histbucket(v);
+		uint64_t hi = histbucketmax(b);
+		uint64_t lo = (b == 0) ? 0 : histbucketmax(b - 1) + 1;
+		if (b >= HIST_BUCKETS || v < lo || v > hi) {
+			printf("value %" PRIu64 " in bucket %zu [%" PRIu64
+			    ", %" PRIu64 "]\n", v, b, lo, hi);
+			exit(EXIT_FAILURE);
+		}
+		// Bucket width is within 1/HIST_SUB of the value.
+		if (v >= HIST_SUB && (hi - lo + 1) > lo/HIST_SUB + 1) {
+			printf("bucket %zu too wide for %" PRIu64 "\n", b, v);
+			exit(EXIT_FAILURE);
+		}
+	}
+	assert(histbucket(UINT64_MAX) == HIST_BUCKETS - 1);
+}
+
+static void
+within(const char *what, uint64_t got, uint64_t want)
+{
+	if (got < want || got > want + want/HIST_SUB) {
+		printf("%s: got %" PRIu64 ", want about %" PRIu64 "\n",
+		    what, got, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+testpercentiles(void)
+{
+	HistSummary s;
+
+	memset(&h, 0, sizeof(h));
+	assert(histpercentile(&h, 50.0) == 0);
+	// 1000..100999 ns in steps of 1.
+	for (uint64_t v = 1000; v < 101000; v++)
+		histrecord(&h, v);
+	histsummary(&h, &s);
+	assert(s.count == 100000);
+	assert(s.max == 100999);
+	within("p50", s.p50, 50999);
+	within("p99", s.p99, 99999);
+	assert(histpercentile(&h, 100.0) == 100999);
+
+	// A single outlier shows up only in the maximum.
+	histrecord(&h, 5000000000ULL);
+	histsummary(&h, &s);
+	assert(s.max == 5000000000ULL);
+	within("p99 with outlier", s.p99, 99999);
+}
+
+int
+main(void)
+{
+	testbuckets();
+	testpercentiles();
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "testlib.h"
+
+enum {
+	NENTRIES = 4096,
+};
+
+//
+// Random prefixes, with repeats and the lengths at both ends,
+// against the same keys inserted one at a time in their original
+// order.  ipmapbuild() is left to clear the host bits itself.
+//
+static void
+testrandom(void)
+{
+	static IPMapEntry entries[NENTRIES], copy[NENTRIES];
+	static int data[NENTRIES];
+	uint32_t seed = 44;
+
+	for (int round = 0; round < 50; round++) {
+		size_t n = (round == 0) ? 0 : (seed >> 4) % NENTRIES;
+		size_t live = ipmaplivenodes(), inserted, built;
+		IPMap *a, *b;
+
+		for (size_t k = 0; k < n; k++) {
+			seed = seed*1103515245 + 12345;
+			entries[k].keylen = (seed >> 8) % 33;
+			seed = seed*1103515245 + 12345;
+			entries[k].key = seed;
+			if (round % 2 == 0)
+				entries[k].key &= 0xFF0F0F00;
+			if (k > 0 && (seed >> 28) == 0)
+				entries[k] = entries[(seed >> 8) % k];
+			entries[k].datum = &data[k];
+		}
+		a = mkipmap();
+		inserted = 0;
+		for (size_t k = 0; k < n; k++) {
+			IPMapEntry *e = &entries[k];
+			uint32_t key = e->key & ~hostbits(e->keylen);
+			if (ipmapinsert(a, key, e->keylen, e->datum) ==
+			    e->datum)
+				inserted++;
+		}
+		memcpy(copy, entries, n*sizeof(*copy));
+		b = mkipmap();
+		built = ipmapbuild(b, copy, n);
+		if (built != inserted)
+			fail("wrong key count (round %d)", round);
+		if (!sametree(a, b))
+			fail("trees differ (round %d)", round);
+		for (size_t k = 1; k < n; k++) {
+			if (copy[k - 1].key > copy[k].key ||
+			    (copy[k - 1].key == copy[k].key &&
+			    copy[k - 1].keylen > copy[k].keylen))
+				fail("entries not sorted (round %d)", round);
+		}
+		freeipmap(a, nofree);
+		freeipmap(b, nofree);
+		if (ipmaplivenodes() != live)
+			fail("nodes leaked (round %d)", round);
+	}
+}
+
+//
+// A default route and a host route under it, given backwards, and
+// a repeat whose datum must lose to the first.
+//
+static void
+testsmall(void)
+{
+	static const char *first = "first", *second = "second";
+	IPMapEntry entries[] = {
+		{ 0x2C000001, 32, (void *)first },
+		{ 0, 0, (void *)first },
+		{ 0x2C000001, 32, (void *)second },
+	};
+	IPMap *map;
+
+	map = mkipmap();
+	if (ipmapbuild(map, entries, 3) != 2)
+		fail("small key count");
+	if (map->datum != first)
+		fail("no default route");
+	if (ipmapfind(map, 0x2C000001, 32) != first)
+		fail("repeat replaced the first datum");
+	if (entries[2].datum != second)
+		fail("repeat not sorted after the first");
+	freeipmap(map, nofree);
+}
+
+int
+main(void)
+{
+	testsmall();
+	testrandom();
+
+	return 0;
+}
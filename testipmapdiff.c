@@ -0,0 +1,289 @@
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "testlib.h"
+
+typedef struct Event Event;
+typedef struct Events Events;
+
+enum {
+	NKEYS = 2000,
+	MAXEVENTS = 2*NKEYS,
+};
+
+struct Event {
+	char what;		// 'a'dded, 'r'emoved, 'c'hanged.
+	uint32_t key;
+	size_t keylen;
+	void *datum;
+};
+
+struct Events {
+	Event ev[MAXEVENTS];
+	size_t n;
+	size_t stopafter;
+};
+
+static int data[2][NKEYS];
+static uint32_t seed = 44;
+
+//
+// Two maps drawn from the same small space of prefixes, so they
+// share many keys, some of them with the same datum.
+//
+static void
+mkmaps(IPMap **a, IPMap **b)
+{
+	*a = mkipmap();
+	*b = mkipmap();
+	for (int k = 0; k < NKEYS; k++) {
+		seed = seed*1103515245 + 12345;
+		size_t keylen = (seed >> 8) % 33;
+		seed = seed*1103515245 + 12345;
+		uint32_t key = (seed & 0xF0F00000) & ~hostbits(keylen);
+		int which = (seed >> 4) % 3;
+		void *datum = &data[0][(seed >> 8) % 64];
+		if (which != 1)
+			ipmapinsert(*a, key, keylen, datum);
+		if (which != 0) {
+			if ((seed >> 16) % 2 == 0)
+				datum = &data[1][k];
+			ipmapinsert(*b, key, keylen, datum);
+		}
+	}
+}
+
+static int
+record(Events *e, char what, uint32_t key, size_t keylen, void *datum)
+{
+	if (e->n == MAXEVENTS)
+		fail("too many events");
+	e->ev[e->n].what = what;
+	e->ev[e->n].key = key;
+	e->ev[e->n].keylen = keylen;
+	e->ev[e->n++].datum = datum;
+	return e->stopafter != 0 && e->n == e->stopafter;
+}
+
+static int
+added(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	return record(arg, 'a', key, keylen, datum);
+}
+
+static int
+removed(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	return record(arg, 'r', key, keylen, datum);
+}
+
+static int
+changed(uint32_t key, size_t keylen, void *old, void *new, void *arg)
+{
+	return record(arg, 'c', key, keylen, new);
+}
+
+static int
+evcmp(const void *ap, const void *bp)
+{
+	const Event *a = ap, *b = bp;
+
+	if (a->key != b->key)
+		return (a->key < b->key) ? -1 : 1;
+	if (a->keylen != b->keylen)
+		return (a->keylen < b->keylen) ? -1 : 1;
+	return 0;
+}
+
+typedef struct Probe Probe;
+struct Probe {
+	IPMap *other;
+	Events *events;
+	char missing;
+};
+
+// The slow way: look each key of one map up in the other.
+static int
+probe(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Probe *p = arg;
+	void *found = ipmapfind(p->other, key, keylen);
+
+	if (found == NULL)
+		record(p->events, p->missing, key, keylen, datum);
+	else if (found != datum && p->missing == 'r')
+		record(p->events, 'c', key, keylen, found);
+
+	return 0;
+}
+
+static void
+testdiff(IPMap *a, IPMap *b)
+{
+	static const IPMapDiff ops = { added, removed, changed };
+	static Events got, want;
+	Probe p;
+
+	memset(&got, 0, sizeof(got));
+	memset(&want, 0, sizeof(want));
+	ipmapdiff(a, b, &ops, &got);
+	p.events = &want;
+	p.other = b;
+	p.missing = 'r';
+	ipmapdo(a, probe, &p);
+	p.other = a;
+	p.missing = 'a';
+	ipmapdo(b, probe, &p);
+	qsort(want.ev, want.n, sizeof(Event), evcmp);
+	if (got.n != want.n)
+		fail("diff: wrong number of differences");
+	for (size_t k = 0; k < got.n; k++)
+		if (evcmp(&got.ev[k], &want.ev[k]) != 0 ||
+		    got.ev[k].what != want.ev[k].what ||
+		    got.ev[k].datum != want.ev[k].datum)
+			fail("diff: wrong difference");
+
+	// Stopping early, and diffing a map against itself.
+	memset(&got, 0, sizeof(got));
+	got.stopafter = 3;
+	ipmapdiff(a, b, &ops, &got);
+	if (want.n >= 3 && got.n != 3)
+		fail("diff: did not stop");
+	memset(&got, 0, sizeof(got));
+	ipmapdiff(a, a, &ops, &got);
+	if (got.n != 0)
+		fail("diff: map differs from itself");
+}
+
+typedef struct Check Check;
+struct Check {
+	IPMap *a, *b, *result;
+	int both;
+	size_t n;
+};
+
+// Every key of a merge must be in the right inputs, with a's datum.
+static int
+checkmerged(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Check *c = arg;
+	void *fa = ipmapfind(c->a, key, keylen);
+	void *fb = ipmapfind(c->b, key, keylen);
+
+	c->n++;
+	if (datum != ((fa != NULL) ? fa : fb))
+		fail("merge: wrong datum");
+	if (c->both && (fa == NULL || fb == NULL))
+		fail("intersection: key not in both");
+	return 0;
+}
+
+// And every key of the inputs that should be in it, is.
+static int
+checkinput(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Check *c = arg;
+
+	if (c->both && (ipmapfind(c->a, key, keylen) == NULL ||
+	    ipmapfind(c->b, key, keylen) == NULL))
+		return 0;
+	if (ipmapfind(c->result, key, keylen) == NULL)
+		fail("merge: key missing");
+	return 0;
+}
+
+static void
+testmerge(IPMap *a, IPMap *b, int both)
+{
+	size_t live = ipmaplivenodes();
+	IPMapStats st;
+	Check c;
+
+	c.a = a;
+	c.b = b;
+	c.both = both;
+	c.n = 0;
+	c.result = both ? ipmapintersect(a, b) : ipmapunion(a, b);
+	ipmapdo(c.result, checkmerged, &c);
+	ipmapdo(a, checkinput, &c);
+	ipmapdo(b, checkinput, &c);
+	ipmapstats(c.result, &st);
+	if (st.data != c.n)
+		fail("merge: wrong count");
+	freeipmap(c.result, nofree);
+	if (ipmaplivenodes() != live)
+		fail("merge: nodes leaked");
+}
+
+// The slow way: try every shorter prefix of the key.
+static int
+checkcover(uint32_t key, size_t keylen, void *datum, void *cover, void *arg)
+{
+	IPMap *b = arg;
+	void *want = NULL;
+
+	for (size_t len = keylen + 1; len-- > 0 && want == NULL;)
+		want = ipmapfind(b, key & ~hostbits(len), len);
+	if (cover != want)
+		fail("coveredby: wrong cover");
+	return 0;
+}
+
+static int
+countcalls(uint32_t key, size_t keylen, void *datum, void *cover, void *arg)
+{
+	size_t *n = arg;
+
+	(*n)++;
+	return 0;
+}
+
+static void
+testcoveredby(IPMap *a, IPMap *b)
+{
+	IPMapStats st;
+	size_t n = 0;
+
+	ipmapcoveredby(a, b, checkcover, b);
+	ipmapcoveredby(a, b, countcalls, &n);
+	ipmapstats(a, &st);
+	if (n != st.data)
+		fail("coveredby: wrong number of keys");
+}
+
+int
+main(void)
+{
+	IPMap *a, *b, *empty;
+
+	for (int round = 0; round < 20; round++) {
+		mkmaps(&a, &b);
+		testdiff(a, b);
+		testmerge(a, b, 0);
+		testmerge(a, b, 1);
+		testcoveredby(a, b);
+		testcoveredby(b, a);
+		freeipmap(a, nofree);
+		freeipmap(b, nofree);
+	}
+
+	mkmaps(&a, &b);
+	empty = mkipmap();
+	testdiff(a, empty);
+	testdiff(empty, b);
+	testmerge(a, empty, 0);
+	testmerge(empty, b, 1);
+	testcoveredby(a, empty);
+	freeipmap(a, nofree);
+	freeipmap(b, nofree);
+	freeipmap(empty, nofree);
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 
 #include "dat.h"
 #include "lib.h"
+#include "testlib.h"
 
 
 IPMap root, a, b, c, d, e;
@@ -79,10 +80,27 @@ test(const char *key, uint32_t keylen, const char *expected)
 	}
 }
 
+// A lone host route sits directly under the root with all 32 bits.
+void
+testlonehost(void)
+{
+	IPMap *map = mkipmap();
+
+	ipmapinsert(map, mkkey("5.6.7.8"), 32, (void *)av);
+	if (ipmapfind(map, mkkey("5.6.7.8"), 32) != av)
+		printf("ipmapfind of a lone host route failed\n");
+	if (ipmapnearest(map, mkkey("5.6.7.8"), 32) != av)
+		printf("ipmapnearest of a lone host route failed\n");
+	if (ipmapfind(map, mkkey("5.6.7.9"), 32) != NULL)
+		printf("ipmapfind of a missing host route succeeded\n");
+	freeipmap(map, nofree);
+}
+
 int
 main(void)
 {
 	setup();
+	testlonehost();
 
 	test("44.0.0.1", 24, NULL);
 	test("44.0.0.1", 32, av);
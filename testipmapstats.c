@@ -0,0 +1,122 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "testlib.h"
+
+static const char *av = "a", *bv = "b", *cv = "c", *dv = "d";
+
+static uint32_t
+mkkey(const char *addr)
+{
+	return ntohl(inet_addr(addr));
+}
+
+static void
+expect(const char *what, size_t got, size_t want)
+{
+	if (got != want) {
+		printf("%s: got %zu, want %zu\n", what, got, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+//
+// 44/8 holds 44.0.0.1/32 on the left and, on the right, a node
+// without data splitting 44.130/16 from 44.131/16:
+//
+//	root -> 44/8 -> 44.0.0.1/32
+//	             -> 44.130/15 -> 44.130/16
+//	                          -> 44.131/16
+//
+static void
+testshape(void)
+{
+	size_t live = ipmaplivenodes();
+	IPMapStats st;
+	IPMap *map;
+
+	map = mkipmap();
+	ipmapinsert(map, mkkey("44.0.0.0"), 8, (void *)av);
+	ipmapinsert(map, mkkey("44.130.0.0"), 16, (void *)bv);
+	ipmapinsert(map, mkkey("44.131.0.0"), 16, (void *)cv);
+	ipmapinsert(map, mkkey("44.0.0.1"), 32, (void *)dv);
+	ipmapstats(map, &st);
+	expect("nodes", st.nodes, 6);
+	expect("live nodes", ipmaplivenodes() - live, 6);
+	expect("data", st.data, 4);
+	expect("bytes", st.bytes, 6*sizeof(IPMap));
+	expect("max depth", st.maxdepth, 3);
+	expect("depth 0", st.depth[0], 0);
+	expect("depth 1", st.depth[1], 1);
+	expect("depth 2", st.depth[2], 1);
+	expect("depth 3", st.depth[3], 2);
+
+	// Removing 44.131/16 folds the split node into 44.130/16.
+	ipmapremove(map, mkkey("44.131.0.0"), 16);
+	ipmapstats(map, &st);
+	expect("nodes after remove", st.nodes, 4);
+	expect("data after remove", st.data, 3);
+	expect("max depth after remove", st.maxdepth, 2);
+	expect("depth 2 after remove", st.depth[2], 2);
+	expect("depth 3 after remove", st.depth[3], 0);
+
+	freeipmap(map, nofree);
+	expect("live nodes after free", ipmaplivenodes(), live);
+}
+
+static void
+testempty(void)
+{
+	IPMapStats st;
+	IPMap *map;
+
+	map = mkipmap();
+	ipmapstats(map, &st);
+	expect("empty nodes", st.nodes, 1);
+	expect("empty data", st.data, 0);
+	expect("empty max depth", st.maxdepth, 0);
+	freeipmap(map, nofree);
+}
+
+// Only meaningful when lib.c is built with IPMAP_STATS.
+static void
+testvisits(void)
+{
+	uint64_t calls[IPMAP_NOPS], visits[IPMAP_NOPS];
+	uint64_t calls2[IPMAP_NOPS], visits2[IPMAP_NOPS];
+	IPMap *map;
+
+	map = mkipmap();
+	ipmapinsert(map, mkkey("44.0.0.0"), 8, (void *)av);
+	ipmapinsert(map, mkkey("44.130.0.0"), 16, (void *)bv);
+	if (!ipmapvisits(calls, visits)) {
+		for (int k = 0; k < IPMAP_NOPS; k++)
+			if (calls[k] != 0 || visits[k] != 0)
+				expect("visits without IPMAP_STATS", 1, 0);
+		freeipmap(map, nofree);
+		return;
+	}
+	ipmapfind(map, mkkey("44.130.0.0"), 16);
+	ipmapvisits(calls2, visits2);
+	expect("find calls", calls2[IPMAP_FIND] - calls[IPMAP_FIND], 1);
+	expect("find visits", visits2[IPMAP_FIND] - visits[IPMAP_FIND], 3);
+	freeipmap(map, nofree);
+}
+
+int
+main(void)
+{
+	testshape();
+	testempty();
+	testvisits();
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "testlib.h"
+
+typedef struct Keys Keys;
+
+enum {
+	NKEYS = 1000,
+};
+
+struct Keys {
+	IPMapEntry e[NKEYS];
+	size_t n;
+	uint32_t key;		// The prefix to select under.
+	size_t keylen;
+	int inside;		// Select under it, or everything else.
+};
+
+static int data[NKEYS];
+static uint32_t seed = 44;
+
+static int
+under(uint32_t key, size_t keylen, uint32_t net, size_t netlen)
+{
+	return netlen <= keylen && ((key ^ net) & ~hostbits(netlen)) == 0;
+}
+
+static int
+collect(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Keys *k = arg;
+
+	if (under(key, keylen, k->key, k->keylen) != k->inside)
+		return 0;
+	if (k->n == NKEYS)
+		fail("too many keys");
+	k->e[k->n].key = key;
+	k->e[k->n].keylen = keylen;
+	k->e[k->n++].datum = datum;
+	return 0;
+}
+
+static int
+samekeys(const Keys *a, const Keys *b)
+{
+	if (a->n != b->n)
+		return 0;
+	for (size_t k = 0; k < a->n; k++)
+		if (a->e[k].key != b->e[k].key ||
+		    a->e[k].keylen != b->e[k].keylen ||
+		    a->e[k].datum != b->e[k].datum)
+			return 0;
+	return 1;
+}
+
+// A map of exactly these keys, shaped as it should be.
+static IPMap *
+mkexpected(const Keys *keys)
+{
+	static IPMapEntry e[NKEYS];
+	IPMap *map = mkipmap();
+
+	memcpy(e, keys->e, keys->n*sizeof(e[0]));
+	ipmapbuild(map, e, keys->n);
+	return map;
+}
+
+//
+// Select under prefixes that are in the map, that split a node,
+// that fall between keys and that miss entirely, and check the
+// walk against a filtered full walk and the removal against maps
+// built from what should go and what should stay.
+//
+static void
+testrandom(void)
+{
+	static Keys want, got, rest;
+	size_t live = ipmaplivenodes();
+
+	for (int round = 0; round < 500; round++) {
+		IPMap *map, *gone, *expgone, *exprest;
+		size_t n = (seed >> 8) % NKEYS;
+
+		map = mkipmap();
+		for (size_t k = 0; k < n; k++) {
+			seed = seed*1103515245 + 12345;
+			size_t keylen = 1 + (seed >> 8) % 32;
+			seed = seed*1103515245 + 12345;
+			uint32_t key = (seed & 0xC3F0F000) & ~hostbits(keylen);
+			ipmapinsert(map, key, keylen, &data[k]);
+		}
+		if (round % 10 == 0)
+			ipmapinsert(map, 0, 0, &data[0]);
+		seed = seed*1103515245 + 12345;
+		want.keylen = (round % 50 == 0) ? 0 : (seed >> 8) % 17;
+		seed = seed*1103515245 + 12345;
+		want.key = (seed & 0xC3F0F000) & ~hostbits(want.keylen);
+		want.inside = 1;
+		want.n = 0;
+		ipmapdotopdown(map, collect, &want);
+		rest = want;
+		rest.inside = 0;
+		rest.n = 0;
+		ipmapdotopdown(map, collect, &rest);
+
+		got = want;
+		got.n = 0;
+		ipmapsubtreedo(map, want.key, want.keylen, collect, &got);
+		if (!samekeys(&got, &want))
+			fail("subtree walk (round %d)", round);
+
+		gone = ipmapsubtreeremove(map, want.key, want.keylen);
+		if ((gone == NULL) != (want.n == 0))
+			fail("remove found the wrong subtree (round %d)",
+			    round);
+		expgone = mkexpected(&want);
+		exprest = mkexpected(&rest);
+		if (gone != NULL && !sametree(gone, expgone))
+			fail("removed subtree misshapen (round %d)", round);
+		if (!sametree(map, exprest))
+			fail("remaining map misshapen (round %d)", round);
+		if (ipmapsubtreeremove(map, want.key, want.keylen) != NULL)
+			fail("removed twice (round %d)", round);
+		freeipmap(gone, nofree);
+		freeipmap(expgone, nofree);
+		freeipmap(exprest, nofree);
+		freeipmap(map, nofree);
+		if (ipmaplivenodes() != live)
+			fail("nodes leaked (round %d)", round);
+	}
+}
+
+int
+main(void)
+{
+	testrandom();
+
+	return 0;
+}
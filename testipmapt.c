@@ -0,0 +1,149 @@
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "ipmapt.h"
+#include "lib.h"
+#include "testlib.h"
+
+IPMAP_DEFINE(ptrmap, void *)
+IPMAP_DEFINE(flagmap, uint8_t)
+
+typedef struct Walk Walk;
+
+enum {
+	NDATA = 256,
+	NOPS = 100000,
+};
+
+struct Walk {
+	ptrmap *typed;
+	ptrmapiter it;
+	size_t n;
+};
+
+static int data[NDATA];
+
+//
+// The generic map's top-down walk and the typed map's iterator must
+// meet the same keys in the same order.
+//
+static int
+step(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Walk *w = arg;
+
+	if (!ptrmapnext(&w->it) || w->it.key != key ||
+	    w->it.keylen != keylen || *w->it.value != datum)
+		fail("walks differ");
+	w->n++;
+	return 0;
+}
+
+//
+// Random operations on a typed map and an IPMap side by side.
+//
+static void
+testagainstipmap(void)
+{
+	uint32_t seed = 44;
+	ptrmap *typed;
+	IPMap *map;
+	IPMapStats st, want;
+	Walk w;
+
+	typed = mkptrmap();
+	map = mkipmap();
+	for (int op = 0; op < NOPS; op++) {
+		seed = seed*1103515245 + 12345;
+		size_t keylen = (seed >> 8) % 33;
+		seed = seed*1103515245 + 12345;
+		uint32_t key = seed & 0xF3C0F00F & ipmaptmask(keylen);
+		void *datum = &data[(seed >> 4) % NDATA];
+		void *old, **p;
+
+		switch ((seed >> 24) % 4) {
+		case 0:
+		case 1:
+			p = ptrmapinsert(typed, key, keylen, datum);
+			if (*p != ipmapinsert(map, key, keylen, datum))
+				fail("insert (op %d)", op);
+			break;
+		case 2:
+			old = ipmapremove(map, key, keylen);
+			if (ptrmapremove(typed, key, keylen, &datum) !=
+			    (old != NULL) || (old != NULL && datum != old))
+				fail("remove (op %d)", op);
+			break;
+		case 3:
+			p = ptrmapfind(typed, key, keylen);
+			if ((p ? *p : NULL) != ipmapfind(map, key, keylen))
+				fail("find (op %d)", op);
+			p = ptrmapnearest(typed, key | 0x7, 32);
+			if ((p ? *p : NULL) != ipmapnearest(map, key | 0x7, 32))
+				fail("nearest (op %d)", op);
+			break;
+		}
+		if (op % 5000 != 0)
+			continue;
+		w.typed = typed;
+		w.n = 0;
+		ptrmapwalk(typed, &w.it);
+		ipmapdotopdown(map, step, &w);
+		if (ptrmapnext(&w.it) || w.n != typed->n)
+			fail("walk lengths differ (op %d)", op);
+		ptrmapstats(typed, &st);
+		ipmapstats(map, &want);
+		if (st.data != typed->n || st.data != want.data ||
+		    st.maxdepth > IPMAP_MAXDEPTH)
+			fail("stats differ (op %d)", op);
+	}
+	freeptrmap(typed);
+	freeipmap(map, nofree);
+}
+
+//
+// Small values live in the node, and a zero value is still there.
+//
+static void
+testflags(void)
+{
+	flagmap *flags;
+	flagmapiter it;
+	uint8_t old;
+	size_t n = 0;
+
+	flags = mkflagmap();
+	flagmapinsert(flags, 0x2C000000, 8, 0);
+	flagmapinsert(flags, 0x2C800000, 9, 1);
+	flagmapinsert(flags, 0x2C000000, 8, 2);
+	if (flagmapfind(flags, 0x2C000000, 8) == NULL ||
+	    *flagmapfind(flags, 0x2C000000, 8) != 0)
+		fail("zero value lost or replaced");
+	if (flagmapfind(flags, 0x2C000000, 9) != NULL)
+		fail("found a key never inserted");
+	if (*flagmapnearest(flags, 0x2C800001, 32) != 1)
+		fail("nearest flag");
+	for (flagmapwalk(flags, &it); flagmapnext(&it);)
+		n += 1 + *it.value;
+	if (n != 3 || flags->n != 2)
+		fail("flag walk");
+	if (!flagmapremove(flags, 0x2C000000, 8, &old) || old != 0 ||
+	    flagmapremove(flags, 0x2C000000, 8, &old))
+		fail("flag remove");
+	freeflagmap(flags);
+}
+
+int
+main(void)
+{
+	testagainstipmap();
+	testflags();
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib.h"
+#include "testlib.h"
+
+// A free function for maps whose data the test owns.
+void
+nofree(void *datum)
+{
+}
+
+// Print the failure, formatted as by printf(), and exit.
+void
+fail(const char *restrict fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	exit(EXIT_FAILURE);
+}
+
+// The host bits of a prefix 'keylen' bits long.
+uint32_t
+hostbits(size_t keylen)
+{
+	return (keylen == 0) ? 0xFFFFFFFF : ((uint32_t)1 << (32 - keylen)) - 1;
+}
+
+//
+// Two tries must agree node for node, not just in what they find.
+//
+int
+sametree(const IPMap *a, const IPMap *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return a->key == b->key && a->keylen == b->keylen &&
+	    a->datum == b->datum &&
+	    sametree(a->left, b->left) && sametree(a->right, b->right);
+}
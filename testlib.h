@@ -0,0 +1,17 @@
+#ifndef RIPD_TESTLIB_H
+#define RIPD_TESTLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib.h"
+
+/*
+ * Helpers shared by the tests and benchmarks.
+ */
+void nofree(void *datum);
+void fail(const char *restrict fmt, ...);
+uint32_t hostbits(size_t keylen);
+int sametree(const IPMap *a, const IPMap *b);
+
+#endif
@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+enum {
+	MAX_LINES = 8192,
+	FLOOD = 10000,
+};
+
+static char *lines[MAX_LINES];
+static int levels[MAX_LINES];
+static atomic_int nlines;
+static atomic_int blocked;
+static atomic_int blocking;
+
+static void
+collect(int level, const char *msg)
+{
+	int n = atomic_load(&nlines);
+
+	if (atomic_load(&blocking)) {
+		struct timespec ts = { 0, 1000000 };
+		atomic_store(&blocked, 1);
+		while (atomic_load(&blocking))
+			nanosleep(&ts, NULL);
+	}
+	assert(n < MAX_LINES);
+	lines[n] = strdup(msg);
+	levels[n] = level;
+	atomic_store(&nlines, n + 1);
+}
+
+static void
+reset(void)
+{
+	for (int k = 0; k < atomic_load(&nlines); k++)
+		free(lines[k]);
+	atomic_store(&nlines, 0);
+}
+
+static void
+expect(int k, int level, const char *want)
+{
+	if (k >= atomic_load(&nlines)) {
+		printf("missing line %d: \"%s\"\n", k, want);
+		exit(EXIT_FAILURE);
+	}
+	if (levels[k] != level || strcmp(lines[k], want) != 0) {
+		printf("line %d: got <%d> \"%s\", want <%d> \"%s\"\n",
+		    k, levels[k], lines[k], level, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+testformat(void)
+{
+	char want[256], name[300];
+	uint32_t u32 = 0xC0000201;
+	uint64_t u64 = 1234567890123ULL;
+	const char *nullstr = NULL;
+
+	memset(name, 'x', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+
+	startlogger();
+	logmsg(LOG_INFO, "Added route %s/%d via %s", "44.0.0.0", 8, "gif3");
+	logmsg(LOG_NOTICE, "%-*s|%5.2f|%c|%%|%zu|%zd", 6, "ab", 2.5, 'q',
+	    (size_t)42, (ssize_t)-7);
+	logmsg(LOG_DEBUG, "%08" PRIx32 " %" PRIu64 " %s", u32, u64, nullstr);
+	errno = ENOENT;
+	logmsg(LOG_WARNING, "cannot open %s: %m", "/nonexistent");
+	logmsg(LOG_INFO, "long %s", name);
+	logmsg(LOG_INFO, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+	    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14);
+	stoplogger();
+
+	expect(0, LOG_INFO, "Added route 44.0.0.0/8 via gif3");
+	expect(1, LOG_NOTICE, "ab    | 2.50|q|%|42|-7");
+	snprintf(want, sizeof(want), "%08" PRIx32 " %" PRIu64 " (null)",
+	    u32, u64);
+	expect(2, LOG_DEBUG, want);
+	snprintf(want, sizeof(want), "cannot open /nonexistent: %s",
+	    strerror(ENOENT));
+	expect(3, LOG_WARNING, want);
+	// Long strings are truncated, not lost.
+	if (strncmp(lines[4], "long xxxx", 9) != 0 ||
+	    strlen(lines[4]) >= strlen(name)) {
+		printf("bad long line \"%s\"\n", lines[4]);
+		exit(EXIT_FAILURE);
+	}
+	// Conversions past the argument limit are left as written.
+	expect(5, LOG_INFO, "1 2 3 4 5 6 7 8 9 10 11 12 %d %d");
+	assert(atomic_load(&nlines) == 6);
+	reset();
+}
+
+void
+testoverflow(void)
+{
+	struct timespec ts = { 0, 1000000 };
+	uint64_t dropped;
+	int n;
+
+	startlogger();
+	atomic_store(&blocking, 1);
+	logmsg(LOG_INFO, "first");
+	while (!atomic_load(&blocked))
+		nanosleep(&ts, NULL);
+	for (int k = 0; k < FLOOD; k++)
+		logmsg(LOG_INFO, "flood %d", k);
+	dropped = logdropped();
+	atomic_store(&blocking, 0);
+	stoplogger();
+
+	n = atomic_load(&nlines);
+	if (dropped == 0 || (uint64_t)n != 1 + FLOOD - dropped + 1) {
+		printf("%d lines with %" PRIu64 " dropped of %d\n",
+		    n, dropped, 1 + FLOOD);
+		exit(EXIT_FAILURE);
+	}
+	expect(0, LOG_INFO, "first");
+	// The newest messages are the ones dropped.
+	expect(1, LOG_INFO, "flood 0");
+	char want[64];
+	snprintf(want, sizeof(want), "log ring full: %" PRIu64
+	    " messages dropped", dropped);
+	expect(n - 1, LOG_WARNING, want);
+	reset();
+}
+
+int
+main(void)
+{
+	setlogsink(collect);
+	testformat();
+	testoverflow();
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "rip.h"
+
+static const char *password = "pLaInTeXtpAsSwD";
+
+void
+testrequest(void)
+{
+	octet buf[512];
+	RIPPacket pkt;
+	RIPResponse whole;
+	size_t n;
+
+	assert(mkriprequest(buf, 10, password) == 0);
+	n = mkriprequest(buf, sizeof buf, password);
+	if (n != MIN_RIP_PACKET_SIZE + 2*RIP_RESPONSE_SIZE) {
+		printf("request length %zu\n", n);
+		exit(EXIT_FAILURE);
+	}
+	memset(&pkt, 0, sizeof(pkt));
+	assert(parserippkt(buf, n, &pkt) == 0);
+	assert(pkt.command == RIP_CMD_REQUEST);
+	assert(pkt.version == RIP_VERSION_2);
+	if (verifyripauth(&pkt, password) < 0) {
+		printf("request authentication failed\n");
+		exit(EXIT_FAILURE);
+	}
+	assert(verifyripauth(&pkt, "wrong") < 0);
+	assert(pkt.nresponse == 1);
+	memset(&whole, 0, sizeof(whole));
+	assert(parseripresponse(&pkt, 0, &whole) == 0);
+	assert(whole.addrfamily == 0);
+	assert(whole.metric == RIP_METRIC_INFINITY);
+}
+
+void
+testresponse(void)
+{
+	octet buf[512];
+	RIPPacket pkt;
+	RIPResponse in[3], out;
+	size_t n;
+
+	memset(in, 0, sizeof(in));
+	for (int k = 0; k < 3; k++) {
+		in[k].addrfamily = 2;
+		in[k].routetag = 44;
+		in[k].ipaddr = 0x2C000000 | (k << 8);
+		in[k].subnetmask = 0xFFFFFF00;
+		in[k].nexthop = 0xC0000201 + k;
+		in[k].metric = 1;
+	}
+	assert(mkripresponse(buf, 60, password, in, 3) == 0);
+	n = mkripresponse(buf, sizeof buf, password, in, 3);
+	memset(&pkt, 0, sizeof(pkt));
+	assert(parserippkt(buf, n, &pkt) == 0);
+	assert(pkt.command == RIP_CMD_RESPONSE);
+	assert(verifyripauth(&pkt, password) == 0);
+	if (pkt.nresponse != 3) {
+		printf("response count %zu\n", pkt.nresponse);
+		exit(EXIT_FAILURE);
+	}
+	for (int k = 0; k < 3; k++) {
+		memset(&out, 0, sizeof(out));
+		assert(parseripresponse(&pkt, k, &out) == 0);
+		if (memcmp(&in[k], &out, sizeof(out)) != 0) {
+			printf("response %d did not round trip\n", k);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int
+main(void)
+{
+	testrequest();
+	testresponse();
+
+	return 0;
+}
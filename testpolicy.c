@@ -0,0 +1,215 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "policy.h"
+#include "testlib.h"
+
+static char ACCEPT[] = "accept", IGNORE[] = "ignore";
+
+static uint32_t
+mkkey(const char *addr)
+{
+	return ntohl(inet_addr(addr));
+}
+
+static void
+failnet(const char *what, uint32_t net, int cidr)
+{
+	struct in_addr in;
+
+	in.s_addr = htonl(net);
+	fail("%s: %s/%d", what, inet_ntoa(in), cidr);
+}
+
+static uint32_t
+mask(int cidr)
+{
+	return (cidr == 0) ? 0 : ~(uint32_t)0 << (32 - cidr);
+}
+
+// Prefixes drawn from a small space, so that they nest and collide.
+static void
+randprefix(uint32_t *net, int *cidr)
+{
+	static const int lens[] = { 0, 8, 12, 16, 20, 24, 28, 32 };
+
+	*cidr = lens[random() % (sizeof(lens)/sizeof(lens[0]))];
+	*net = (44u << 24 | (random() & 0x0F0F0F)) & mask(*cidr);
+}
+
+//
+// The compiled policy must agree with the trie it replaced,
+// including when the same prefix is given twice.
+//
+static void
+testlookup(void)
+{
+	Policy *policy = mkpolicy();
+	IPMap *ref = mkipmap();
+
+	for (int k = 0; k < 2000; k++) {
+		uint32_t net;
+		int cidr, accept = random() & 1;
+		randprefix(&net, &cidr);
+		policyadd(policy, net, cidr, accept);
+		ipmapinsert(ref, net, cidr, accept ? ACCEPT : IGNORE);
+	}
+	policycompile(policy);
+	for (int k = 0; k < 100000; k++) {
+		uint32_t net;
+		int cidr;
+		randprefix(&net, &cidr);
+		net |= random() & ~mask(cidr);
+		net &= mask(cidr);
+		if (policyaccepts(policy, net, cidr) !=
+		    (ipmapnearest(ref, net, cidr) == ACCEPT))
+			failnet("lookup disagrees", net, cidr);
+	}
+	freeipmap(ref, nofree);
+	freepolicy(policy);
+}
+
+static void
+testfirstwins(void)
+{
+	Policy *policy = mkpolicy();
+
+	policyadd(policy, mkkey("44.0.0.0"), 8, 1);
+	policyadd(policy, mkkey("44.1.0.0"), 16, 0);
+	policyadd(policy, mkkey("44.1.2.3"), 16, 1);	// Duplicate.
+	policycompile(policy);
+	if (policy->size != 2)
+		failnet("duplicate kept", mkkey("44.1.0.0"), 16);
+	if (policyaccepts(policy, mkkey("44.1.2.0"), 24))
+		failnet("second duplicate won", mkkey("44.1.2.0"), 24);
+	if (!policyaccepts(policy, mkkey("44.2.0.0"), 16))
+		failnet("not accepted", mkkey("44.2.0.0"), 16);
+	if (policyaccepts(policy, mkkey("10.0.0.0"), 8))
+		failnet("uncovered accepted", mkkey("10.0.0.0"), 8);
+	freepolicy(policy);
+}
+
+typedef struct DiffState DiffState;
+struct DiffState {
+	const Policy *old;
+	const Policy *new;
+	IPMap *changed;
+};
+
+static void
+collect(uint32_t net, int cidr, void *arg)
+{
+	DiffState *state = arg;
+
+	ipmapinsert(state->changed, net, cidr, ACCEPT);
+}
+
+//
+// Every prefix the two policies judge differently must lie within
+// a prefix the diff reports.
+//
+static void
+testdiff(void)
+{
+	Policy *old = mkpolicy(), *new;
+	DiffState state;
+
+	for (int k = 0; k < 500; k++) {
+		uint32_t net;
+		int cidr;
+		randprefix(&net, &cidr);
+		policyadd(old, net, cidr, random() & 1);
+	}
+	new = duppolicy(old);
+	policycompile(old);
+	for (int k = 0; k < 20; k++) {
+		uint32_t net;
+		int cidr;
+		randprefix(&net, &cidr);
+		policyadd(new, net, cidr, random() & 1);
+	}
+	policycompile(new);
+	state.old = old;
+	state.new = new;
+	state.changed = mkipmap();
+	policydiff(old, new, collect, &state);
+	for (int k = 0; k < 100000; k++) {
+		uint32_t net;
+		int cidr;
+		randprefix(&net, &cidr);
+		if (policyaccepts(old, net, cidr) !=
+		    policyaccepts(new, net, cidr) &&
+		    ipmapnearest(state.changed, net, cidr) == NULL)
+			failnet("change not reported", net, cidr);
+	}
+	if (policydiff(old, old, collect, &state) != 0)
+		fail("policy differs from itself");
+	freeipmap(state.changed, nofree);
+	freepolicy(old);
+	freepolicy(new);
+}
+
+static void
+testread(void)
+{
+	char path[] = "/tmp/testpolicy.XXXXXX";
+	const char *rules =
+	    "# AMPR\n"
+	    "accept 44.0.0.0/8\n"
+	    "\n"
+	    "ignore\t44.128.0.0/10   # not ours\n"
+	    "accept 44.130.0.0/16\n";
+	Policy *policy;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	fputs(rules, fp);
+	fclose(fp);
+	policy = mkpolicy();
+	if (policyread(policy, path) < 0)
+		fail("read failed");
+	policycompile(policy);
+	if (policy->size != 3)
+		fail("wrong rule count: %zu", policy->size);
+	if (!policyaccepts(policy, mkkey("44.1.0.0"), 16) ||
+	    policyaccepts(policy, mkkey("44.129.0.0"), 16) ||
+	    !policyaccepts(policy, mkkey("44.130.1.0"), 24))
+		fail("wrong verdict from file");
+	freepolicy(policy);
+
+	// A bad line rejects the whole file.
+	fp = fopen(path, "w");
+	fputs("accept 44.0.0.0/8\nallow 44.1.0.0/16\n", fp);
+	fclose(fp);
+	policy = mkpolicy();
+	if (policyread(policy, path) == 0 || policy->size != 0)
+		fail("bad file accepted");
+	freepolicy(policy);
+	unlink(path);
+}
+
+int
+main(void)
+{
+	srandom(44);
+	testlookup();
+	testfirstwins();
+	testdiff();
+	testread();
+
+	return 0;
+}
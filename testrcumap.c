@@ -0,0 +1,263 @@
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "rcu.h"
+#include "testlib.h"
+
+typedef struct Entry Entry;
+typedef struct Walk Walk;
+
+enum {
+	NENTRIES = 512,
+	NREADERS = 4,
+	NUPDATES = 200000,
+};
+
+// Each datum records its own key, so readers can check what they find.
+struct Entry {
+	uint32_t key;
+	size_t keylen;
+};
+
+struct Walk {
+	uint32_t keys[NENTRIES];
+	size_t keylens[NENTRIES];
+	size_t n;
+	int bad;
+};
+
+static Entry entries[NENTRIES];
+static atomic_int done;
+static atomic_uint seeds = 1;
+
+//
+// Prefixes crowded into 44/8 and its neighbours, at lengths that
+// make the trie split, merge and nest.
+//
+static void
+mkentries(void)
+{
+	uint32_t seed = 44;
+
+	for (size_t k = 0; k < NENTRIES; k++) {
+		seed = seed*1103515245 + 12345;
+		size_t keylen = 8 + (seed >> 8) % 25;
+		uint32_t key = 0x2C000000 | ((seed >> 4) & 0x01FFFFFF);
+		if (k % 64 == 0)
+			keylen = 4 + k % 5;
+		entries[k].keylen = keylen;
+		entries[k].key = key & ~(uint32_t)0 << (32 - keylen);
+	}
+}
+
+static int
+collect(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Entry *e = datum;
+	Walk *w = arg;
+
+	if (e->key != key || e->keylen != keylen)
+		w->bad = 1;
+	if (w->n < NENTRIES) {
+		w->keys[w->n] = key;
+		w->keylens[w->n] = keylen;
+	}
+	w->n++;
+
+	return 1;
+}
+
+static int
+samewalk(const Walk *a, const Walk *b)
+{
+	if (a->n != b->n || a->bad || b->bad)
+		return 0;
+	for (size_t k = 0; k < a->n; k++)
+		if (a->keys[k] != b->keys[k] || a->keylens[k] != b->keylens[k])
+			return 0;
+	return 1;
+}
+
+//
+// The same updates applied to a plain IPMap and an RCUMap must give
+// the same answers and the same tree, and a tree held by a reader
+// must not change underneath it.
+//
+static void
+testequiv(void)
+{
+	size_t live = ipmaplivenodes();
+	Walk *a, *b, *pinned;
+	RCUReader *reader;
+	IPMap *plain, *snap;
+	uint32_t seed = 7;
+	RCUMap *map;
+
+	a = calloc(3, sizeof(Walk));
+	if (a == NULL)
+		fail("malloc");
+	b = a + 1;
+	pinned = a + 2;
+	plain = mkipmap();
+	map = mkrcumap();
+	reader = rcuregister(map);
+	for (int k = 0; k < 20000; k++) {
+		seed = seed*1103515245 + 12345;
+		Entry *e = &entries[(seed >> 8) % NENTRIES];
+		void *x, *y;
+		if ((seed >> 20) % 3 != 0) {
+			x = ipmapinsert(plain, e->key, e->keylen, e);
+			y = rcuinsert(map, e->key, e->keylen, e);
+		} else {
+			x = ipmapremove(plain, e->key, e->keylen);
+			y = rcuremove(map, e->key, e->keylen);
+		}
+		if (x != y)
+			fail("update results differ");
+		if (k % 1000 != 0)
+			continue;
+
+		// Pin the tree, change the map, and look again.
+		snap = rculock(reader);
+		memset(pinned, 0, sizeof(*pinned));
+		ipmapdo(snap, collect, pinned);
+		e = &entries[k % NENTRIES];
+		x = rcuremove(map, e->key, e->keylen);
+		if (x == NULL)
+			rcuinsert(map, e->key, e->keylen, e);
+		for (int j = 0; j < 1000; j++)
+			rcudefer(map, NULL, nofree);
+		memset(b, 0, sizeof(*b));
+		ipmapdo(snap, collect, b);
+		if (!samewalk(pinned, b))
+			fail("pinned tree changed");
+		rcuunlock(reader);
+		if (x != NULL)
+			rcuinsert(map, e->key, e->keylen, x);
+		else
+			rcuremove(map, e->key, e->keylen);
+
+		memset(a, 0, sizeof(*a));
+		memset(b, 0, sizeof(*b));
+		ipmapdo(plain, collect, a);
+		ipmapdo(rcuroot(map), collect, b);
+		if (!samewalk(a, b))
+			fail("trees differ");
+		for (size_t j = 0; j < NENTRIES; j += 7) {
+			uint32_t key = entries[j].key | 0x55;
+			if (ipmapnearest(plain, key, 32) !=
+			    ipmapnearest(rcuroot(map), key, 32))
+				fail("nearest differs");
+		}
+	}
+	rcureclaim(map);
+	if (rcupending(map) != 0)
+		fail("retired nodes left with no readers");
+	rcuunregister(reader);
+	freeipmap(plain, nofree);
+	freercumap(map, nofree);
+	if (ipmaplivenodes() != live)
+		fail("nodes leaked");
+	free(a);
+}
+
+static int
+covers(const Entry *net, uint32_t key)
+{
+	uint32_t mask = ~(uint32_t)0 << (32 - net->keylen);
+
+	return net->keylen == 0 || ((net->key ^ key) & mask) == 0;
+}
+
+static void *
+reader(void *arg)
+{
+	uint32_t seed = atomic_fetch_add(&seeds, 1);
+	RCUReader *r;
+	Walk *w;
+
+	w = malloc(sizeof(*w));
+	r = rcuregister(arg);
+	if (w == NULL || r == NULL)
+		fail("reader setup");
+	while (!atomic_load(&done)) {
+		IPMap *root = rculock(r);
+		for (int k = 0; k < 64; k++) {
+			seed = seed*1103515245 + 12345;
+			Entry *e = &entries[(seed >> 8) % NENTRIES];
+			Entry *found = ipmapfind(root, e->key, e->keylen);
+			if (found != NULL && (found->key != e->key ||
+			    found->keylen != e->keylen))
+				fail("reader found the wrong datum");
+			found = ipmapnearest(root, e->key | 0x7, 32);
+			if (found != NULL && !covers(found, e->key))
+				fail("reader's nearest does not cover the key");
+		}
+		memset(w, 0, sizeof(*w));
+		ipmapdo(root, collect, w);
+		if (w->bad)
+			fail("reader walked into a torn tree");
+		rcuunlock(r);
+	}
+	rcuunregister(r);
+	free(w);
+
+	return NULL;
+}
+
+//
+// Readers look up and walk while the writer churns the map; they
+// must only ever see entries under their own keys.  Built with
+// -fsanitize=address or thread, this also shows nothing is freed
+// while a reader can still reach it.
+//
+static void
+testconcurrent(void)
+{
+	pthread_t threads[NREADERS];
+	size_t live = ipmaplivenodes();
+	uint32_t seed = 11;
+	RCUMap *map;
+
+	map = mkrcumap();
+	atomic_store(&done, 0);
+	for (int k = 0; k < NREADERS; k++)
+		if (pthread_create(&threads[k], NULL, reader, map) != 0)
+			fail("pthread_create");
+	for (int k = 0; k < NUPDATES; k++) {
+		seed = seed*1103515245 + 12345;
+		Entry *e = &entries[(seed >> 8) % NENTRIES];
+		if ((seed >> 20) % 2 == 0)
+			rcuinsert(map, e->key, e->keylen, e);
+		else
+			rcuremove(map, e->key, e->keylen);
+	}
+	atomic_store(&done, 1);
+	for (int k = 0; k < NREADERS; k++)
+		pthread_join(threads[k], NULL);
+	rcureclaim(map);
+	if (rcupending(map) != 0)
+		fail("retired nodes left after readers left");
+	freercumap(map, nofree);
+	if (ipmaplivenodes() != live)
+		fail("nodes leaked under readers");
+}
+
+int
+main(void)
+{
+	mkentries();
+	testequiv();
+	testconcurrent();
+
+	return 0;
+}
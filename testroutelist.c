@@ -0,0 +1,115 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+
+enum {
+	NROUTES = 64,
+};
+
+static int failed;
+
+//
+// Walk the list both ways: every route's 'rprev' must point at the
+// link that led to it, and the list must hold exactly the routes
+// marked in 'on'.
+//
+static void
+checklist(Tunnel *tunnel, Route *routes, const int *on, const char *what)
+{
+	Route **link = &tunnel->routes;
+	int n = 0, want = 0;
+
+	for (Route *r = tunnel->routes; r != NULL; r = r->rnext) {
+		if (r->rprev != link || !on[r - routes] ||
+		    r->tunnel != tunnel || r->gateway != tunnel->outer_remote) {
+			printf("%s: route %td misplaced\n", what, r - routes);
+			failed = 1;
+			return;
+		}
+		link = &r->rnext;
+		n++;
+	}
+	for (int k = 0; k < NROUTES; k++) {
+		want += on[k];
+		if (!on[k] && routes[k].tunnel == tunnel &&
+		    (routes[k].rprev != NULL || routes[k].gateway != 0)) {
+			printf("%s: route %d not unlinked\n", what, k);
+			failed = 1;
+		}
+	}
+	if (n != want || tunnel->nref != want) {
+		printf("%s: %d routes, nref %d, expected %d\n", what, n,
+		    tunnel->nref, want);
+		failed = 1;
+	}
+}
+
+int
+main(void)
+{
+	static Route routes[NROUTES];
+	static int on[NROUTES], onb[NROUTES];
+	Tunnel a, b;
+	uint32_t seed = 44;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.outer_remote = 0x0A000001;
+	b.outer_remote = 0x0A000002;
+	for (int k = 0; k < NROUTES; k++) {
+		routes[k].ipnet = 0x2C000000 | k << 8;
+		routes[k].subnetmask = 0xFFFFFF00;
+		linkroute(&a, &routes[k]);
+		on[k] = 1;
+	}
+	checklist(&a, routes, on, "link");
+
+	// Unlink from the head, the tail and the middle, and twice.
+	for (int k = 0; k < 4*NROUTES; k++) {
+		int r;
+
+		seed = seed*1103515245 + 12345;
+		r = (seed >> 8) % NROUTES;
+		unlinkroute(&a, &routes[r]);
+		on[r] = 0;
+		checklist(&a, routes, on, "unlink");
+	}
+	for (int k = 0; k < NROUTES; k++) {
+		unlinkroute(&a, &routes[k]);
+		on[k] = 0;
+	}
+	checklist(&a, routes, on, "unlink all");
+	if (a.routes != NULL)
+		failed = 1;
+
+	// Move routes between tunnels, as when a route's gateway changes.
+	for (int k = 0; k < NROUTES; k++) {
+		linkroute(&a, &routes[k]);
+		on[k] = 1;
+	}
+	for (int k = 0; k < 4*NROUTES; k++) {
+		int r;
+
+		seed = seed*1103515245 + 12345;
+		r = (seed >> 8) % NROUTES;
+		if (on[r]) {
+			unlinkroute(&a, &routes[r]);
+			linkroute(&b, &routes[r]);
+		} else {
+			unlinkroute(&b, &routes[r]);
+			linkroute(&a, &routes[r]);
+		}
+		on[r] = !on[r];
+		onb[r] = !on[r];
+		checklist(&a, routes, on, "move");
+		checklist(&b, routes, onb, "move");
+	}
+	unlinkroute(NULL, &routes[0]);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
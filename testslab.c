@@ -0,0 +1,207 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "slab.h"
+
+enum {
+	NOBJS = 2000,		// Several pages of either slab.
+	NCHURN = 100000,
+};
+
+static int failed;
+
+//
+// Each object and hot record holds its number in the reference
+// array, so a scan can tell which it visited.
+//
+typedef struct Obj Obj;
+struct Obj {
+	size_t id;
+	char pad[40];
+};
+
+typedef struct Scan Scan;
+struct Scan {
+	Obj **objs;
+	unsigned char *seen;
+	size_t n;
+	size_t stopat;		// Stop after this many, if non-zero.
+};
+
+static int
+visit(void *hot, void *obj, void *arg)
+{
+	Scan *s = arg;
+	Obj *o = obj;
+
+	if (o->id >= NOBJS || s->objs[o->id] != o ||
+	    *(size_t *)hot != o->id || slabhot(o) != hot)
+	{
+		printf("scan: stray object %p\n", obj);
+		failed = 1;
+		return 1;
+	}
+	if (s->seen[o->id]++ != 0) {
+		printf("scan: object %zu visited twice\n", o->id);
+		failed = 1;
+	}
+	s->n++;
+	return s->stopat != 0 && s->n == s->stopat ? 2 : 0;
+}
+
+static void
+checkscan(Slab *slab, Obj **objs, const char *what)
+{
+	static unsigned char seen[NOBJS];
+	Scan s = { objs, seen, 0, 0 };
+	size_t want = 0;
+
+	memset(seen, 0, sizeof(seen));
+	if (slabscan(slab, visit, &s) != 0) {
+		printf("%s: scan stopped\n", what);
+		failed = 1;
+	}
+	for (size_t k = 0; k < NOBJS; k++) {
+		if (objs[k] != NULL)
+			want++;
+		if ((objs[k] != NULL) != seen[k]) {
+			printf("%s: object %zu %s\n", what, k,
+			    seen[k] ? "freed but visited" : "not visited");
+			failed = 1;
+		}
+	}
+	if (s.n != want || slab->nlive != want) {
+		printf("%s: %zu visited, %zu live, expected %zu\n", what, s.n,
+		    slab->nlive, want);
+		failed = 1;
+	}
+}
+
+static Obj *
+alloc(Slab *slab, Obj **objs, size_t id)
+{
+	Obj *o = slaballoc(slab);
+	size_t *hot = slabhot(o);
+	const char *p = (const char *)o;
+
+	for (size_t k = 0; k < sizeof(*o); k++)
+		if (p[k] != 0) {
+			printf("object %zu not zeroed\n", id);
+			failed = 1;
+			break;
+		}
+	if (*hot != 0) {
+		printf("hot record %zu not zeroed\n", id);
+		failed = 1;
+	}
+	if (((uintptr_t)o & (_Alignof(Obj) - 1)) != 0 ||
+	    ((uintptr_t)hot & (_Alignof(size_t) - 1)) != 0) {
+		printf("object %zu misaligned\n", id);
+		failed = 1;
+	}
+	memset(o, 0xA5, sizeof(*o));
+	o->id = id;
+	*hot = id;
+	objs[id] = o;
+	return o;
+}
+
+static void
+testchurn(void)
+{
+	static Obj *objs[NOBJS];
+	Slab *slab = mkslab(sizeof(Obj), sizeof(size_t));
+	Scan s = { objs, NULL, 0, 10 };
+	static unsigned char seen[NOBJS];
+	uint32_t seed = 44;
+	size_t npages;
+
+	for (size_t k = 0; k < NOBJS; k++)
+		alloc(slab, objs, k);
+	npages = slab->npages;
+	if (npages != (NOBJS + slab->nperpage - 1) / slab->nperpage) {
+		printf("%zu pages for %d objects of %zu a page\n", npages,
+		    NOBJS, slab->nperpage);
+		failed = 1;
+	}
+	checkscan(slab, objs, "filled");
+
+	// Every other object freed, then each freed slot reused.
+	for (size_t k = 0; k < NOBJS; k += 2) {
+		slabfree(slab, objs[k]);
+		objs[k] = NULL;
+	}
+	checkscan(slab, objs, "halved");
+	for (size_t k = 0; k < NOBJS; k += 2)
+		alloc(slab, objs, k);
+	checkscan(slab, objs, "refilled");
+	if (slab->npages != npages) {
+		printf("grew to %zu pages reusing freed objects\n",
+		    slab->npages);
+		failed = 1;
+	}
+
+	// Random frees and allocations, checking that the objects and
+	// hot records written by alloc() never overlap.
+	for (size_t k = 0; k < NCHURN; k++) {
+		size_t id = (seed = seed*1664525 + 1013904223) >> 8;
+
+		id %= NOBJS;
+		if (objs[id] != NULL) {
+			slabfree(slab, objs[id]);
+			objs[id] = NULL;
+		} else
+			alloc(slab, objs, id);
+	}
+	checkscan(slab, objs, "churned");
+
+	// A non-zero return stops the scan and is returned.
+	s.seen = seen;
+	if (slabscan(slab, visit, &s) != 2 || s.n != 10) {
+		printf("scan not stopped after %zu\n", s.stopat);
+		failed = 1;
+	}
+	freeslab(slab);
+}
+
+//
+// Routes keep their expiry time in the slab's hot record, apart
+// from the fields of the route.
+//
+static void
+testroutes(void)
+{
+	static Route *routes[NOBJS];
+	Slab *slab = mkslab(sizeof(Route), sizeof(time_t));
+
+	for (size_t k = 0; k < NOBJS; k++) {
+		routes[k] = slaballoc(slab);
+		routes[k]->ipnet = 0x2C000000 + ((uint32_t)k << 8);
+		setrouteexpires(routes[k], 1000 + k);
+	}
+	for (size_t k = 0; k < NOBJS; k++) {
+		Route *r = routes[k];
+		if (routeexpires(r) != (time_t)(1000 + k) ||
+		    r->ipnet != 0x2C000000 + ((uint32_t)k << 8) ||
+		    r->tunnel != NULL || r->rnext != NULL) {
+			printf("route %zu: expires %lld\n", k,
+			    (long long)routeexpires(r));
+			failed = 1;
+		}
+	}
+	freeslab(slab);
+}
+
+int
+main(void)
+{
+	testchurn();
+	testroutes();
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,316 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "lib.h"
+#include "tbm.h"
+#include "testlib.h"
+
+enum {
+	NKEYS = 2048,
+	MAXENTRIES = 4096,
+};
+
+typedef struct Prefix Prefix;
+struct Prefix {
+	uint32_t key;
+	size_t keylen;
+};
+
+static const char *rv = "root";
+static const char *av = "a";
+static const char *bv = "b";
+static const char *cv = "c";
+static const char *dv = "d";
+static const char *ev = "e";
+
+static int failed;
+
+static uint32_t
+mkkey(const char *addr)
+{
+	return ntohl(inet_addr(addr));
+}
+
+static uint32_t
+netmask(size_t keylen)
+{
+	return (keylen == 0) ? 0 : 0xFFFFFFFF << (32 - keylen);
+}
+
+static void
+report(const char *fmt, const char *key, size_t keylen)
+{
+	printf(fmt, key, keylen);
+	printf("\n");
+	failed = 1;
+}
+
+static void
+testfind(TBMap *map, const char *key, size_t keylen, const char *expected)
+{
+	if (tbmapfind(map, mkkey(key), keylen) != expected)
+		report("tbmapfind %s/%zu", key, keylen);
+}
+
+static void
+testnearest(TBMap *map, const char *key, size_t keylen,
+    const char *expected)
+{
+	if (tbmapnearest(map, mkkey(key), keylen) != expected)
+		report("tbmapnearest %s/%zu", key, keylen);
+}
+
+//
+// The maps of testipmapfind and testipmapnearest, built by insertion
+// rather than by hand, with the same questions.
+//
+static void
+testcases(void)
+{
+	TBMap *map = mktbmap();
+
+	tbmapinsert(map, mkkey("5.6.7.8"), 32, (void *)av);
+	testfind(map, "5.6.7.8", 32, av);
+	testnearest(map, "5.6.7.8", 32, av);
+	testfind(map, "5.6.7.9", 32, NULL);
+	tbmapremove(map, mkkey("5.6.7.8"), 32);
+
+	tbmapinsert(map, mkkey("44.0.0.1"), 32, (void *)av);
+	tbmapinsert(map, mkkey("44.130.0.0"), 16, (void *)bv);
+	tbmapinsert(map, mkkey("44.130.24.0"), 24, (void *)cv);
+	tbmapinsert(map, mkkey("44.130.130.0"), 24, (void *)dv);
+	tbmapinsert(map, mkkey("44.130.24.25"), 32, (void *)ev);
+	testfind(map, "44.0.0.1", 24, NULL);
+	testfind(map, "44.0.0.1", 32, av);
+	testfind(map, "44.130.24.25", 32, ev);
+	testfind(map, "44.130.24.1", 32, NULL);
+	testfind(map, "44.188.0.1", 32, NULL);
+	testfind(map, "44.130.130.0", 24, dv);
+	testfind(map, "44.130.130.0", 27, NULL);
+	testfind(map, "44.130.131.0", 27, NULL);
+	testfind(map, "44.130.24.0", 24, cv);
+
+	tbmapinsert(map, mkkey("44.0.0.0"), 8, (void *)rv);
+	testnearest(map, "130.0.0.1", 32, NULL);
+	testnearest(map, "44.0.0.1", 24, rv);
+	testnearest(map, "44.0.0.12", 32, rv);
+	testnearest(map, "44.0.0.1", 32, av);
+	testnearest(map, "44.130.24.25", 32, ev);
+	testnearest(map, "44.130.24.1", 32, cv);
+	testnearest(map, "44.188.0.1", 32, rv);
+	testnearest(map, "44.130.130.0", 24, dv);
+	testnearest(map, "44.130.130.0", 27, dv);
+	testnearest(map, "44.130.131.0", 27, bv);
+	testnearest(map, "44.130.24.0", 24, cv);
+
+	if (tbmapinsert(map, mkkey("44.130.24.0"), 24, (void *)av) != cv)
+		report("tbmapinsert %s/%zu replaced", "44.130.24.0", 24);
+	if (tbmapremove(map, mkkey("44.130.24.0"), 23) != NULL)
+		report("tbmapremove %s/%zu", "44.130.24.0", 23);
+	if (tbmapcount(map) != 6) {
+		printf("tbmapcount %zu, expected 6\n", tbmapcount(map));
+		failed = 1;
+	}
+	freetbmap(map, nofree);
+}
+
+typedef struct Walk Walk;
+struct Walk {
+	Prefix seen[MAXENTRIES];
+	void *data[MAXENTRIES];
+	size_t n;
+};
+
+static int
+record(uint32_t key, size_t keylen, void *datum, void *arg)
+{
+	Walk *w = arg;
+
+	assert(w->n < MAXENTRIES);
+	w->seen[w->n].key = key;
+	w->seen[w->n].keylen = keylen;
+	w->data[w->n] = datum;
+	w->n++;
+	return 0;
+}
+
+static int
+samewalk(const Walk *a, const Walk *b)
+{
+	if (a->n != b->n)
+		return 0;
+	for (size_t k = 0; k < a->n; k++)
+		if (a->seen[k].key != b->seen[k].key ||
+		    a->seen[k].keylen != b->seen[k].keylen ||
+		    a->data[k] != b->data[k])
+			return 0;
+	return 1;
+}
+
+//
+// Random inserts and removes, clustered so that prefixes share
+// nodes, against an IPMap given the same updates: every lookup
+// must agree, and a walk must see the same prefixes in the same
+// order as ipmapdotopdown().
+//
+static void
+testrandom(void)
+{
+	static Prefix keys[NKEYS];
+	static int data[NKEYS];
+	static Walk want, got;
+	uint32_t seed = 44;
+	IPMap *ref = mkipmap();
+	TBMap *map = mktbmap();
+	size_t live = 0;
+
+	for (size_t k = 0; k < NKEYS; k++) {
+		seed = seed*1103515245 + 12345;
+		keys[k].keylen = (seed >> 8) % 33;
+		seed = seed*1103515245 + 12345;
+		keys[k].key = (seed & 0xFF1F3F0F) & netmask(keys[k].keylen);
+	}
+	for (int round = 0; round < 40; round++) {
+		for (int op = 0; op < 500; op++) {
+			size_t k;
+			void *v, *w;
+
+			seed = seed*1103515245 + 12345;
+			k = (seed >> 8) % NKEYS;
+			if ((seed >> 28) < ((round % 4 == 3) ? 12 : 7)) {
+				v = NULL;
+				if (ipmapfind(ref, keys[k].key,
+				    keys[k].keylen) != NULL)
+					v = ipmapremove(ref, keys[k].key,
+					    keys[k].keylen);
+				w = tbmapremove(map, keys[k].key,
+				    keys[k].keylen);
+				live -= (v != NULL);
+			} else {
+				v = ipmapfind(ref, keys[k].key,
+				    keys[k].keylen);
+				live += (v == NULL);
+				v = ipmapinsert(ref, keys[k].key,
+				    keys[k].keylen, &data[k]);
+				w = tbmapinsert(map, keys[k].key,
+				    keys[k].keylen, &data[k]);
+			}
+			if (v != w) {
+				printf("update %" PRIx32 "/%zu: %p != %p\n",
+				    keys[k].key, keys[k].keylen, w, v);
+				failed = 1;
+			}
+		}
+		if (tbmapcount(map) != live) {
+			printf("round %d: %zu prefixes, expected %zu\n",
+			    round, tbmapcount(map), live);
+			failed = 1;
+		}
+		for (int q = 0; q < 2000; q++) {
+			uint32_t key;
+			size_t keylen;
+
+			seed = seed*1103515245 + 12345;
+			key = seed & 0xFF1F3FFF;
+			seed = seed*1103515245 + 12345;
+			keylen = (seed >> 8) % 33;
+			if (tbmapnearest(map, key, keylen) !=
+			    ipmapnearest(ref, key, keylen) ||
+			    tbmapfind(map, key, keylen) !=
+			    ipmapfind(ref, key & netmask(keylen), keylen)) {
+				printf("lookup %" PRIx32 "/%zu differs\n",
+				    key, keylen);
+				failed = 1;
+			}
+		}
+		want.n = got.n = 0;
+		ipmapdotopdown(ref, record, &want);
+		tbmapdo(map, record, &got);
+		if (!samewalk(&want, &got)) {
+			printf("round %d: walks differ\n", round);
+			failed = 1;
+		}
+	}
+	freeipmap(ref, nofree);
+	freetbmap(map, nofree);
+}
+
+//
+// The updates of testipmapinsert: insert every prefix in a file,
+// then remove them in order, checking the rest after each.
+//
+static void
+testfile(const char *path)
+{
+	static Prefix prefixes[MAXENTRIES];
+	static int data[MAXENTRIES];
+	char buf[256];
+	size_t n = 0;
+	TBMap *map;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		failed = 1;
+		return;
+	}
+	map = mktbmap();
+	while (fgets(buf, sizeof buf, fp) != NULL) {
+		char *bp = buf;
+		char *ip = strsep(&bp, " \t\r\n");
+		char *mask = strsep(&bp, " \t\r\n");
+		assert(ip != NULL && mask != NULL && n < MAXENTRIES);
+		prefixes[n].key = mkkey(ip);
+		prefixes[n].keylen = netmask2cidr(mkkey(mask));
+		if (tbmapinsert(map, prefixes[n].key, prefixes[n].keylen,
+		    &data[n]) != &data[n] ||
+		    tbmapfind(map, prefixes[n].key,
+		    prefixes[n].keylen) != &data[n])
+			report("%s: insert %zu", path, n);
+		n++;
+	}
+	fclose(fp);
+	for (size_t k = 0; k < n; k++) {
+		if (tbmapremove(map, prefixes[k].key,
+		    prefixes[k].keylen) != &data[k])
+			report("%s: remove %zu", path, k);
+		for (size_t j = k + 1; j < n; j++)
+			if (tbmapfind(map, prefixes[j].key,
+			    prefixes[j].keylen) != &data[j])
+				report("%s: find %zu", path, j);
+	}
+	if (tbmapcount(map) != 0)
+		report("%s: %zu left", path, tbmapcount(map));
+	freetbmap(map, nofree);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *files[] = {
+		"testdata/testipmapinsert.data",
+		"testdata/testipmapinsert.data2",
+		"testdata/testipmapinsert.data3",
+	};
+
+	testcases();
+	testrandom();
+	if (argc > 1) {
+		for (int k = 1; k < argc; k++)
+			testfile(argv[k]);
+	} else {
+		for (size_t k = 0; k < sizeof(files)/sizeof(files[0]); k++)
+			testfile(files[k]);
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}